@@ -46,9 +46,11 @@ array set auditmsgs {
 }
 
 #
-# Drive the audit
+# Drive the audit.  If share is 1, this is one share of the packages being
+#  audited by a separate process for another nsbd, so the number of errors
+#  is written to standard output for it instead of being reported.
 #
-proc auditpackages {packagelist} {
+proc auditpackages {packagelist {share 0}} {
     global auditTotalErrors
     set auditTotalErrors 0
 
@@ -57,16 +59,62 @@ proc auditpackages {packagelist} {
     applyCmdkeys cmdContents nsb
 
     set packagelist [expandRegisteredPackages $packagelist "-audit"]
+
+    #
+    # Audit shares of the packages in separate processes if parallelPackages
+    #   is set.  Auditing extra files needs the paths of all the packages
+    #   together, so that is always done here.
+    #
+    global auditextra
+    if {!$auditextra && [parallelnsbquery -auditShare \
+		[groupPackagesByInstallTop $packagelist] \
+		[llength $packagelist] outputs]} {
+	foreach output $outputs {
+	    # each process ends its output with its own number of errors
+	    set stdout [lindex $output 0]
+	    if {[regexp "(^|\n)auditErrors: (\[0-9\]+)\n\$" $stdout \
+						    line x numErrors]} {
+		set stdout [string range $stdout 0 \
+			[expr {[string length $stdout] - \
+				[string length $line] + [string length $x] - 1}]]
+		incr auditTotalErrors $numErrors
+	    } else {
+		# the process failed before it finished
+		incr auditTotalErrors
+	    }
+	    puts -nonewline $stdout
+	    puts -nonewline stderr [lindex $output 1]
+	}
+	updatemsg "Audit completed with $auditTotalErrors errors"
+	return
+    }
+
+    global auditchecksig
+    if {$auditchecksig} {
+	# check all the signatures at the same time if possible; the
+	#   good ones are then found in the signatureCache
+	set nsbStoreFiles ""
+	foreach package $packagelist {
+	    catch {eval lappend nsbStoreFiles [findNsbStoreFiles $package]}
+	}
+	if {[catch {pgpCheckFiles $nsbStoreFiles} message] != 0} {
+	    debugmsg "couldn't check the signatures together: $message"
+	}
+    }
+
     foreach package $packagelist {
 	auditpackage $package cmdContents
     }
 
-    global auditextra
     if {$auditextra} {
 	auditextras $packagelist cmdContents
     }
 
-    updatemsg "Audit completed with $auditTotalErrors errors"
+    if {$share} {
+	puts "auditErrors: $auditTotalErrors"
+    } else {
+	updatemsg "Audit completed with $auditTotalErrors errors"
+    }
 }
 
 #
@@ -231,6 +279,7 @@ proc auditpackage {package cmdContentsname} {
 		continue
 	    }
 	    set mdType $nupContents(mdType)
+	    set table $nupContents(pathTable)
 	    set reloadPaths ""
 	    if {$auditrepair} {
 		set temporaryTop [getTemporaryTop $installTop $package]
@@ -268,8 +317,8 @@ proc auditpackage {package cmdContentsname} {
 			}
 			continue
 		    }
-		    if {[info exists nupContents([list paths $path linkTo])]} {
-			set link [relativeLinkPath $nupContents([list paths $path linkTo]) $path]
+		    if {[pathtable exists $table $path linkTo]} {
+			set link [relativeLinkPath [pathtable get $table $path linkTo] $path]
 			if {($statb(type) != "link") || 
 					([file readlink $fname] != $link)} {
 			    if {$auditrepair} {
@@ -284,8 +333,8 @@ proc auditpackage {package cmdContentsname} {
 			auditok $path symlinked "to $link"
 			continue
 		    }
-		    if {[info exists nupContents([list paths $path hardLinkTo])]} {
-			set link $nupContents([list paths $path hardLinkTo])
+		    if {[pathtable exists $table $path hardLinkTo]} {
+			set link [pathtable get $table $path hardLinkTo]
 			set flink [file join $installTop $link]
 			if {[catch {file lstat $flink statb2} string] != 0} {
 			    debugmsg "lstat error $string"
@@ -311,7 +360,7 @@ proc auditpackage {package cmdContentsname} {
 			lappend reloadPaths $path
 			continue
 		    }
-		    set length $nupContents([list paths $path length])
+		    set length [pathtable get $table $path length]
 		    if {$statb(size) != $length} {
 			auditerror $path wronglength $length
 			lappend reloadPaths $path
@@ -328,14 +377,14 @@ proc auditpackage {package cmdContentsname} {
 			    fconfigure $fd -translation binary
 			    set mdData [$mdType -chan $fd]
 			}
-			set checksum $nupContents([list paths $path $mdType])
+			set checksum [pathtable get $table $path digest]
 			if {[lindex $mdData 1] != $checksum} {
 			    auditerror $path badchecksum
 			    lappend reloadPaths $path
 			    continue
 			}
 		    }
-		    set mode $nupContents([list paths $path mode])
+		    set mode [pathtable get $table $path mode]
 		    if {[auditgroupandperm]} {
 			auditok $path file
 		    }
@@ -353,8 +402,8 @@ proc auditpackage {package cmdContentsname} {
 		set newpaths ""
 		foreach path $nupContents(paths) {
 		    if {[lsearch -exact $reloadPaths $path] >= 0} {
-			foreach k "loadPath linkTo hardLinkTo length $mdType mode" {
-			    catch {unset nupContents([list paths $path $k])}
+			foreach k "loadPath linkTo hardLinkTo length digest mode" {
+			    pathtable unset $table $path $k
 			}
 		    } else {
 			lappend newpaths $path
@@ -379,6 +428,7 @@ proc auditpackage {package cmdContentsname} {
 				$storeExecutableTypes($nsbStoreName) \
 				$storeVersions($nsbStoreName)
 		    upvar 0 oldnupContents nupContents
+		    set table $nupContents(pathTable)
 		}
 	    }
 
@@ -404,9 +454,9 @@ proc auditpackage {package cmdContentsname} {
 		    setknownPath $package $path
 		    # add backup paths too if present
 		    #
-		    if {[info exists nupContents([list paths $path backupPath])]} {
+		    if {[pathtable exists $table $path backupPath]} {
 			setknownPath $package \
-				$nupContents([list paths $path backupPath])
+				[pathtable get $table $path backupPath]
 		    }
 		}
 	    }
@@ -0,0 +1,436 @@
+#
+# Long-running client for the -pollDaemon option.  It polls each registered
+#   package when its minPollPeriod has elapsed, the same as running -poll
+#   from cron, but the configuration, the registry, the signatures already
+#   checked and the rest of what -poll loads stay in memory from one poll
+#   to the next.  Packages that come due together are polled together so
+#   that their '.nsb' files can be fetched over one connection.  Requests to
+#   poll or update packages right away are taken on a socket.  Tcl has no
+#   Unix domain sockets, so it is a TCP port on the loopback address, and
+#   because any user on the computer can connect to that, the first line
+#   from each connection has to be the random key that is written to a
+#   file only the user running the daemon can read.
+#
+# A package whose poll fails is polled again after pollDaemonRetrySeconds,
+#   twice as long after each failure in a row, up to its minPollPeriod.
+#
+# The polls are scheduled on a timer wheel of pollDaemonWheelSize slots of
+#   pollDaemonTickSeconds each, which moves on one slot every tick.  Each
+#   package is put in the slot of the tick at or after its next poll time,
+#   and one that isn't due until a later turn of the wheel is left there.
+#
+# Copyright (C) 1996-2003 by Dave Dykstra and Lucent Technologies
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# If those terms are not sufficient for you, contact the author to
+# discuss the possibility of an alternate license.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+set pollDaemonTickSeconds 60
+set pollDaemonWheelSize 1024
+set pollDaemonRetrySeconds 300
+set pollDaemonKeyFile "pollDaemon.key"
+
+#
+# Poll packages and take requests on address, which is a port number
+#  optionally preceded by a host name or address and a colon.  Does not
+#  return until pollDaemonStop is set by a "stop" request.
+#
+proc pollDaemon {address} {
+    if {![regexp {^(([^:]*):)?([0-9]+)$} $address x y host port]} {
+	nsbderror "-pollDaemon parameter must be \[host:\]port, got $address"
+    }
+    if {$host == ""} {
+	set host "127.0.0.1"
+    }
+    if {($host != "localhost") && ![string match "127.*" $host]} {
+	nsbderror "-pollDaemon only takes requests from the same computer, so its host must be localhost or 127.0.0.1"
+    }
+    set keyFile [pollDaemonMakeKey]
+    alwaysEvalFor "" {file delete -force $keyFile} {
+	set listener [notrace {socket -server pollDaemonAccept \
+						-myaddr $host $port}]
+	noticemsg "Taking poll requests on $host:$port with the key in $keyFile"
+
+	global pollDaemonQueue pollDaemonBusy pollDaemonStop
+	set pollDaemonQueue ""
+	set pollDaemonBusy 0
+	catch {unset pollDaemonStop}
+	pollDaemonScheduleAll
+	pollDaemonTick
+	vwait pollDaemonStop
+	close $listener
+    }
+    noticemsg "Stopped taking poll requests"
+}
+
+#
+# Write a new random key into pollDaemonKeyFile in the nsbdpath directory,
+#  readable only by this user, and return the file name
+#
+proc pollDaemonMakeKey {} {
+    global cfgContents pollDaemonKey pollDaemonKeyFile
+    if {![info exists cfgContents(nsbdpath)] ||
+					($cfgContents(nsbdpath) == "")} {
+	nsbderror "-pollDaemon needs an nsbdpath to put its key file in"
+    }
+    withOpen fd "/dev/urandom" "r" {
+	fconfigure $fd -translation binary
+	binary scan [read $fd 16] H* pollDaemonKey
+    }
+    set keyFile [file join $cfgContents(nsbdpath) $pollDaemonKeyFile]
+    file delete -force $keyFile
+    set fd [notrace {open $keyFile {WRONLY CREAT EXCL} 0600}]
+    alwaysEvalFor $keyFile {close $fd} {
+	puts $fd $pollDaemonKey
+    }
+    return $keyFile
+}
+
+#
+# Put all the registered packages on the timer wheel
+#
+proc pollDaemonScheduleAll {} {
+    global pollDaemonWheel pollDaemonNext
+    catch {unset pollDaemonWheel}
+    catch {unset pollDaemonNext}
+    foreach package [nrdPackages] {
+	pollDaemonSchedule $package
+    }
+}
+
+#
+# Put package on the timer wheel at its next poll time, unless it is
+#  never polled or is already there at that time.  failed is 1 after a
+#  poll of the package failed, and succeeded is 1 after one worked.
+#
+proc pollDaemonSchedule {package {failed 0} {succeeded 0}} {
+    global pollDaemonWheel pollDaemonNext pollDaemonLastTick
+    global pollDaemonTickSeconds pollDaemonWheelSize
+    global pollDaemonFailures pollDaemonRetryTime pollDaemonRetrySeconds
+    if {[catch {minPollSeconds $package} minPollSeconds] != 0} {
+	errormsg $minPollSeconds
+	set minPollSeconds 0
+    }
+    if {$minPollSeconds == 0} {
+	catch {unset pollDaemonNext($package)}
+	catch {unset pollDaemonFailures($package)}
+	catch {unset pollDaemonRetryTime($package)}
+	return
+    }
+    set when [clock seconds]
+    set lastTimePolled [nrdLookup $package lastTimePolled]
+    if {$lastTimePolled != ""} {
+	set nextTime [expr {[scanAnyTime $lastTimePolled] + $minPollSeconds}]
+	if {$nextTime > $when} {
+	    set when $nextTime
+	}
+    }
+    if {$failed} {
+	# a failed poll doesn't change lastTimePolled, so without waiting
+	#   longer it would be polled again on the next tick
+	set failures [incr pollDaemonFailures($package)]
+	set delay $minPollSeconds
+	if {$failures <= 16} {
+	    set retry [expr {$pollDaemonRetrySeconds << ($failures - 1)}]
+	    if {$retry < $delay} {
+		set delay $retry
+	    }
+	}
+	set pollDaemonRetryTime($package) [expr {[clock seconds] + $delay}]
+    } elseif {$succeeded} {
+	catch {unset pollDaemonFailures($package)}
+	catch {unset pollDaemonRetryTime($package)}
+    }
+    if {[info exists pollDaemonRetryTime($package)] &&
+			($pollDaemonRetryTime($package) > $when)} {
+	set when $pollDaemonRetryTime($package)
+    }
+    if {[info exists pollDaemonNext($package)] &&
+			($pollDaemonNext($package) == $when)} {
+	return
+    }
+    set pollDaemonNext($package) $when
+    # any entry for an earlier time is skipped when its slot comes up
+    set tick [expr {($when + $pollDaemonTickSeconds - 1) / \
+						$pollDaemonTickSeconds}]
+    if {[info exists pollDaemonLastTick] && ($tick <= $pollDaemonLastTick)} {
+	set tick [expr {$pollDaemonLastTick + 1}]
+    }
+    lappend pollDaemonWheel([expr {$tick % $pollDaemonWheelSize}]) \
+						    [list $tick $when $package]
+}
+
+#
+# Move the timer wheel on to the current tick and queue a poll of the
+#  packages that have come due
+#
+proc pollDaemonTick {} {
+    global pollDaemonWheel pollDaemonNext pollDaemonLastTick pollDaemonBusy
+    global pollDaemonTickSeconds pollDaemonWheelSize
+    set now [clock seconds]
+    set nowTick [expr {$now / $pollDaemonTickSeconds}]
+    after [expr {(($nowTick + 1) * $pollDaemonTickSeconds - $now) * 1000}] \
+								pollDaemonTick
+    if {!$pollDaemonBusy} {
+	pollDaemonRefresh
+    }
+    if {![info exists pollDaemonLastTick] ||
+	    ($nowTick - $pollDaemonLastTick > $pollDaemonWheelSize)} {
+	# nothing can be more than one turn of the wheel behind
+	set pollDaemonLastTick [expr {$nowTick - $pollDaemonWheelSize}]
+    }
+    set due ""
+    while {$pollDaemonLastTick < $nowTick} {
+	set slot [expr {[incr pollDaemonLastTick] % $pollDaemonWheelSize}]
+	if {![info exists pollDaemonWheel($slot)]} {
+	    continue
+	}
+	set later ""
+	foreach entry $pollDaemonWheel($slot) {
+	    foreach {tick when package} $entry {}
+	    if {![info exists pollDaemonNext($package)] ||
+				($pollDaemonNext($package) != $when)} {
+		# rescheduled since
+		continue
+	    }
+	    if {$tick > $nowTick} {
+		# due on a later turn of the wheel
+		lappend later $entry
+		continue
+	    }
+	    lappend due $package
+	    unset pollDaemonNext($package)
+	}
+	if {$later == ""} {
+	    unset pollDaemonWheel($slot)
+	} else {
+	    set pollDaemonWheel($slot) $later
+	}
+    }
+    if {$due != ""} {
+	pollDaemonRequest [concat poll $due] ""
+    }
+}
+
+#
+# Forget everything loaded from the registry and schedule all the packages
+#  again when another nsbd has changed it
+#
+proc pollDaemonRefresh {} {
+    global nrdFileName
+    if {[file exists $nrdFileName] && [nrdFileChanged]} {
+	debugmsg "reloading $nrdFileName"
+	nrdInit
+	pollDaemonScheduleAll
+    }
+}
+
+#
+# Accept a new connection
+#
+proc pollDaemonAccept {sock addr port} {
+    debugmsg "poll request connection from $addr"
+    if {![string match "127.*" $addr]} {
+	warnmsg "refusing poll request connection from $addr"
+	catch {close $sock}
+	return
+    }
+    upvar #0 pollDaemon$sock conn
+    set conn(partial) ""
+    set conn(keyed) 0
+    fconfigure $sock -blocking off -buffering line
+    fileevent $sock readable [list pollDaemonRead $sock]
+}
+
+#
+# Read request lines from sock and queue them.  The first line has to be
+#  the key.  Lines are split here instead of by gets so that no more than
+#  pollDaemonMaxLine bytes, or the length of the key before it has been
+#  read, are held waiting for the end of a line.
+#
+set pollDaemonMaxLine 4096
+proc pollDaemonRead {sock} {
+    upvar #0 pollDaemon$sock conn
+    global pollDaemonKey pollDaemonMaxLine
+    if {[catch {read $sock $pollDaemonMaxLine} data] != 0} {
+	pollDaemonClose $sock
+	return
+    }
+    set lines [split $conn(partial)$data "\n"]
+    set last [expr {[llength $lines] - 1}]
+    set conn(partial) [lindex $lines $last]
+    foreach line [lrange $lines 0 [expr {$last - 1}]] {
+	set line [string trim $line]
+	if {$line == ""} {
+	    continue
+	}
+	if {!$conn(keyed)} {
+	    # not != because that compares strings that look like numbers
+	    #   as numbers
+	    if {[string compare $line $pollDaemonKey] != 0} {
+		warnmsg "poll request connection without the key"
+		catch {puts $sock "error: the first line must be the key"}
+		pollDaemonClose $sock
+		return
+	    }
+	    set conn(keyed) 1
+	    continue
+	}
+	if {[catch {llength $line}] != 0} {
+	    catch {puts $sock "error: badly formed request"}
+	    continue
+	}
+	pollDaemonRequest $line $sock
+    }
+    if {$conn(keyed)} {
+	set max $pollDaemonMaxLine
+    } else {
+	set max [expr {[string length $pollDaemonKey] + 1}]
+    }
+    if {[string length $conn(partial)] > $max} {
+	warnmsg "poll request line of more than $max bytes"
+	catch {puts $sock "error: line too long"}
+	pollDaemonClose $sock
+    } elseif {[eof $sock]} {
+	pollDaemonClose $sock
+    }
+}
+
+#
+# Close the request connection on sock
+#
+proc pollDaemonClose {sock} {
+    upvar #0 pollDaemon$sock conn
+    catch {close $sock}
+    catch {unset conn}
+}
+
+#
+# Queue a request, to be answered on sock if it isn't empty.  Requests are
+#  done one at a time; any that arrive or come due while one is being done
+#  wait until it is finished.
+#
+proc pollDaemonRequest {request sock} {
+    global pollDaemonQueue pollDaemonBusy
+    lappend pollDaemonQueue [list $request $sock]
+    if {!$pollDaemonBusy} {
+	after idle pollDaemonRun
+    }
+}
+
+#
+# Do all the queued requests
+#
+proc pollDaemonRun {} {
+    global pollDaemonQueue pollDaemonBusy
+    if {$pollDaemonBusy} {
+	return
+    }
+    set pollDaemonBusy 1
+    while {$pollDaemonQueue != ""} {
+	foreach {request sock} [lindex $pollDaemonQueue 0] {}
+	set pollDaemonQueue [lrange $pollDaemonQueue 1 end]
+	pollDaemonRefresh
+	set code [catch {pollDaemonDo $request} answer]
+	scratchClean
+	if {$code != 0} {
+	    # don't leave updates of a failed package to be committed
+	    #  with the next one
+	    nrdAbortUpdates
+	    errormsg "$request request failed: $answer"
+	    regsub -all "\n\[ \t\n\]*" $answer " " answer
+	    set answer "error: $answer"
+	} else {
+	    lappend answer "ok"
+	    set answer [join $answer "\n"]
+	}
+	if {$sock != ""} {
+	    catch {puts $sock $answer}
+	}
+	global pollDaemonStop
+	if {[info exists pollDaemonStop]} {
+	    # the rest are dropped
+	    break
+	}
+    }
+    set pollDaemonBusy 0
+}
+
+#
+# Do one request and return a list of lines to answer it with
+#
+proc pollDaemonDo {request} {
+    global pollDaemonNext
+    set command [lindex $request 0]
+    set packages [lrange $request 1 end]
+    switch -- $command {
+	poll - update {
+	    # packages that came due were taken off the timer wheel, so
+	    #   they have to be put back even if this fails
+	    global nsbPackageFailed nsbPackageSkipped
+	    catch {unset nsbPackageFailed}
+	    catch {unset nsbPackageSkipped}
+	    set failed 1
+	    alwaysEvalFor "" {
+		foreach package $packages {
+		    if {![nrdPackageRegistered $package]} {
+			continue
+		    }
+		    if {$failed || [info exists nsbPackageFailed($package)]} {
+			pollDaemonSchedule $package 1
+		    } elseif {[info exists nsbPackageSkipped($package)]} {
+			# its poll time hadn't come
+			pollDaemonSchedule $package
+		    } else {
+			pollDaemonSchedule $package 0 1
+		    }
+		}
+	    } {
+		set packages [expandRegisteredPackages $packages "-$command"]
+		if {$packages == ""} {
+		    nsbderror "no registered packages to $command"
+		}
+		option-$command $packages
+		set failed 0
+	    }
+	    return ""
+	}
+	schedule {
+	    global pollDaemonFailures
+	    set times ""
+	    foreach package [array names pollDaemonNext] {
+		lappend times [list $pollDaemonNext($package) $package]
+	    }
+	    set answer ""
+	    foreach time [lsort -integer -index 0 $times] {
+		set package [lindex $time 1]
+		set line "$package [httpTime [lindex $time 0]]"
+		if {[info exists pollDaemonFailures($package)]} {
+		    append line " (after $pollDaemonFailures($package) failures)"
+		}
+		lappend answer $line
+	    }
+	    return $answer
+	}
+	reload {
+	    nrdInit
+	    pollDaemonScheduleAll
+	    return ""
+	}
+	stop {
+	    global pollDaemonStop
+	    set pollDaemonStop 1
+	    return ""
+	}
+    }
+    nsbderror "unknown request \"$command\""
+}
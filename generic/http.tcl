@@ -5,6 +5,12 @@
 # security policy.
 # These procedures use a callback interface to avoid using vwait,
 # which is not defined in the safe base.
+# Modified to optionally use HTTP/1.1 persistent connections for requests
+# without a query (the -keepalive option); those connections are kept in
+# a pool per host and port and reused by later requests.  With the
+# -pipeline option as well, a request is sent on a connection that is still
+# waiting for the responses to earlier requests to the same server, and
+# its response is read after theirs.
 #
 # SCCS: @(#) http.tcl 1.10 97/10/29 16:12:55
 #
@@ -57,7 +63,18 @@ proc http_config {args} {
 	set state(error) [list $errormsg $errorInfo $errorCode]
 	set state(status) error
     }
-    catch {close $state(sock)}
+    if {[info exists state(sock)]} {
+	set reuse [expr {[info exists state(bodydone)] &&
+					($state(status) == "ok")}]
+	if {[info exists state(pipelined)]} {
+	    httpPipeDone $token $reuse
+	} elseif {$reuse} {
+	    httpPoolSocket $state(socketkey) $state(sock)
+	} else {
+	    catch {close $state(sock)}
+	}
+	unset state(sock)
+    }
     catch {after cancel $state(after)}
     if {[info exists state(-command)]} {
 	if {[catch {eval $state(-command) {$token}} err]} {
@@ -72,7 +89,11 @@ proc http_config {args} {
 proc http_reset { token {why reset} } {
     upvar #0 $token state
     set state(status) $why
-    catch {fileevent $state(sock) readable {}}
+    if {![info exists state(pipelined)]} {
+	# the connection of a pipelined request may be reading an
+	#   earlier response
+	catch {fileevent $state(sock) readable {}}
+    }
     httpFinish $token
     if {[info exists state(error)]} {
 	set errorlist $state(error)
@@ -92,6 +113,8 @@ proc http_get { url args } {
 	-blocksize 	8192
 	-validate 	0
 	-headers 	{}
+	-keepalive	0
+	-pipeline	0
 	-timeout 	0
 	state		header
 	meta		{}
@@ -101,8 +124,8 @@ proc http_get { url args } {
         body            {}
 	status		""
     }
-    set options {-blocksize -channel -command -handler -headers -progress \
-		-query -querychannel -querylength -queryprogress \
+    set options {-blocksize -channel -command -handler -headers -keepalive \
+		-pipeline -progress -query -querychannel -querylength -queryprogress \
 		-timeout -validate}
     set usage [join $options ", "]
     regsub -all -- - $options {} options
@@ -141,17 +164,6 @@ proc http_get { url args } {
     if {$state(-timeout) > 0} {
 	set state(after) [after $state(-timeout) [list http_reset $token timeout]]
     }
-    if {[info exists phost] && [string length $phost]} {
-	set srvurl $url
-	set s [socket $phost $pport]
-    } else {
-	set s [socket $host $port]
-    }
-    set state(sock) $s
-
-    # Send data in cr-lf format, but accept any line terminators
-
-    fconfigure $s -translation {auto crlf} -buffersize $state(-blocksize)
 
     set len 0
     set how GET
@@ -169,46 +181,76 @@ proc http_get { url args } {
     } elseif {$state(-validate)} {
 	set how HEAD
     }
-    puts $s "$how $srvurl HTTP/1.0"
-    puts $s "Accept: $http(-accept)"
-    puts $s "Host: $host"
-    puts $s "User-Agent: $http(-useragent)"
+    set state(how) $how
+    if {$state(-keepalive) && ($len == 0)} {
+	# only requests without a query can be simply resent if a
+	#   pooled connection turns out to have been closed by the server
+	set state(keepalive) 1
+	set version HTTP/1.1
+    } else {
+	set version HTTP/1.0
+    }
+
+    if {[info exists phost] && [string length $phost]} {
+	set srvurl $url
+	set state(socketkey) $phost:$pport
+    } else {
+	set state(socketkey) $host:$port
+    }
+    set request "$how $srvurl $version"
+    append request "\nAccept: $http(-accept)"
+    append request "\nHost: $host"
+    append request "\nUser-Agent: $http(-useragent)"
     foreach {key value} $state(-headers) {
 	regsub -all \[\n\r\]  $value {} value
 	set key [string trim $key]
 	if {[string length $key]} {
-	    puts $s "$key: $value"
+	    append request "\n$key: $value"
+	}
+    }
+    set state(request) $request
+
+    if {[info exists state(keepalive)] && $state(-pipeline)} {
+	if {[httpPipeAdd $token]} {
+	    if {! [info exists state(-command)]} {
+		http_wait $token
+	    }
+	    return $token
 	}
+	set s [httpOpen $token]
+	set state(sock) $s
+	httpPipeStart $token
+    } else {
+	set s [httpOpen $token]
+	set state(sock) $s
     }
+
+    # Send data in cr-lf format, but accept any line terminators
+
+    fconfigure $s -translation {auto crlf} -buffersize $state(-blocksize)
+
+    puts $s $request
     if {$len > 0} {
 	puts $s "Content-Length: $len"
 	# WORKAROUND ALERT: this should be {auto binary} but a bug
 	#   in the tcl8.0 base release causes that to break
 	fconfigure $s -translation {crlf binary}
 	if {[info exists state(-querychannel)]} {
+	    # the body is sent in the background a block at a time while
+	    #   the response is read, so the server can start answering a
+	    #   long request before all of it has been sent
 	    puts $s "Content-Type: application/octet-stream"
 	    puts $s ""
 	    fconfigure $state(-querychannel) -translation binary
-	    set remaining $len
-	    while {$remaining > 0} {
-		set n $state(-blocksize)
-		if {$n > $remaining} {
-		    set n $remaining
-		}
-		fcopy $state(-querychannel) $s -size $n
-		incr remaining -$n
-		eval $state(-queryprogress) \
-		    {$token $len [expr {$len - $remaining}]}
-	    }
-	    puts $s ""
+	    set state(queryremaining) $len
 	} else {
 	    puts $s "Content-Type: application/x-www-form-urlencoded"
 	    puts $s ""
 	    puts $s $state(-query)
+	    # WORKAROUND CONTINUED -- now that we're done with output to the
+	    #   socket, set both the input and output to auto 
+	    fconfigure $s -translation auto
 	}
-	# WORKAROUND CONTINUED -- now that we're done with output to the
-	#   socket, set both the input and output to auto 
-	fconfigure $s -translation auto
     } else {
 	puts $s ""
     }
@@ -220,11 +262,207 @@ proc http_get { url args } {
     catch {fconfigure $s -blocking off}
 
     fileevent $s readable [list httpEvent $token]
+    if {[info exists state(queryremaining)]} {
+	fileevent $s writable [list httpQueryEvent $token]
+    }
     if {! [info exists state(-command)]} {
 	http_wait $token
     }
     return $token
 }
+
+# Send the next block of the -querychannel body when the socket can take
+#   more.  Tcl doesn't call this while an earlier block is still being
+#   flushed, so no more than one block is ever buffered.
+
+ proc httpQueryEvent {token} {
+    upvar #0 $token state
+    set s $state(sock)
+    set n $state(-blocksize)
+    if {$n > $state(queryremaining)} {
+	set n $state(queryremaining)
+    }
+    if {[catch {
+	set block [read $state(-querychannel) $n]
+	if {[string length $block] != $n} {
+	    error "-querychannel ended $state(queryremaining) bytes early"
+	}
+	puts -nonewline $s $block
+	flush $s
+    } err]} {
+	httpFinish $token $err
+	return
+    }
+    incr state(queryremaining) -$n
+    if {[info exists state(-queryprogress)]} {
+	eval $state(-queryprogress) {$token $state(-querylength) \
+			[expr {$state(-querylength) - $state(queryremaining)}]}
+    }
+    if {$state(queryremaining) == 0} {
+	fileevent $s writable {}
+    }
+}
+
+# Open a connection for a request, reusing an idle pooled connection to
+#   the same host and port for keepalive requests if there is one
+
+ proc httpOpen {token} {
+    upvar #0 $token state
+    global httpPool
+    set key $state(socketkey)
+    if {[info exists state(keepalive)] && [info exists httpPool($key)]} {
+	while {[llength $httpPool($key)] > 0} {
+	    set s [lindex $httpPool($key) 0]
+	    set httpPool($key) [lrange $httpPool($key) 1 end]
+	    # an idle connection the server has closed reads as end of
+	    #   file, and one with unexpected data on it can't be used
+	    if {[catch {read $s} data] || [eof $s] ||
+					    [string length $data]} {
+		catch {close $s}
+		continue
+	    }
+	    set state(reused) 1
+	    return $s
+	}
+    }
+    set hostport [split $key :]
+    return [socket [lindex $hostport 0] [lindex $hostport 1]]
+}
+
+# Put a connection whose response has been completely read into the pool
+
+ proc httpPoolSocket {key s} {
+    global httpPool
+    fileevent $s readable {}
+    lappend httpPool($key) $s
+}
+
+# A pooled connection was closed by the server before any response to
+#   a keepalive request was read; send the request again on a new one
+
+ proc httpResend {token} {
+    upvar #0 $token state
+    set rest [httpPipeRemove $token]
+    catch {close $state(sock)}
+    unset state(reused)
+    set state(meta) {}
+    if {!$state(-pipeline) || ![httpPipeAdd $token]} {
+	set s [httpOpen $token]
+	set state(sock) $s
+	if {$state(-pipeline)} {
+	    httpPipeStart $token
+	}
+	fconfigure $s -translation {auto crlf} -buffersize $state(-blocksize)
+	puts $s $state(request)
+	puts $s ""
+	flush $s
+	catch {fconfigure $s -blocking off}
+	fileevent $s readable [list httpEvent $token]
+    }
+    # any requests pipelined after this one were lost too
+    foreach next $rest {
+	httpResend $next
+    }
+}
+
+# Make the connection of token the one that later -pipeline requests to
+#   the same server are sent on while it waits for its response
+
+ proc httpPipeStart {token} {
+    upvar #0 $token state
+    global httpPipe httpPipeline
+    set httpPipe($state(socketkey)) $state(sock)
+    set httpPipeline($state(sock)) [list $token]
+    set state(pipelined) 1
+}
+
+# Send the request of token on a connection that is waiting for responses
+#   to earlier -pipeline requests to the same server, if there is one.
+#   Return 1 if it was sent, else 0.
+
+ proc httpPipeAdd {token} {
+    upvar #0 $token state
+    global httpPipe httpPipeline
+    if {![info exists httpPipe($state(socketkey))]} {
+	return 0
+    }
+    set s $httpPipe($state(socketkey))
+    # leave the input translation alone because an earlier response may
+    #   be being read in binary
+    if {[catch {
+	    fconfigure $s -translation \
+			[list [lindex [fconfigure $s -translation] 0] crlf]
+	    puts $s $state(request)
+	    puts $s ""
+	    flush $s
+	}]} {
+	# the server has already closed it; the requests waiting on it
+	#   will be sent again when that is noticed
+	unset httpPipe($state(socketkey))
+	return 0
+    }
+    set state(sock) $s
+    set state(pipelined) 1
+    # if the connection is closed before the response, send it again
+    set state(reused) 1
+    lappend httpPipeline($s) $token
+    return 1
+}
+
+# The response to the pipelined request of token is finished.  If reuse
+#   is true the connection can be used again, so start reading the
+#   response to the next request on it, or put it into the pool if there
+#   are no more.  Otherwise send the rest again on another connection.
+
+ proc httpPipeDone {token reuse} {
+    upvar #0 $token state
+    global httpPipeline
+    set s $state(sock)
+    if {$reuse && ([lindex $httpPipeline($s) 0] == $token) &&
+				([llength $httpPipeline($s)] > 1)} {
+	unset state(pipelined)
+	set httpPipeline($s) [lrange $httpPipeline($s) 1 end]
+	fconfigure $s -translation {auto crlf}
+	fileevent $s readable [list httpEvent [lindex $httpPipeline($s) 0]]
+	return
+    }
+    set rest [httpPipeRemove $token]
+    if {$reuse && ($rest == "")} {
+	httpPoolSocket $state(socketkey) $s
+    } else {
+	catch {close $s}
+    }
+    foreach next $rest {
+	httpResend $next
+    }
+}
+
+# Stop pipelining requests on the connection of token, and return the
+#   requests other than token that were waiting for responses on it
+
+ proc httpPipeRemove {token} {
+    upvar #0 $token state
+    global httpPipe httpPipeline
+    if {![info exists state(pipelined)]} {
+	return ""
+    }
+    set s $state(sock)
+    set rest ""
+    foreach next $httpPipeline($s) {
+	upvar #0 $next nextstate
+	unset nextstate(pipelined)
+	if {$next != $token} {
+	    lappend rest $next
+	}
+    }
+    unset httpPipeline($s)
+    if {[info exists httpPipe($state(socketkey))] &&
+		($httpPipe($state(socketkey)) == $s)} {
+	unset httpPipe($state(socketkey))
+    }
+    return $rest
+}
+
 proc http_data {token} {
     upvar #0 $token state
     return $state(body)
@@ -252,7 +490,15 @@ proc http_size {token} {
     }
     if {$state(state) == "header"} {
 	set n [gets $s line]
-	if {$n == 0} {
+	if {($n == 0) && [info exists state(http)] &&
+		    [regexp {^HTTP/[0-9.]+ +1[0-9][0-9]} $state(http)]} {
+	    # an interim response, the real one follows
+	    unset state(http)
+	    set state(meta) {}
+	} elseif {($n == 0) && [info exists state(keepalive)]} {
+	    set state(state) body
+	    httpKeepAliveStart $token
+	} elseif {$n == 0} {
 	    set state(state) body
 	    if ![regexp -nocase ^text $state(type)] {
 		# Turn off conversions for non-text data
@@ -273,6 +519,13 @@ proc http_size {token} {
 	    }
 	    if [regexp -nocase {^content-length:(.+)$} $line x length] {
 		set state(totalsize) [string trim $length]
+		set state(contentlength) $state(totalsize)
+	    }
+	    if [regexp -nocase {^transfer-encoding:(.+)$} $line x coding] {
+		set state(coding) [string tolower [string trim $coding]]
+	    }
+	    if [regexp -nocase {^connection:(.+)$} $line x connection] {
+		set state(connection) [string tolower [string trim $connection]]
 	    }
 	    if [regexp -nocase {^([^:]+):(.+)$} $line x key value] {
 		lappend state(meta) $key $value
@@ -280,6 +533,8 @@ proc http_size {token} {
 		set state(http) $line
 	    }
 	}
+    } elseif {[info exists state(keepalive)]} {
+	httpKeepAliveEvent $token
     } else {
 	if [catch {
 	    if {[info exists state(-handler)]} {
@@ -308,6 +563,133 @@ proc http_size {token} {
 	}
     }
 }
+
+# Called at the end of the headers of a keepalive request.  Find out how
+#   the end of the body is marked: the connection can only be reused if
+#   the body has a Content-Length or is chunked, or if there is no body.
+
+ proc httpKeepAliveStart {token} {
+    upvar #0 $token state
+    set s $state(sock)
+    fconfigure $s -translation binary
+    if {[info exists state(-channel)]} {
+	fconfigure $state(-channel) -translation binary
+    }
+    set code [lindex $state(http) 1]
+    if {([lindex $state(http) 0] != "HTTP/1.1") ||
+	    ([info exists state(connection)] &&
+				($state(connection) == "close"))} {
+	# the server will close the connection after this response
+	unset state(keepalive)
+	set state(bodyleft) -1
+    } elseif {($state(how) == "HEAD") || ($code == 204) || ($code == 304)} {
+	set state(bodyleft) 0
+    } elseif {[info exists state(coding)] && ($state(coding) != "identity")} {
+	if {$state(coding) != "chunked"} {
+	    httpFinish $token "unsupported Transfer-Encoding $state(coding)"
+	    return
+	}
+	set state(chunked) 1
+	set state(bodyleft) 0
+    } elseif {[info exists state(contentlength)]} {
+	set state(bodyleft) $state(contentlength)
+    } else {
+	unset state(keepalive)
+	set state(bodyleft) -1
+    }
+    if {![info exists state(keepalive)]} {
+	# read the body until end of file, always in binary
+	if {[info exists state(-channel)] && ![info exists state(-handler)]} {
+	    fileevent $s readable {}
+	    httpCopyStart $s $token
+	}
+    } elseif {($state(bodyleft) == 0) && ![info exists state(chunked)]} {
+	httpKeepAliveDone $token
+    }
+}
+
+# Read part of the body of a keepalive response, never reading past
+#   the end of the body or of the current chunk
+
+ proc httpKeepAliveEvent {token} {
+    upvar #0 $token state
+    set s $state(sock)
+    if {[info exists state(chunked)] && ($state(bodyleft) == 0)} {
+	# expecting the size line of the next chunk, the blank line after
+	#   the previous chunk, or trailer lines after the last chunk
+	if {[gets $s line] < 0} {
+	    return
+	}
+	set line [string trimright $line "\r"]
+	if {[info exists state(trailer)]} {
+	    if {$line == ""} {
+		httpKeepAliveDone $token
+	    }
+	    return
+	}
+	if {$line == ""} {
+	    return
+	}
+	if {![regexp {^([0-9a-fA-F]+)} $line x size]} {
+	    httpFinish $token "bad chunk size line \"$line\" from $state(url)"
+	    return
+	}
+	set size [expr 0x$size]
+	if {$size == 0} {
+	    set state(trailer) 1
+	} else {
+	    set state(bodyleft) $size
+	}
+	return
+    }
+    set n $state(-blocksize)
+    if {$n > $state(bodyleft)} {
+	set n $state(bodyleft)
+    }
+    if [catch {
+	if {[info exists state(-handler)]} {
+	    # limit how much the handler reads at once
+	    set blocksize $state(-blocksize)
+	    set state(-blocksize) $n
+	    set code [catch {eval $state(-handler) {$s $token}} n]
+	    set state(-blocksize) $blocksize
+	    if {$code} {
+		global errorInfo errorCode
+		error $n $errorInfo $errorCode
+	    }
+	} else {
+	    set block [read $s $n]
+	    set n [string length $block]
+	    if {[info exists state(-channel)]} {
+		puts -nonewline $state(-channel) $block
+	    } else {
+		append state(body) $block
+	    }
+	}
+	incr state(currentsize) $n
+	incr state(bodyleft) -$n
+    } err] {
+	httpFinish $token $err
+	return
+    }
+    if [info exists state(-progress)] {
+	eval $state(-progress) {$token $state(totalsize) $state(currentsize)}
+    }
+    if {($state(bodyleft) == 0) && ![info exists state(chunked)]} {
+	httpKeepAliveDone $token
+    }
+}
+
+# The complete body of a keepalive response has been read
+
+ proc httpKeepAliveDone {token} {
+    upvar #0 $token state
+    set state(bodydone) 1
+    set state(status) ok
+    set state(state) eof
+    httpFinish $token
+}
+
  proc httpCopyStart {s token} {
     upvar #0 $token state
     if [catch {
@@ -334,6 +716,14 @@ proc http_size {token} {
 }
  proc httpEof {token} {
     upvar #0 $token state
+    if {[info exists state(reused)] && ![info exists state(http)]} {
+	httpResend $token
+	return
+    }
+    if {[info exists state(keepalive)] && ($state(state) == "body")} {
+	httpFinish $token "premature end of file from $state(url)"
+	return
+    }
     if {$state(state) == "header"} {
 	# Premature eof
 	set state(status) eof
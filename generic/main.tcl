@@ -56,6 +56,8 @@ nsbd [**] {-update | -poll | -audit} {all | {[*] package [...]}}
 nsbd [**] {-preview | -fetchAll} {[*] {package | URL | file.nsb | -}} [...]
 nsbd [*] {-remove | -unregister} {[*] package [...]}
 nsbd {{-multigetFiles [directoryPrefix]} | {[*] -multigetPackage package}}
+nsbd [*] -multigetServer [host:]port
+nsbd [**] -pollDaemon [host:]port
 nsbd [**] {-updateOnePackage | -changedPaths | -batchUpdate} package
 nsbd [*] -updateComments {file.ncf | file.nrd | file.npd | file.nsb}
 nsbd [*] {-getPathPackages | -getRegisteredPathPackages} glob_pattern [...]
@@ -262,6 +264,10 @@ To poll for and install updates for all packages, good to do from
 cron nightly or weekly:
   nsbd -poll all
 
+Or to leave nsbd running to poll each package as soon as it is due,
+taking requests such as "update nsbd" on local port 8700:
+  nsbd -pollDaemon 8700
+
 To manually register for the nsbd solaris binary package, add this
 to ~/.nsbd/registry.nrd:
   packages:
@@ -681,11 +687,7 @@ proc initializeCfgFile {cfgFileName} {
 	}
     }
     if {$mailcap != ""} {
-	global argv0
-	set nsbd [file join [pwd] $argv0]
-	if {![file executable $nsbd] || ![file isfile $nsbd]} {
-	    set nsbd [whereExecutable nsbd]
-	}
+	set nsbd [nsbdExecutable]
 	puts ""
 	if {$nsbd != ""} {
 	    puts "If you want to be able to register for an NSBD-based package by clicking on"
@@ -718,6 +720,18 @@ proc initializeCfgFile {cfgFileName} {
     puts "  announce it by email to on the NSBD mailing list"
 }
 
+#
+# Return the complete path to the nsbd program, or empty if it can't be found
+#
+proc nsbdExecutable {} {
+    global argv0
+    set nsbd [file join [pwd] $argv0]
+    if {![file executable $nsbd] || ![file isfile $nsbd]} {
+	set nsbd [whereExecutable nsbd]
+    }
+    return $nsbd
+}
+
 #
 # Process arguments to nsbd.  The first argument is a boolean set to
 #   non-zero if only command line keyword settings and info-only options
@@ -824,7 +838,11 @@ proc procfile {filename expectedType {typeArg ""} {scratchName ""}} {
 	# allow a url as a source file; copy it to a local file
 	if {$procNsbType == "poll"} {
 	    set package $typeArg
-	    set ans [urlFile $filename [nrdLookup $package lastServerPollTime]]
+	    set since [nrdLookup $package lastServerPollTime]
+	    set ans [urlNsbDeltaFile $package $since]
+	    if {$ans == ""} {
+		set ans [urlFile $filename $since]
+	    }
 	    set scratchName [lindex $ans 0]
 	    set serverTime [lindex $ans 1]
 	    if {$serverTime != ""} {
@@ -836,7 +854,15 @@ proc procfile {filename expectedType {typeArg ""} {scratchName ""}} {
 		return
 	    }
 	} else {
-	    set code [catch {set ans [urlFile $filename]} message]
+	    set ans ""
+	    if {$procNsbType == "update"} {
+		set ans [urlNsbDeltaFile $typeArg]
+	    }
+	    if {$ans == ""} {
+		set code [catch {set ans [urlFile $filename]} message]
+	    } else {
+		set code 0
+	    }
 	    if {$code > 0} {
 		global errorInfo errorCode
 		if {([verboseLevel] < 4) && [regexp {.*Not Found} $message]} {
@@ -856,6 +882,12 @@ proc procfile {filename expectedType {typeArg ""} {scratchName ""}} {
 	nsbderror "error: $scratchName is a directory, expecting a file"
     }
     if {$expectedType == "nsb"} {
+	if {[compressedFileEncoding $scratchName] != ""} {
+	    # compressed on the server or in transit
+	    set plainName [scratchAddName "unz"]
+	    uncompressFile $scratchName $plainName
+	    set scratchName $plainName
+	}
 	# make sure there aren't any lines too long before processing
 	# I wish standard gets would support checking for long lines
 	#  so wouldn't have to make an extra pass through the file!
@@ -955,7 +987,17 @@ proc procnpdfile {fd lineno filename {typeArg ""}} {
     # construct '.nsb' contents table
     makeNsbContents npdContents nsbContents
 
+    if {[info exists nsbContents(packUrl)]} {
+	makePackFile npdContents nsbContents $nsbContents(package).pack
+    }
+
     set nsbFilename $nsbContents(package).nsb
+    set oldNsbName ""
+    if {[info exists nsbContents(nsbDeltaUrl)] && [file exists $nsbFilename]} {
+	# keep the '.nsb' file being replaced to make a delta from
+	set oldNsbName [scratchAddName "onb"]
+	file copy -force $nsbFilename $oldNsbName
+    }
     global unsignedNsbfiles
     if {$unsignedNsbfiles} {
 	# create an unsigned nsbfile
@@ -1004,6 +1046,14 @@ proc procnpdfile {fd lineno filename {typeArg ""}} {
 
 	scratchClean "nsb"
     }
+
+    if {$oldNsbName != ""} {
+	makeNsbDelta $oldNsbName $nsbFilename "$nsbFilename.delta"
+	scratchClean "onb"
+    } elseif {![info exists nsbContents(nsbDeltaUrl)]} {
+	# don't leave a stale delta around for clients to find
+	file delete "$nsbFilename.delta"
+    }
 }
 
 #
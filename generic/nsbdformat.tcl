@@ -188,131 +188,134 @@ proc nsbdFileType {fd {expectedType ""}} {
 proc nsbdParseContents {fd fileType lineno filename arrayname} {
     upvar #0 ${fileType}Keytable keytable
     upvar $arrayname array
-    nsbdnestlevelInit
+    set nest [nsbdnestlevelInit]
     set arraykey ""
     set keytabkey ""
     set prevnestlevel 0
     set inlist(0) 0
     set inlist(1) 0
     set skipkeyword 0
-    while {[set linelength [gets $fd line]] >= 0} {
-	if {[string range $line 0 4] == "-----"} {
-	    break
-	}
-	incr lineno
-	set answer [nsbdnestlevel $line $linelength $lineno]
-	set nestlevel [lindex $answer 0]
-	set whitechars [lindex $answer 1]
-	if {($whitechars == $linelength) ||
-				([string index $line $whitechars] == "#")} {
-	    # skip blank lines and comments
-	    continue
-	}
-	set realline [string trimright [string range $line $whitechars end]]
-	if {$skipkeyword} {
-	    if {$nestlevel > $prevnestlevel} {
-		# ignore sub-keywords at higher nesting levels
+    # release the nest slot even if there is a parse error
+    alwaysEvalFor "" {nsbdnestlevelDone $nest} {
+	while {[set linelength [gets $fd line]] >= 0} {
+	    if {[string range $line 0 4] == "-----"} {
+		break
+	    }
+	    incr lineno
+	    set answer [nsbdnestlevel $nest $line $linelength $lineno]
+	    set nestlevel [lindex $answer 0]
+	    set whitechars [lindex $answer 1]
+	    if {($whitechars == $linelength) ||
+				    ([string index $line $whitechars] == "#")} {
+		# skip blank lines and comments
 		continue
 	    }
-	    set skipkeyword 0
-	}
-	if {$nestlevel < $prevnestlevel} {
-	    # trim down the keytabkey to this level.
-	    # this is tricky because keytabkey does not include elements
-	    #   for nesting levels that are lists.  Trim off the elements
-	    #   that correspond to nesting levels that are not lists.
-	    # can't assume here that every odd-numbered level is "inlist"
-	    #   because if there's a single item in a list it is allowed to
-	    #   immediately follow the keyword.
-	    set keylen -1
-	    for {set n 0} {$n <= $nestlevel} {incr n} {
-		if {!$inlist($n)} {
-		    incr keylen
+	    set realline [string trimright [string range $line $whitechars end]]
+	    if {$skipkeyword} {
+		if {$nestlevel > $prevnestlevel} {
+		    # ignore sub-keywords at higher nesting levels
+		    continue
 		}
+		set skipkeyword 0
 	    }
-	    set keytabkey [lrange $keytabkey 0 $keylen]
-	}
-	if {$inlist($nestlevel)} {
-	    # only a value on this line, no keyword
-	    set value $realline
-	    if {$keytable($keytabkey)} {
-		# list is expected
-		# trim down arraykey the array key to this level
-		set arraykey [lrange $arraykey 0 [expr $nestlevel - 1]]
-		if {!$noappend || ![info exists array($arraykey)]} {
-		    # append this value to the list at this nesting level
-		    lappend array($arraykey) $value
-		    set noappend 0
+	    if {$nestlevel < $prevnestlevel} {
+		# trim down the keytabkey to this level.
+		# this is tricky because keytabkey does not include elements
+		#   for nesting levels that are lists.  Trim off the elements
+		#   that correspond to nesting levels that are not lists.
+		# can't assume here that every odd-numbered level is "inlist"
+		#   because if there's a single item in a list it is allowed to
+		#   immediately follow the keyword.
+		set keylen -1
+		for {set n 0} {$n <= $nestlevel} {incr n} {
+		    if {!$inlist($n)} {
+			incr keylen
+		    }
 		}
-		# append value to the arraykey in case there are any subkeys
-		lappend arraykey $value
-	    } elseif {![info exists array($arraykey)]} {
-		# value is not expected to be a list, store only first item
-		set array($arraykey) $value
+		set keytabkey [lrange $keytabkey 0 $keylen]
 	    }
-	    set prevnestlevel $nestlevel
-	    continue
-	}
-	# new keyword on this line
-	# note that the following regexp allows there to be no whitespace
-	#  after the colon; I could save the whitespace and then if there
-	#  is a non-empty value make sure that the whitespace is not empty,
-	#  but instead I think I'll allow the whitespace to be missing
-	regexp "^(\[^ \t:\]*)(:)?\[ \t\]*(.*)" $realline x keyword colon value
-	if {$colon != ":"} {
-	    nsbderror "keyword $keyword on line $lineno is not followed by a colon"
-	}
-	if {$nestlevel > $prevnestlevel} {
-	    # $nestlevel is exactly one greater than $prevnestlevel
-	    #   because nestlevels can only increase one at a time
-	    lappend arraykey $keyword
-	    lappend keytabkey $keyword
-	} elseif {$nestlevel == 0} {
-	    set arraykey [list $keyword]
-	    set keytabkey [list $keyword]
-	} else {
-	    # $nestlevel <= $prevnestlevel
-	    # replace all items in arraykey from current level to end
-	    set arraykey [lreplace $arraykey $nestlevel end $keyword]
-	    # replace just last item in keytabkey because the rest would
-	    #  have been trimmed off above
-	    set n [expr [llength $keytabkey] - 1]
-	    set keytabkey [lreplace $keytabkey $n $n $keyword]
-	}
-	if {[info exists keytable($keytabkey)]} {
-	    # recognized keyword
-	    if {[string length $value] == 0} {
-		# this is a keyword with no value; next nestlevel is value list
-		set inlist([expr $nestlevel + 1]) 1
-		# nestlevel after that if any will be a keyword
-		set inlist([expr $nestlevel + 2]) 0
-		set noappend 1
-	    } else {
-		# there is a value, next nestlevel is keyword + value
-		set inlist([expr $nestlevel + 1]) 0
-		if {![info exists array($arraykey)]} {
-		    if {$keytable($keytabkey)} {
-			# list is expected
-			set value [split $value ","]
-			set array($arraykey) $value
-			#  append first item to the arraykey in case there are
-			#    any subkeys
-			lappend arraykey [lindex $value 0]
-		    } else {
-			# value is not expected to be a list; store item
-			set array($arraykey) $value
+	    if {$inlist($nestlevel)} {
+		# only a value on this line, no keyword
+		set value $realline
+		if {$keytable($keytabkey)} {
+		    # list is expected
+		    # trim down arraykey the array key to this level
+		    set arraykey [lrange $arraykey 0 [expr $nestlevel - 1]]
+		    if {!$noappend || ![info exists array($arraykey)]} {
+			# append this value to the list at this nesting level
+			lappend array($arraykey) $value
+			set noappend 0
 		    }
+		    # append value to the arraykey in case there are any subkeys
+		    lappend arraykey $value
+		} elseif {![info exists array($arraykey)]} {
+		    # value is not expected to be a list, store only first item
+		    set array($arraykey) $value
 		}
+		set prevnestlevel $nestlevel
+		continue
 	    }
-	} else {
-	    # unrecognized keyword, skip sub-keys if any
-	    set skipkeyword 1
-	    global fileWarnUnknownKeys
-	    if {$fileWarnUnknownKeys($fileType)} {
-		warnmsg "warning: unknown keyword '$keyword' in $filename ignored"
+	    # new keyword on this line
+	    # note that the following regexp allows there to be no whitespace
+	    #  after the colon; I could save the whitespace and then if there
+	    #  is a non-empty value make sure that the whitespace is not empty,
+	    #  but instead I think I'll allow the whitespace to be missing
+	    regexp "^(\[^ \t:\]*)(:)?\[ \t\]*(.*)" $realline x keyword colon value
+	    if {$colon != ":"} {
+		nsbderror "keyword $keyword on line $lineno is not followed by a colon"
+	    }
+	    if {$nestlevel > $prevnestlevel} {
+		# $nestlevel is exactly one greater than $prevnestlevel
+		#   because nestlevels can only increase one at a time
+		lappend arraykey $keyword
+		lappend keytabkey $keyword
+	    } elseif {$nestlevel == 0} {
+		set arraykey [list $keyword]
+		set keytabkey [list $keyword]
+	    } else {
+		# $nestlevel <= $prevnestlevel
+		# replace all items in arraykey from current level to end
+		set arraykey [lreplace $arraykey $nestlevel end $keyword]
+		# replace just last item in keytabkey because the rest would
+		#  have been trimmed off above
+		set n [expr [llength $keytabkey] - 1]
+		set keytabkey [lreplace $keytabkey $n $n $keyword]
 	    }
+	    if {[info exists keytable($keytabkey)]} {
+		# recognized keyword
+		if {[string length $value] == 0} {
+		    # this is a keyword with no value; next nestlevel is value list
+		    set inlist([expr $nestlevel + 1]) 1
+		    # nestlevel after that if any will be a keyword
+		    set inlist([expr $nestlevel + 2]) 0
+		    set noappend 1
+		} else {
+		    # there is a value, next nestlevel is keyword + value
+		    set inlist([expr $nestlevel + 1]) 0
+		    if {![info exists array($arraykey)]} {
+			if {$keytable($keytabkey)} {
+			    # list is expected
+			    set value [split $value ","]
+			    set array($arraykey) $value
+			    #  append first item to the arraykey in case there are
+			    #    any subkeys
+			    lappend arraykey [lindex $value 0]
+			} else {
+			    # value is not expected to be a list; store item
+			    set array($arraykey) $value
+			}
+		    }
+		}
+	    } else {
+		# unrecognized keyword, skip sub-keys if any
+		set skipkeyword 1
+		global fileWarnUnknownKeys
+		if {$fileWarnUnknownKeys($fileType)} {
+		    warnmsg "warning: unknown keyword '$keyword' in $filename ignored"
+		}
+	    }
+	    set prevnestlevel $nestlevel
 	}
-	set prevnestlevel $nestlevel
     }
     return $arrayname
 }
@@ -325,17 +328,18 @@ proc nsbdParseContents {fd fileType lineno filename arrayname} {
 # this is useful for timing nsbdnestlevel separately from just reading
 #  the file and from nsbdParseContents
 proc nsbdnestleveltest {filename {filealone 0}} {
-    nsbdnestlevelInit
+    set nest [nsbdnestlevelInit]
     withOpen fd $filename "r" {
 	gets $fd line
 	set lineno 1
 	while {[set linelength [gets $fd line]] >= 0} {
 	    incr lineno
 	    if {!$filealone} {
-		set answer [nsbdnestlevel $line $linelength $lineno]
+		set answer [nsbdnestlevel $nest $line $linelength $lineno]
 	    }
 	}
     }
+    nsbdnestlevelDone $nest
 }
 
 # nsbdParse parses an nsbd file
@@ -363,7 +367,7 @@ proc nsbdParse {fd expectedFileType filename contentsName} {
 proc nsbdParseFile {filename expectedFileType contentsName} {
     upvar $contentsName contents
     debugmsg "Parsing $filename"
-    withOpen fd $filename "r" {
+    withOpenUncompressed fd $filename {
 	return [nsbdParse $fd $expectedFileType $filename contents]
     }
 }
@@ -9,7 +9,9 @@
 #   previously installed package), fetching the changed files over the 
 #   network into a temporary directory, and installing the files from the
 #   temporary directory into their final location.  The "nupContents" array
-#   is also written out and passed to pre/postUpdateCommands.
+#   is also written out and passed to pre/postUpdateCommands.  Information
+#   about each path in "nupContents" is kept in a compact "pathtable"
+#   (implemented in C) rather than in separate array elements per path.
 # This source file also contains the GUI (tk) code for registering new
 #   packages, intended for use from a web browser.
 #
@@ -90,13 +92,14 @@ proc makeNsbContents {npdContentsName nsbContentsName} {
 	return
     }
     if {[info exists npdContents(topUrl)] ||
-		[info exists npdContents(multigetUrl)]} {
+		[info exists npdContents(multigetUrl)] ||
+		    [info exists npdContents(packUrl)]} {
 	if {![info exists npdContents(nsbUrl)]} {
-	    warnmsg "Warning: no 'nsbUrl' keyword although there is 'topUrl' or 'multigetUrl'"
+	    warnmsg "Warning: no 'nsbUrl' keyword although there is 'topUrl', 'multigetUrl' or 'packUrl'"
 	}
     } else {
 	if {[info exists npdContents(nsbUrl)]} {
-	    warnmsg "Warning: no 'topUrl' or 'multigetUrl' keyword although there is 'nsbUrl'"
+	    warnmsg "Warning: no 'topUrl', 'multigetUrl' or 'packUrl' keyword although there is 'nsbUrl'"
 	}
     }
 
@@ -223,6 +226,237 @@ proc makeNsbContents {npdContentsName nsbContentsName} {
     }
 }
 
+#
+# Write the data of all the files in nsbContents, from the localTop in
+#   npdContents, one after the other into packFile, and write an index of
+#   them into packFile.idx.  Each line of the index has the offset and
+#   length of a file in packFile followed by its path in the '.nsb' file,
+#   whatever the urlPresubstitutions.  Both are written under temporary
+#   names and renamed into place when they are complete.  Clients fetch
+#   the files they need from the packUrl with Range requests, so any
+#   http server can serve them as efficiently as a multigetUrl.
+#
+proc makePackFile {npdContentsName nsbContentsName packFile} {
+    upvar $npdContentsName npdContents
+    upvar $nsbContentsName nsbContents
+    global knownMdTypes cfgContents
+
+    set mdType [lindex $knownMdTypes 0]
+    if {[info exists cfgContents(mdType)]} {
+	set mdType $cfgContents(mdType)
+    }
+    set localTop "."
+    if {[info exists npdContents(localTop)]} {
+	set localTop $npdContents(localTop)
+    }
+    set paths ""
+    if {[info exists nsbContents(paths)]} {
+	set paths $nsbContents(paths)
+    }
+
+    set offset 0
+    set index ""
+    withOpen packfd "$packFile.new" "w" {
+	fconfigure $packfd -translation binary
+	foreach path $paths {
+	    set lengthKey [list paths $path length]
+	    if {![info exists nsbContents($lengthKey)]} {
+		# a directory or link
+		continue
+	    }
+	    withOpen fd [file join $localTop $path] "r" {
+		fconfigure $fd -translation binary
+		set mdData [$mdType -chan $fd -copychan $packfd]
+	    }
+	    compareMdDataFor $path [list $nsbContents($lengthKey) \
+		    $nsbContents([list paths $path $mdType])] $mdData
+	    lappend index "$offset [lindex $mdData 0] $path"
+	    incr offset [lindex $mdData 0]
+	}
+    }
+    withOpen fd "$packFile.idx.new" "w" {
+	puts $fd [join $index "\n"]
+    }
+    file rename -force "$packFile.new" $packFile
+    file rename -force "$packFile.idx.new" "$packFile.idx"
+    progressmsg "Created $packFile and $packFile.idx"
+}
+
+#
+# Read a '.nsb' file as a list of records, each one a line that does
+#   not start with a tab plus all the tab-indented lines after it, so a
+#   path entry with its length, mode and digests is a single record
+#
+proc readNsbRecords {filename} {
+    set records ""
+    set record ""
+    withOpen fd $filename "r" {
+	fconfigure $fd -translation binary
+	while {[gets $fd line] >= 0} {
+	    if {([string index $line 0] != "\t") && ($record != "")} {
+		lappend records $record
+		set record ""
+	    }
+	    append record "$line\n"
+	}
+    }
+    if {$record != ""} {
+	lappend records $record
+    }
+    return $records
+}
+
+#
+# Return the md5 digest of the uncompressed contents of a file
+#
+proc nsbDeltaDigest {filename} {
+    withOpenUncompressed fd $filename {
+	fconfigure $fd -translation binary
+	set mdData [md5 -chan $fd]
+    }
+    return [lindex $mdData 1]
+}
+
+#
+# Write a delta that turns oldFile into newFile.  After a header of
+#   "keyword: value" lines ending with an empty line, each line is
+#   "= n" to copy the next n records of the old file, "- n" to skip
+#   them, or "+ n" followed by n lines to put into the new file.
+#
+proc makeNsbDelta {oldFile newFile deltaFile} {
+    set oldRecords [readNsbRecords $oldFile]
+    set newRecords [readNsbRecords $newFile]
+    set numOld [llength $oldRecords]
+    set idx 0
+    foreach record $oldRecords {
+	lappend oldAt([lindex [split $record "\n"] 0]) $idx
+	incr idx
+    }
+
+    set ops ""
+    set lastOp ""
+    set lastCount 0
+    set oldIdx 0
+    set numAdded 0
+    foreach record $newRecords {
+	set lines [split $record "\n"]
+	set lines [lreplace $lines end end]
+	set matchIdx -1
+	if {($oldIdx < $numOld) && ($record == [lindex $oldRecords $oldIdx])} {
+	    set matchIdx $oldIdx
+	} elseif {[info exists oldAt([lindex $lines 0])]} {
+	    foreach idx $oldAt([lindex $lines 0]) {
+		if {$idx >= $oldIdx} {
+		    set matchIdx $idx
+		    break
+		}
+	    }
+	}
+	if {$matchIdx > $oldIdx} {
+	    lappend ops "- [expr {$matchIdx - $oldIdx}]"
+	    set oldIdx $matchIdx
+	}
+	if {($matchIdx >= 0) && ($record == [lindex $oldRecords $matchIdx])} {
+	    if {$lastOp == "="} {
+		set ops [lreplace $ops end end "= [incr lastCount]"]
+	    } else {
+		lappend ops "= 1"
+		set lastOp "="
+		set lastCount 1
+	    }
+	    incr oldIdx
+	    continue
+	}
+	if {$matchIdx >= 0} {
+	    # same first line but changed, replace the old one
+	    lappend ops "- 1"
+	    incr oldIdx
+	}
+	lappend ops "+ [llength $lines]" [join $lines "\n"]
+	set lastOp "+"
+	incr numAdded
+    }
+    if {$oldIdx < $numOld} {
+	lappend ops "- [expr {$numOld - $oldIdx}]"
+    }
+
+    withOpen fd "$deltaFile.new" "w" {
+	fconfigure $fd -translation binary
+	puts $fd "nsbDelta: 1"
+	puts $fd "baseMd5: [nsbDeltaDigest $oldFile]"
+	puts $fd "md5: [nsbDeltaDigest $newFile]"
+	puts $fd ""
+	foreach op $ops {
+	    puts $fd $op
+	}
+    }
+    file rename -force "$deltaFile.new" $deltaFile
+    progressmsg "Created $deltaFile with $numAdded new records"
+}
+
+#
+# Apply a delta made by makeNsbDelta to baseFile, writing outFile.
+#   Errors if the delta was not made from baseFile or if the result
+#   is not what the delta was made to.  The base file is read one
+#   record at a time so large '.nsb' files are not held in memory.
+#
+proc applyNsbDelta {baseFile deltaFile outFile} {
+    withOpenUncompressed dfd $deltaFile {
+	fconfigure $dfd -translation binary
+	while {([gets $dfd line] > 0) && \
+		[regexp {^([^:]*): (.*)$} $line x key value]} {
+	    set header($key) $value
+	}
+	if {![info exists header(nsbDelta)] || ($header(nsbDelta) != 1) || \
+		![info exists header(baseMd5)] || ![info exists header(md5)]} {
+	    nsbderror "$deltaFile is not a '.nsb' delta"
+	}
+	if {[nsbDeltaDigest $baseFile] != $header(baseMd5)} {
+	    nsbderror "$deltaFile was not made from $baseFile"
+	}
+	withOpenUncompressed bfd $baseFile {
+	    fconfigure $bfd -translation binary
+	    withOpen ofd $outFile "w" {
+		fconfigure $ofd -translation binary
+		set havePending [expr {[gets $bfd pending] >= 0}]
+		while {[gets $dfd line] >= 0} {
+		    if {![regexp {^([-=+]) ([0-9]+)$} $line x op count]} {
+			nsbderror "bad line in $deltaFile: $line"
+		    }
+		    if {$op == "+"} {
+			while {$count > 0} {
+			    if {[gets $dfd line] < 0} {
+				nsbderror "$deltaFile ends too soon"
+			    }
+			    puts $ofd $line
+			    incr count -1
+			}
+			continue
+		    }
+		    while {$count > 0} {
+			if {!$havePending} {
+			    nsbderror "$deltaFile goes past the end of $baseFile"
+			}
+			if {$op == "="} {
+			    puts $ofd $pending
+			}
+			while {[set havePending [expr {[gets $bfd pending] >= 0}]] \
+				    && ([string index $pending 0] == "\t")} {
+			    if {$op == "="} {
+				puts $ofd $pending
+			    }
+			}
+			incr count -1
+		    }
+		}
+	    }
+	}
+    }
+    if {[nsbDeltaDigest $outFile] != $header(md5)} {
+	nsbderror "result of applying $deltaFile does not match"
+    }
+}
+
 #
 # keep a count of the number of errors, print message, and continue
 #   so all errors can be located in one pass
@@ -536,7 +770,7 @@ proc procnsbfile {fd lineno filename expectedPackageName hassig nsbScratch} {
 		[set nsbStoreFiles [findNsbStoreFiles $package]] != ""} {
 	    # See if it is exactly the same as an old one
 	    foreach nsbStoreFile $nsbStoreFiles {
-		set catchcode [catch {compareFiles $nsbScratch \
+		set catchcode [catch {compareNsbStoreFile $nsbScratch \
 						$nsbStoreFile} answer]
 		if {($catchcode == 0) && $answer} {
 		    progressmsg "No change in .nsb file for package $package"
@@ -762,7 +996,8 @@ proc procnsbfile2 {package executableTypes versions nsbScratch} {
     if {($procNsbType != "changedPaths") && ($procNsbType != "batchUpdate")} {
 	# If there are % substitutions in topUrl or multigetUrl, do fetches
 	#  separately per installTop because multifetches require a single top
-	foreach key {topUrl multigetUrl} {
+	foreach key {topUrl multigetUrl packUrl topUrlMirrors \
+						    multigetUrlMirrors} {
 	    if {[info exists nsbContents($key)]} {
 		if {[regexp {%[EVP]} $nsbContents($key)]} {
 		    set batchFetches 0
@@ -815,11 +1050,16 @@ proc procnsbfile2 {package executableTypes versions nsbScratch} {
     }
 
     if {$procNsbType == "changedPaths"} {
-	puts "-----BEGIN CHANGED PATHS-----"
+	# the -multigetServer option sends these to a socket instead of stdout
+	global changedPathsChannel
+	if {![info exists changedPathsChannel]} {
+	    set changedPathsChannel stdout
+	}
+	puts $changedPathsChannel "-----BEGIN CHANGED PATHS-----"
 	foreach pathInfo $pathsInfo {
-	    puts [lindex $pathInfo 0]
+	    puts $changedPathsChannel [lindex $pathInfo 0]
 	}
-	puts "-----END CHANGED PATHS-----"
+	puts $changedPathsChannel "-----END CHANGED PATHS-----"
 	return
     }
 
@@ -892,9 +1132,21 @@ proc procnsbfile2 {package executableTypes versions nsbScratch} {
 		    } else {
 			set action copy
 		    }
-		    notrace {withParentDir {file $action -force $nsbScratch $nsbStoreName}}
-		    if {$action == "rename"} {
-			removeFromScratchFiles $nsbScratch
+		    set encoding [nsbStoreEncoding]
+		    if {$encoding != ""} {
+			notrace {file mkdir [file dirname $nsbStoreName]}
+			filterFile [urlEncodingCommand $encoding compress] \
+					$nsbScratch "$nsbStoreName.new"
+			notrace {file rename -force "$nsbStoreName.new" \
+							    $nsbStoreName}
+			if {$action == "rename"} {
+			    scratchClean [list $nsbScratch]
+			}
+		    } else {
+			notrace {withParentDir {file $action -force $nsbScratch $nsbStoreName}}
+			if {$action == "rename"} {
+			    removeFromScratchFiles $nsbScratch
+			}
 		    }
 		} elseif {[file exists $nsbStoreName]} {
 		    if {$procNsbType == "remove"} {
@@ -929,7 +1181,7 @@ proc procnsbfile2 {package executableTypes versions nsbScratch} {
 	incr nupCount
 	upvar 0 nupContents_$nupCount nupContents
 	executeUpdateCommands $package "postUpdateCommands" nupContents 1
-	unset nupContents
+	clearSubstitutedContents nupContents
     }
 }
 
@@ -1486,6 +1738,48 @@ proc defaultNsbStorePath {} {
     return $nsbdpath
 }
 
+#
+# Return the nsbStoreEncoding to compress stored '.nsb' files with, or
+#   empty if they are not to be compressed
+#
+proc nsbStoreEncoding {} {
+    global cfgContents
+    if {![info exists cfgContents(nsbStoreEncoding)] ||
+			($cfgContents(nsbStoreEncoding) == "")} {
+	return ""
+    }
+    set encoding $cfgContents(nsbStoreEncoding)
+    if {[urlEncodingCommand $encoding compress] == ""} {
+	nsbderror "nsbStoreEncoding $encoding is not supported or its program was not found"
+    }
+    return [string tolower $encoding]
+}
+
+#
+# Return 1 if the '.nsb' file nsbScratch has the same contents as the
+#   stored '.nsb' file nsbStoreFile, which may be compressed, otherwise 0
+#
+proc compareNsbStoreFile {nsbScratch nsbStoreFile} {
+    if {[compressedFileEncoding $nsbStoreFile] == ""} {
+	return [compareFiles $nsbScratch $nsbStoreFile]
+    }
+    withOpen fd1 $nsbScratch "r" {
+	fconfigure $fd1 -translation binary
+	withOpenUncompressed fd2 $nsbStoreFile {
+	    fconfigure $fd2 -translation binary
+	    while {[set buf [read $fd1 8192]] != ""} {
+		if {[read $fd2 [string length $buf]] != $buf} {
+		    return 0
+		}
+	    }
+	    if {[read $fd2 1] != ""} {
+		return 0
+	    }
+	}
+    }
+    return 1
+}
+
 #
 # Return the name of the file that the '.nsb' file will be stored under
 #   for the given package, executableType and version.
@@ -1569,6 +1863,41 @@ proc substitutePercents {var path package executableType version} {
     return $path
 }
 
+#
+# Return a list of the url of a delta to the current '.nsb' file of
+#   package and the stored '.nsb' file that it applies to, or empty if
+#   there is no stored '.nsb' file or it has no nsbDeltaUrl.
+#
+proc nsbDeltaSource {package} {
+    global nsbDeltaFailed
+    if {[info exists nsbDeltaFailed($package)]} {
+	return ""
+    }
+    set storeFiles [findNsbStoreFiles $package]
+    if {[llength $storeFiles] != 1} {
+	return ""
+    }
+    set baseFile [lindex $storeFiles 0]
+    set deltaUrl ""
+    withOpenUncompressed fd $baseFile {
+	# keywords other than paths all come before paths
+	while {([gets $fd line] >= 0) && ($line != "paths:")} {
+	    if {[regexp {^nsbDeltaUrl: (.*)$} $line x deltaUrl]} {
+		break
+	    }
+	}
+    }
+    if {$deltaUrl == ""} {
+	return ""
+    }
+    set urls [substituteUrl $deltaUrl $package \
+	[nrdLookup $package executableTypes] [nrdLookup $package versions]]
+    if {[llength $urls] != 1} {
+	return ""
+    }
+    return [list [lindex $urls 0] $baseFile]
+}
+
 #
 # Substitute %P, %E, and %V if any in url for given package,
 #    executableTypes, and versions
@@ -1642,25 +1971,29 @@ proc fetchAllNsbContents {executableTypes versions nsbStoreName} {
 	progressmsg "No applicable paths in package"
     } else {
 	set mdType $subContents(mdType)
+	set table $subContents(pathTable)
 	set pathsInfo ""
 	set scratchName [scratchAddName "ver"]
 	foreach path $subContents(paths) {
-	    if {![info exists subContents([list paths $path length])]} {
+	    if {![pathtable exists $table $path length]} {
 		# must be directory or link, skip it
 		continue
 	    }
-	    set expectedMdData [list $subContents([list paths $path length]) \
-				    $subContents([list paths $path $mdType])]
+	    set expectedMdData [list [pathtable get $table $path length] \
+				    [pathtable get $table $path digest]]
+	    set packPath [pathtable get $table $path loadPath]
 	    if {![info exists subContents(urlPresubstitutions)] ||
 		    (($subContents(urlPresubstitutions) != "all") &&
 		     ($subContents(urlPresubstitutions) != "nsbFile"))} {
-		set path $subContents([list paths $path loadPath])
+		set path $packPath
 	    }
-	    lappend pathsInfo [list $path $scratchName "" "" $expectedMdData]
+	    lappend pathsInfo [list $path $scratchName "" "" $expectedMdData \
+							"" "" "" $packPath]
 	}
 	multiFetchPaths subContents $pathsInfo $executableTypes $versions
 	scratchClean $scratchName
     }
+    clearSubstitutedContents subContents
 }
 
 #
@@ -1717,6 +2050,10 @@ proc loadOldNsbFile {level nsbStoreFile package executableTypes versions} {
 	    }
 	}
     }
+    if {![info exists oldnupContents(pathTable)]} {
+	# always have a pathtable, even if empty, for simpler lookups
+	set oldnupContents(pathTable) [pathtable create]
+    }
 
     #
     # Clean out anything in oldnsbContents starting with "paths" to save
@@ -1729,6 +2066,41 @@ proc loadOldNsbFile {level nsbStoreFile package executableTypes versions} {
     }
 }
 
+#
+# Load the stored '.nsb' files for all installTops of all of the given
+#   packages, each one only once, and return a list of pairs of package
+#   name and stored file name.  As with loadOldNsbFile, the contents of
+#   each are left in the global arrays nsbContents_<stored file name> and
+#   nupContents_<stored file name>.
+#
+
+proc loadOldNsbFiles {packages cmdContentsName} {
+    upvar $cmdContentsName cmdContents
+    set loaded ""
+    foreach package $packages {
+	set executableTypes [getExecutableTypes $package cmdContents 1]
+	set versions [getVersions $package cmdContents]
+	# as a side effect calculateInstallTops sets a topNsbStoreNames
+	#  indexed by the installTops, and storeExecutableTypes and
+	#  storeVersions indexed by the topNsbStoreNames
+	set installTops \
+	    [calculateInstallTops $package $executableTypes $versions]
+	foreach installTop $installTops {
+	    foreach nsbStoreName $topNsbStoreNames($installTop) {
+		if {[info exists loadedStores($nsbStoreName)]} {
+		    continue
+		}
+		set loadedStores($nsbStoreName) ""
+		loadOldNsbFile 1 $nsbStoreName $package \
+			$storeExecutableTypes($nsbStoreName) \
+			$storeVersions($nsbStoreName)
+		lappend loaded [list $package $nsbStoreName]
+	    }
+	}
+    }
+    return $loaded
+}
+
 #
 # Clear the oldnsbContents and oldnupContents arrays because once
 #  a package is successfully processed the old ones won't be valid
@@ -1738,7 +2110,7 @@ proc clearOldNsbFile {{level "#0"}} {
     upvar $level oldnsbContents oldnsbContents
     upvar $level oldnupContents oldnupContents
     catch {unset oldnsbContents}
-    catch {unset oldnupContents}
+    clearSubstitutedContents oldnupContents
 }
 
 #
@@ -2054,7 +2426,7 @@ proc makeNupContents {nsbStoreFile nsbScratch installTop \
     global nsbContents nsbNupKeys procNsbType noNsbChanges
     upvar nupContents nupContents
 
-    catch {unset nupContents}
+    clearSubstitutedContents nupContents
     # always set the mdType and paths to something for later convenience
     set nupContents(mdType) md5
     set nupContents(paths) ""
@@ -2073,6 +2445,7 @@ proc makeNupContents {nsbStoreFile nsbScratch installTop \
 	#
 	# Skip the rest of the processing in this procedure
 	#
+	set nupContents(pathTable) [pathtable create]
 	set nupContents(removePaths) ""
 	return 0
     }
@@ -2113,6 +2486,7 @@ proc makeNupContents {nsbStoreFile nsbScratch installTop \
 	    set removePaths $oldnupContents(paths)
 	}
 	set nupContents(removePaths) [lsort -decreasing $removePaths]
+	set nupContents(oldObjects) [getOldObjects $removePaths]
 	clearOldNsbFile
 	return 0
     }
@@ -2130,79 +2504,92 @@ proc makeNupContents {nsbStoreFile nsbScratch installTop \
 	updatemsg "no paths keyword found"
     } else {
 	validatePaths nupContents [nrdLookup $package "validPaths"] $executableTypes
-	set mdType $nupContents(mdType)
+	set table $nupContents(pathTable)
+	set oldtable $oldnupContents(pathTable)
 	set changedPaths ""
+	set oldIndexed 0
 	if {[info exists nupContents(paths)]} {
 	    set substitutedPaths $nupContents(paths)
 	}
 	foreach path $substitutedPaths {
-	    set pathsTable($path) ""
 	    if {[isDirectory $path]} {
 		# a directory
-		if {[info exists oldnupContents([list paths $path loadPath])]} {
-		    unset nupContents([list paths $path loadPath])
+		if {[pathtable exists $oldtable $path loadPath]} {
+		    pathtable unset $table $path loadPath
 		    continue
 		}
 		# perm is atemporary internal keyword
-		set nupContents([list paths $path perm]) [getPathPerm $path]
+		pathtable set $table $path perm [getPathPerm $path]
 		# fall through
-	    } elseif {[info exists nupContents([list paths $path linkTo])]} {
+	    } elseif {[pathtable exists $table $path linkTo]} {
 		# a symbolic link
-		set link $nupContents([list paths $path linkTo])
-		if {[info exists oldnupContents([list paths $path linkTo])]} {
-		    set oldlink $oldnupContents([list paths $path linkTo])
+		set link [pathtable get $table $path linkTo]
+		if {[pathtable exists $oldtable $path linkTo]} {
+		    set oldlink [pathtable get $oldtable $path linkTo]
 		    if {$link == $oldlink} {
 			# hasn't changed, no need to include it
-			unset nupContents([list paths $path linkTo])
-			unset nupContents([list paths $path loadPath])
+			pathtable unset $table $path linkTo
+			pathtable unset $table $path loadPath
 			continue
 		    }
 		}
 		# fall through
-	    } elseif {[info exists nupContents([list paths $path hardLinkTo])]} {
+	    } elseif {[pathtable exists $table $path hardLinkTo]} {
 		# a hard link
-		set link $nupContents([list paths $path hardLinkTo])
-		if {![info exists nupContents([list paths $link loadPath])] &&
-		  [info exists oldnupContents([list paths $path hardLinkTo])]} {
-		    set oldlink $oldnupContents([list paths $path hardLinkTo])
+		set link [pathtable get $table $path hardLinkTo]
+		if {![pathtable exists $table $link loadPath] &&
+		  [pathtable exists $oldtable $path hardLinkTo]} {
+		    set oldlink [pathtable get $oldtable $path hardLinkTo]
 		    if {$link == $oldlink} {
 			# link hasn't changed and path linked-to hasn't
 			#   changed, so no need to include hard link
-			unset nupContents([list paths $path hardLinkTo])
-			unset nupContents([list paths $path loadPath])
+			pathtable unset $table $path hardLinkTo
+			pathtable unset $table $path loadPath
 			continue
 		    }
 		}
 		# fall through
 	    } else {
-		set mode $nupContents([list paths $path mode])
+		set mode [pathtable get $table $path mode]
 		set perm [getPathPerm $path $mode]
-		if {[info exists oldnupContents([list paths $path length])] &&
-		    [info exists oldnupContents([list paths $path $mdType])] &&
-			($nupContents([list paths $path length]) ==
-			    $oldnupContents([list paths $path length])) &&
-			($nupContents([list paths $path $mdType]) ==
-				$oldnupContents([list paths $path $mdType])) &&
+		if {[pathtable exists $oldtable $path length] &&
+		    [pathtable exists $oldtable $path digest] &&
+			([pathtable get $table $path length] ==
+			    [pathtable get $oldtable $path length]) &&
+			([pathtable get $table $path digest] ==
+				[pathtable get $oldtable $path digest]) &&
 			($perm == [getPathPerm $path \
-				$oldnupContents([list paths $path mode])])} {
+				[pathtable get $oldtable $path mode]])} {
 		    # file is the same as the old one, don't need to update
-		    unset nupContents([list paths $path length])
-		    unset nupContents([list paths $path $mdType])
-		    unset nupContents([list paths $path mode])
-		    unset nupContents([list paths $path loadPath])
+		    pathtable unset $table $path
 		    continue
 		} else {
 		    # perm is a temporary internal keyword
-		    set nupContents([list paths $path perm]) $perm
+		    pathtable set $table $path perm $perm
+		    # if an old file had the same content, for example
+		    #   because it was renamed, it can be copied locally
+		    #   instead of fetched
+		    if {!$oldIndexed} {
+			indexOldContents oldnupContents $nupContents(mdType) \
+							    oldContentPaths
+			set oldIndexed 1
+		    }
+		    set key [list [pathtable get $table $path length] \
+				    [pathtable get $table $path digest]]
+		    if {[info exists oldContentPaths($key)]} {
+			# localPath is a temporary internal keyword
+			pathtable set $table $path localPath \
+						$oldContentPaths($key)
+		    }
 		}
 	    }
 	    if {[set group [getPathGroup $path]] != ""} {
 		# group is a temporary internal keyword
-		set nupContents([list paths $path group]) $group
+		pathtable set $table $path group $group
 	    }
-	    if {![info exists oldnupContents([list paths $path loadPath])]} {
+	    if {![pathtable exists $oldtable $path loadPath]} {
 		# new is a temporary internal keyword
-		set nupContents([list paths $path new]) ""
+		pathtable set $table $path new ""
 	    }
 	    lappend changedPaths $path
 	}
@@ -2215,25 +2602,88 @@ proc makeNupContents {nsbStoreFile nsbScratch installTop \
     #  that the directory will need to be removed if there are
     #  still files that use the directory.  They are sorted in
     #  decreasing order to make sure all files will be removed
-    #  before their enclosing directories.
+    #  before their enclosing directories.  The old table is not
+    #  needed after this, so the rows of paths that are still in the
+    #  package are dropped from it and whatever is left was removed;
+    #  only those get copied and sorted.
     #
+    set oldObjects [getOldObjects $nupContents(paths)]
     set removePaths ""
     if {[info exists oldnupContents(paths)]} {
+	set oldtable $oldnupContents(pathTable)
+	foreach path $substitutedPaths {
+	    pathtable unset $oldtable $path
+	}
 	foreach path $oldnupContents(paths) {
-	    if {![info exists pathsTable($path)]} {
-		if {$path != ""} {
-		    lappend removePaths $path
-		}
+	    if {($path != "") && [pathtable exists $oldtable $path]} {
+		lappend removePaths $path
 	    }
 	}
+	set removePaths [lsort -decreasing $removePaths]
     }
-    set nupContents(removePaths) [lsort -decreasing $removePaths]
+    set nupContents(removePaths) $removePaths
+    set nupContents(oldObjects) [concat $oldObjects \
+				    [getOldObjects $removePaths]]
 
     clearOldNsbFile
 
     return [expr {$substitutedPaths != ""}]
 }
 
+#
+# Set elements of the array indexName, indexed by the list of length and
+#   message digest, to a path of a file in oldContents with that content.
+#   Nothing is indexed if the old message digest type is not mdType.
+#
+proc indexOldContents {oldContentsName mdType indexName} {
+    upvar $oldContentsName oldContents
+    upvar $indexName index
+    set oldMdType md5
+    if {[info exists oldContents(mdType)]} {
+	set oldMdType $oldContents(mdType)
+    }
+    if {($oldMdType != $mdType) || ![info exists oldContents(paths)]} {
+	return
+    }
+    set oldtable $oldContents(pathTable)
+    foreach path $oldContents(paths) {
+	if {[pathtable exists $oldtable $path length] &&
+		[pathtable exists $oldtable $path digest]} {
+	    set index([list [pathtable get $oldtable $path length] \
+			    [pathtable get $oldtable $path digest]]) $path
+	}
+    }
+}
+
+#
+# If there is an objectStore, return a list of
+#   {mdType length digest} for each of the paths that was a file in
+#   oldnupContents, so that stored files that are no longer used after
+#   they are replaced or removed can be deleted.
+#
+proc getOldObjects {paths} {
+    global oldnupContents
+    if {([getObjectStore] == "") ||
+		![info exists oldnupContents(pathTable)]} {
+	return ""
+    }
+    set mdType md5
+    if {[info exists oldnupContents(mdType)]} {
+	set mdType $oldnupContents(mdType)
+    }
+    set oldtable $oldnupContents(pathTable)
+    set objects ""
+    foreach path $paths {
+	if {[pathtable exists $oldtable $path length] &&
+		[pathtable exists $oldtable $path digest]} {
+	    lappend objects [list $mdType \
+			[pathtable get $oldtable $path length] \
+			[pathtable get $oldtable $path digest]]
+	}
+    }
+    return $objects
+}
+
 #
 # Find packages that have registry validPaths that overlap the given validPath
 #    glob patterns.  Return a list of all overlapping packages.
@@ -2454,7 +2904,7 @@ proc findConflictingNupPaths {executableTypes} {
 	#  but that finds more potentially conflicting packages than necessary.
 	if {![info exists nupContents(paths)]} {
 	    foreach path $nupContents(paths) {
-		if {[info exists nupContents([list paths $path new])]
+		if {[pathtable exists $nupContents(pathTable) $path new]
 				&& ![isDirectory $path]} {
 		    lappend paths $path
 		}
@@ -2510,7 +2960,7 @@ proc findConflictingNupPaths {executableTypes} {
 		    # directories are allowed to conflict
 		    continue
 		}
-		if {[info exists oldnupContents([list paths $path loadPath])]} {
+		if {[pathtable exists $oldnupContents(pathTable) $path loadPath]} {
 		    nsbderror "$path already installed by package $otherPackage"
 		}
 	    }
@@ -2518,7 +2968,7 @@ proc findConflictingNupPaths {executableTypes} {
 	if {$checkDeletes} {
 	    set removePaths ""
 	    foreach path $nupContents(removePaths) {
-		if {[info exists oldnupContents([list paths $path loadPath])] &&
+		if {[pathtable exists $oldnupContents(pathTable) $path loadPath] &&
 			![isDirectory $path]} {
 		    progressmsg "Skipping delete of $path because in package $otherPackage"
 		    continue
@@ -2534,6 +2984,11 @@ proc findConflictingNupPaths {executableTypes} {
 # Substitute all paths in the fromContents table and load them into
 #   the paths keyword in the toContents table.  Also add the internal keyword
 #   mdType with the message digest type into the toContents table. 
+#   The information about each substituted path (length, digest, mode, etc.)
+#   goes into the pathtable named by the internal keyword pathTable; use
+#   clearSubstitutedContents to free it.  fromContents itself still keeps
+#   that information in elements indexed by [list paths $path keyword],
+#   the layout nsbdParseContents gives every file type.
 #   Also apply local substitutions to validPaths in fromContents if any.
 # If substituteLevel is 0, do all normal substitutions.  If 1 or more, ignore 
 #  duplicate paths. If 2 or more, don't include local config and registry
@@ -2545,6 +3000,13 @@ proc substitutePaths {package fromContentsName toContentsName \
     upvar $fromContentsName fromContents
     upvar $toContentsName toContents
 
+    # the per-path information goes into a pathtable rather than into
+    #   separate toContents elements, to save memory on large packages
+    if {![info exists toContents(pathTable)]} {
+	set toContents(pathTable) [pathtable create]
+    }
+    set table $toContents(pathTable)
+
     if {![info exists fromContents(paths)]} {
 	return
     }
@@ -2578,14 +3040,13 @@ proc substitutePaths {package fromContentsName toContentsName \
 	}
 	if {$nonPortable} {
 	    # the nonPortable keyword is temporary and internal
-	    set toContents([list paths $sPath nonPortable]) ""
+	    pathtable set $table $sPath nonPortable ""
 	}
 
 	# Note: the "loadPath" and "backupPath" keywords are temporary and
 	#   internal, not defined in the nup fileType tables so they will
 	#   never be written out to a file
-	if {[info exists toContents([list paths $sPath loadPath])] &&
-							    !$ignoreDups} {
+	if {[pathtable exists $table $sPath loadPath] && !$ignoreDups} {
 	    if {[isDirectory $sPath]} {
 		# both are directories
 		# silently allow duplicate directories for convenience
@@ -2595,22 +3056,22 @@ proc substitutePaths {package fromContentsName toContentsName \
 		continue
 	    }
 	    # both are files
-	    set prevPath $toContents([list paths $sPath loadPath])
+	    set prevPath [pathtable get $table $sPath loadPath]
 	    nsbderror "both $prevPath and $path install at $sPath"
 	}
 
 	if {[isDirectory $sPath]} {
 	    set fPath [string range $sPath 0 [expr {[string length $sPath] - 2}]]
-	    if {[info exists toContents([list paths $fPath loadPath])]} {
+	    if {[pathtable exists $table $fPath loadPath]} {
 		# this one's a directory and the other's a file
-		set prevPath $toContents([list paths $fPath loadPath])
+		set prevPath [pathtable get $table $fPath loadPath]
 		# this message will end in a trailing slash
 		nsbderror "$prevPath and $path both install at directory $sPath"
 	    }
 	    # fall through
-	} elseif {[info exists toContents([list paths $sPath/ loadPath])]} {
+	} elseif {[pathtable exists $table $sPath/ loadPath]} {
 	    # this one's a file and the other's a directory
-	    set prevPath $toContents([list paths $sPath/ loadPath])
+	    set prevPath [pathtable get $table $sPath/ loadPath]
 	    # this message will not end in a trailing slash
 	    nsbderror "$prevPath and $path both install at directory $sPath"
 	} elseif {[info exists fromContents([set plinkType [list paths $path \
@@ -2633,9 +3094,9 @@ proc substitutePaths {package fromContentsName toContentsName \
 		nsbderror $msg
 	    }
 	    if {$nonPortable} {
-		set toContents([list paths $sPath nonPortable]) ""
+		pathtable set $table $sPath nonPortable ""
 	    }
-	    set toContents([list paths $sPath $linkType]) $link
+	    pathtable set $table $sPath $linkType $link
 	    # fall through
 	} elseif {![info exists fromContents([set plength \
 				    [list paths $path length]])]} {
@@ -2659,24 +3120,24 @@ proc substitutePaths {package fromContentsName toContentsName \
 	    # copy the length and message digest to toContents, even though
 	    #  they are temporary and internal and not officially
 	    #  part of the toContents
-	    set toContents([list paths $sPath length]) $fromContents($plength)
-	    set toContents([list paths $sPath $mdType]) $fromContents($pmdType)
+	    pathtable set $table $sPath length $fromContents($plength)
+	    pathtable set $table $sPath digest $fromContents($pmdType)
 	    # same goes for mode, and insert a default if missing
 	    if {[info exists fromContents([set pmode \
 				    [list paths $path mode]])]} {
-		set toContents([list paths $sPath mode]) $fromContents($pmode)
+		pathtable set $table $sPath mode $fromContents($pmode)
 	    } else {
 		# fill in default
-		set toContents([list paths $sPath mode]) "rw"
+		pathtable set $table $sPath mode "rw"
 	    }
 	    # copy the mtime too if it is there
 	    if {[info exists fromContents([set pmtime \
 				    [list paths $path mtime]])]} {
-		set toContents([list paths $sPath mtime]) $fromContents($pmtime)
+		pathtable set $table $sPath mtime $fromContents($pmtime)
 	    }
 	    # fall through
 	}
-	set toContents([list paths $sPath loadPath]) $path
+	pathtable set $table $sPath loadPath $path
 	lappend toContents(paths) $sPath
 	if {$substituteLevel > 2} {
 	    set toContents([list loadPaths $path path]) $sPath
@@ -2686,7 +3147,7 @@ proc substitutePaths {package fromContentsName toContentsName \
 	    if {[set msg [relativePathCheck $bPath]] != ""} {
 		nsbderror $msg
 	    }
-	    set toContents([list paths $sPath backupPath]) $bPath
+	    pathtable set $table $sPath backupPath $bPath
 	}
     }
 
@@ -2711,6 +3172,18 @@ proc substitutePaths {package fromContentsName toContentsName \
     }
 }
 
+#
+# Free a contents array that was filled in by substitutePaths, including
+#   its pathtable
+#
+proc clearSubstitutedContents {contentsName} {
+    upvar $contentsName contents
+    if {[info exists contents(pathTable)]} {
+	pathtable delete $contents(pathTable)
+    }
+    catch {unset contents}
+}
+
 #
 # Do loop-invariant calculating for substitutions to avoid doing them
 #   on every path.  Assumes called from the same proc as substitutePath
@@ -3150,6 +3623,7 @@ proc validatePaths {contentsName validPaths executableTypes} {
 	}
 	regsub -all %X $validPaths $extension validPaths
     }
+    set table $contents(pathTable)
     foreach path $contents(paths) {
 	# Validate each path.
 	# Also need to validate the link targets to prevent security holes,
@@ -3160,23 +3634,21 @@ proc validatePaths {contentsName validPaths executableTypes} {
 	# Need to make sure backupPath is included in validPaths for
 	#   checking conflicts between packages and for auditing
 	#
-	set plist [list paths $path "linkTo"]
-	if {[info exists contents($plist)]} {
+	if {[pathtable exists $table $path linkTo]} {
 	    # symbolic links can be directories so try with and without
 	    #  trailing slash
 	    if {[catch {validatePath "$path/" $validPaths}]} {
 		validatePath $path $validPaths
 	    }
-	    set plink $contents($plist)
+	    set plink [pathtable get $table $path linkTo]
 	    if {[catch {validatePath "$plink/" $validPaths}]} {
 		validatePath $plink $validPaths
 	    }
 	} else {
 	    validatePath $path $validPaths
 	    foreach subkey {hardLinkTo backupPath} {
-		set plist [list paths $path $subkey]
-		if {[info exists contents($plist)]} {
-		    validatePath $contents($plist) $validPaths
+		if {[pathtable exists $table $path $subkey]} {
+		    validatePath [pathtable get $table $path $subkey] $validPaths
 		}
 	    }
 	}
@@ -3192,38 +3664,39 @@ proc previewNupPaths {} {
     set package $nupContents(package)
     set installTop $nupContents(installTop)
 
+    set table $nupContents(pathTable)
     set firstmsg "Install top $installTop"
     set removedPaths ""
     foreach path $nupContents(paths) {
 	set toPath [file join $installTop $path]
-	if {[info exists nupContents([list paths $path backupPath])]} {
+	if {[pathtable exists $table $path backupPath]} {
 	    if {[file exists $toPath]} {
-		set bPath $nupContents([list paths $path backupPath])
+		set bPath [pathtable get $table $path backupPath]
 		previewNupUpdatemsg "Would back up $path to $bPath"
 	    }
 	}
 	set groupmsg ""
-	if {[info exists nupContents([list paths $path group])]} {
-	    set groupmsg " group $nupContents([list paths $path group])"
+	if {[pathtable exists $table $path group]} {
+	    set groupmsg " group [pathtable get $table $path group]"
 	}
 	if {[isDirectory $path]} {
 	    if {[robustFileType $toPath] != "directory"} {
-		set perm $nupContents([list paths $path perm])
+		set perm [pathtable get $table $path perm]
 		previewNupUpdatemsg "Would make directory $path mode $perm$groupmsg"
 	    }
-	} elseif {[info exists nupContents([list paths $path linkTo])]} {
-	    set link $nupContents([list paths $path linkTo])
+	} elseif {[pathtable exists $table $path linkTo]} {
+	    set link [pathtable get $table $path linkTo]
 	    previewNupUpdatemsg "Would link $path to $link"
 	    if {[robustFileType $toPath] == "directory"} {
 		# keep track of directories deleted so we don't try to
 		#   remove files under it later
 		lappend removedPaths "$path/*"
 	    }
-	} elseif {[info exists nupContents([list paths $path hardLinkTo])]} {
-	    set link $nupContents([list paths $path hardLinkTo])
+	} elseif {[pathtable exists $table $path hardLinkTo]} {
+	    set link [pathtable get $table $path hardLinkTo]
 	    previewNupUpdatemsg "Would hardlink $path to $link"
 	} else {
-	    set perm $nupContents([list paths $path perm])
+	    set perm [pathtable get $table $path perm]
 	    previewNupUpdatemsg "Would install $path mode $perm$groupmsg"
 	}
     }
@@ -3323,6 +3796,132 @@ proc getTemporaryTop {installTop package} {
     return [file join [getInstallTmp $installTop] $package]
 }
 
+#
+# Return the objectStore directory, or an empty string if there is none.
+#  It has to be an absolute path because the same store is used for all
+#  installTops.
+#
+proc getObjectStore {} {
+    global cfgContents
+    if {![info exists cfgContents(objectStore)] ||
+				($cfgContents(objectStore) == "")} {
+	return ""
+    }
+    set objectStore [expandTildes $cfgContents(objectStore)]
+    if {[file pathtype $objectStore] != "absolute"} {
+	nsbderror "objectStore must be an absolute path, not \"$cfgContents(objectStore)\""
+    }
+    return $objectStore
+}
+
+#
+# Return the path in objectStore of the file with mdData (length and
+#  message digest) of type mdType
+#
+proc objectStorePath {objectStore mdType mdData} {
+    set digest [lindex $mdData 1]
+    return [file join $objectStore $mdType [string range $digest 0 1] \
+					    "$digest-[lindex $mdData 0]"]
+}
+
+#
+# Make toPath from the file with mdData in objectStore if it is there.
+#  It is hard-linked if the stored file already has permissions perm and
+#  modification time mtime (if that is not empty), so that installing
+#  toPath won't change the other links, and copied otherwise.  A
+#  hard-linked installed file changed in place changes the stored file
+#  too, so the stored file is checked against mdData first unless it has
+#  the same length and modification time as when it was last checked.
+#  Return 1 if toPath was made, otherwise 0.
+#
+proc objectStoreGet {objectStore mdType mdData toPath perm mtime} {
+    set object [objectStorePath $objectStore $mdType $mdData]
+    if {[catch {file stat $object statb}] || ($statb(type) != "file")} {
+	return 0
+    }
+    if {($statb(size) != [lindex $mdData 0]) ||
+		![objectStoreChecked $object $statb(mtime)]} {
+	if {[catch {withOpen fd $object "r" {
+		    fconfigure $fd -translation binary
+		    compareMdDataFor $object $mdData [$mdType -chan $fd]
+		}} msg]} {
+	    warnmsg "Deleting bad stored object: $msg"
+	    catch {file delete $object "$object.checked"}
+	    return 0
+	}
+	objectStoreSetChecked $object $statb(mtime)
+    }
+    file delete -force $toPath
+    if {(($statb(mode) & 07777) == $perm) &&
+	    (($mtime == "") || ($mtime == $statb(mtime))) &&
+		![catch {notrace {withParentDir {hardLink $object $toPath} \
+							    $toPath}}]} {
+	return 1
+    }
+    notrace {withParentDir {file copy $object $toPath} $toPath}
+    return 1
+}
+
+#
+# Return 1 if the stored object was checked against its message digest
+#  when it had modification time mtime.  That is recorded as the
+#  modification time of an empty file next to it named with ".checked"
+#  added.
+#
+proc objectStoreChecked {object mtime} {
+    if {[catch {file mtime "$object.checked"} checkedMtime]} {
+	return 0
+    }
+    return [expr {$checkedMtime == $mtime}]
+}
+
+#
+# Record that the stored object was checked when it had modification
+#  time mtime.  Fails silently because it only saves checking again.
+#
+proc objectStoreSetChecked {object mtime} {
+    if {[catch {
+	close [open "$object.checked" "w"]
+	changeMtime "$object.checked" $mtime
+    } msg]} {
+	debugmsg "could not record check of $object: $msg"
+    }
+}
+
+#
+# Put fromPath into objectStore as the file with mdData, by hard-linking it,
+#  if there is not already one there.  fromPath has already been checked
+#  against mdData.  Fails silently (for example if objectStore is in a
+#  different filesystem) because the store is only an optimization.
+#
+proc objectStorePut {objectStore mdType mdData fromPath} {
+    set object [objectStorePath $objectStore $mdType $mdData]
+    if {[file exists $object]} {
+	return
+    }
+    if {[catch {withParentDir {hardLink $fromPath $object} $object} msg]} {
+	debugmsg "could not add $fromPath to object store: $msg"
+	return
+    }
+    objectStoreSetChecked $object [file mtime $object]
+}
+
+#
+# Delete the files in objectStore for the list of {mdType length digest}
+#  in objects that are no longer linked to any installed file.  The link
+#  count of each stored file is its reference count.
+#
+proc objectStoreRelease {objectStore objects} {
+    foreach object $objects {
+	set object [objectStorePath $objectStore [lindex $object 0] \
+						    [lrange $object 1 2]]
+	if {![catch {file stat $object statb}] && ($statb(nlink) <= 1)} {
+	    debugmsg "Deleting unreferenced stored object $object"
+	    catch {file delete $object "$object.checked"}
+	}
+    }
+}
+
 # Append all the information needed to fetch files into temporary directories
 #  to the pathsInfo list, of the form needed by urlMultiMdCopy.  If a file
 #  is portable and is retrieved in one of the previous nupContents, only
@@ -3337,6 +3936,7 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
     set temporaryTop [getTemporaryTop $installTop $package]
     set nupContents(temporaryTop) $temporaryTop
     set mdType $nupContents(mdType)
+    set table $nupContents(pathTable)
 
     set relocTop [lindex $relocParams 0]
     set origInstallTop ""
@@ -3353,6 +3953,7 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
     set nupContents(loadRevreloc) $revreloc
 
     set usingRsync [isRsyncFetch nupContents]
+    set objectStore [getObjectStore]
 
     set urlPresubstitutions ""
     if {[info exists nupContents(urlPresubstitutions)]} {
@@ -3384,24 +3985,29 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
 	if {[isDirectory $path]} {
 	    continue
 	}
-	if {[info exists nupContents([list paths $path linkTo])] ||
-		[info exists nupContents([list paths $path hardLinkTo])]} {
+	if {[pathtable exists $table $path linkTo] ||
+		[pathtable exists $table $path hardLinkTo]} {
 	    continue
 	}
-	if {![info exists nupContents([list paths $path nonPortable])]} {
+	set localPath ""
+	if {[pathtable exists $table $path localPath]} {
+	    set localPath [pathtable get $table $path localPath]
+	    pathtable unset $table $path localPath
+	}
+	if {![pathtable exists $table $path nonPortable]} {
 	    # Only load the portable files once
 	    set gotit 0
 	    for {set n 1} {$n < $nupCount} {incr n} {
 		upvar nupContents_$n otherNupContents
-		if {[info exists \
-			otherNupContents([list paths $path loadPath])]} {
-		    set nupContents([list paths $path otherLoadPath]) \
+		set othertable $otherNupContents(pathTable)
+		if {[pathtable exists $othertable $path loadPath]} {
+		    pathtable set $table $path otherLoadPath \
 			[file join $otherNupContents(temporaryTop) \
-			    $otherNupContents([list paths $path loadPath])]
+			    [pathtable get $othertable $path loadPath]]
 		    if {$otherNupContents(loadRevreloc) != $revreloc} {
 			# going to have to undo that reloc and redo with
 			#   this reloc in order to duplicate the files
-			set nupContents([list paths $path otherRevreloc]) \
+			pathtable set $table $path otherRevreloc \
 				$otherNupContents(loadRevreloc)
 		    }
 		    set gotit 1
@@ -3412,17 +4018,19 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
 		continue
 	    }
 	}
-	set expectedMdData [list $nupContents([list paths $path length]) \
-				$nupContents([list paths $path $mdType])]
+	set expectedMdData [list [pathtable get $table $path length] \
+				[pathtable get $table $path digest]]
+	# a pack file always has the paths as they are in the '.nsb' file
+	set packPath [pathtable get $table $path loadPath]
 	if {$urlPresubstitutions == "all"} {
 	    set fromPath $path
-	    set nupContents([list paths $path loadPath]) $fromPath
+	    pathtable set $table $path loadPath $fromPath
 	} elseif {$urlPresubstitutions == "nsbFile"} {
-	    set loadPath $nupContents([list paths $path loadPath])
+	    set loadPath [pathtable get $table $path loadPath]
 	    set fromPath $subContents([list loadPaths $loadPath path])
-	    set nupContents([list paths $path loadPath]) $fromPath
+	    pathtable set $table $path loadPath $fromPath
 	} else {
-	    set fromPath $nupContents([list paths $path loadPath])
+	    set fromPath [pathtable get $table $path loadPath]
 	}
 
 	#
@@ -3436,6 +4044,11 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
 	#   been relocated so the checksum check would likely succeed even
 	#   though it really isn't ready to be used.
 	#
+	# A file shorter than expected that is left from an aborted run
+	#   without relocation is kept so that fetching it can resume
+	#   after the bytes already there.
+	#
+	set resumeFrom ""
 	if {!$usingRsync} {
 	    set tmppath [file join $temporaryTop $fromPath]
 	    if {[file exists $tmppath]} {
@@ -3452,19 +4065,82 @@ proc getNupPathsInfo {nupCount pathsInfoName executableTypes versions relocParam
 		    }
 		    debugmsg "failed to reuse because $string"
 		}
-		file delete $tmppath
+		if {(($reloc == "=") || ($reloc == "")) &&
+			([file size $tmppath] < [lindex $expectedMdData 0])} {
+		    set resumeFrom [file size $tmppath]
+		} else {
+		    file delete $tmppath
+		}
 	    }
 	}
 
-	set perm $nupContents([list paths $path perm])
-	if {[info exists nupContents([list paths $path group])]} {
+	set perm [pathtable get $table $path perm]
+	if {[pathtable exists $table $path group]} {
 	    # it's a security hole to create the temporary file setgid to
 	    #   the wrong group
 	    set perm [removeSetgidPerm $perm]
+	} elseif {($objectStore != "") && !$usingRsync &&
+				    (($reloc == "=") || ($reloc == ""))} {
+	    # relocation doesn't change the file, so it can come from
+	    #   the object store if it is there
+	    set mtime ""
+	    if {[pathtable exists $table $path mtime]} {
+		set mtime [pathtable get $table $path mtime]
+	    }
+	    if {[objectStoreGet $objectStore $mdType $expectedMdData \
+		    [file join $temporaryTop $fromPath] $perm $mtime]} {
+		transfermsg "Using stored object for $fromPath"
+		continue
+	    }
+	}
+	if {($localPath != "") && !$usingRsync && [copyLocalContent $path \
+		[file join $installTop $localPath] $revreloc \
+		[file join $temporaryTop $fromPath] $reloc $perm \
+		$mdType $expectedMdData]} {
+	    transfermsg "Copying $fromPath from installed $localPath"
+	    continue
 	}
-	lappend pathsInfo \
-	    [list $fromPath $temporaryTop $path $perm $expectedMdData $installTop $reloc]
+	lappend pathsInfo [list $fromPath $temporaryTop $path $perm \
+		    $expectedMdData $installTop $reloc $resumeFrom $packPath]
     }
+    clearSubstitutedContents subContents
+}
+
+#
+# Copy the installed file oldPath, which the old nsb file said had the same
+#  content as path, to toPath instead of fetching it.  The old file is
+#  first checked against mdData after undoing its relocation with
+#  revreloc, because it may have been modified since it was installed.
+#  Return 1 if it was copied or 0 if it has to be fetched.
+#
+proc copyLocalContent {path oldPath revreloc toPath reloc perm mdType mdData} {
+    if {[catch {file lstat $oldPath statb}] || ($statb(type) != "file")} {
+	return 0
+    }
+    if {[catch {
+	    set fd [openbreloc $oldPath $revreloc "r"]
+	    alwaysEvalFor "" {closebreloc $fd} {
+		compareMdDataFor $path $mdData [$mdType -chan $fd]
+	    }
+	} string] != 0} {
+	debugmsg "not copying $oldPath because $string"
+	return 0
+    }
+    if {[catch {notrace {withParentDir {
+	    file delete -force $toPath
+	    set fd1 [openbreloc $oldPath $revreloc "r"]
+	    alwaysEvalFor "" {closebreloc $fd1} {
+		set fd2 [openbreloc $toPath $reloc "w" $perm]
+		alwaysEvalFor "" {closebreloc $fd2} {
+		    fcopy $fd1 $fd2
+		}
+	    }
+	} $toPath}} string] != 0} {
+	debugmsg "error copying $oldPath to $toPath: $string"
+	catch {file delete -force $toPath}
+	return 0
+    }
+    return 1
 }
 
 #
@@ -3481,30 +4157,38 @@ proc copyPortableTemps {nupContentsName} {
 
     set installTop $nupContents(installTop)
     set temporaryTop $nupContents(temporaryTop)
+    set table $nupContents(pathTable)
     set mdType $nupContents(mdType)
 
+    # only files that relocation doesn't change can be shared with the
+    #   object store, and not ones that will have their group changed
+    set objectStore ""
+    if {($nupContents(loadReloc) == "") || ($nupContents(loadReloc) == "=")} {
+	set objectStore [getObjectStore]
+    }
+
     foreach path $nupContents(paths) {
 	if {[isDirectory $path]} {
 	    continue
 	}
-	if {[info exists nupContents([list paths $path linkTo])]} {
+	if {[pathtable exists $table $path linkTo]} {
 	    continue
 	}
-	if {[info exists nupContents([list paths $path hardLinkTo])]} {
+	if {[pathtable exists $table $path hardLinkTo]} {
 	    continue
 	}
-	if {[info exists nupContents([list paths $path otherLoadPath])]} {
-	    set loadPath $nupContents([list paths $path loadPath])
+	if {[pathtable exists $table $path otherLoadPath]} {
+	    set loadPath [pathtable get $table $path loadPath]
 	    set toPath [file join $temporaryTop $loadPath]
 	    notrace {withParentDir {
-		if {[info exists nupContents([list paths $path otherRevreloc])]} {
+		if {[pathtable exists $table $path otherRevreloc]} {
 		    progressmsg "Duplicating & relocating $loadPath"
 		    set fd1 [openbreloc \
-			$nupContents([list paths $path otherLoadPath]) \
-			$nupContents([list paths $path otherRevreloc]) "r"]
+			[pathtable get $table $path otherLoadPath] \
+			[pathtable get $table $path otherRevreloc] "r"]
 		    alwaysEvalFor "" {closebreloc $fd1} {
-			set perm $nupContents([list paths $path perm])
-			if {[info exists nupContents([list paths $path group])]} {
+			set perm [pathtable get $table $path perm]
+			if {[pathtable exists $table $path group]} {
 			    # it's a security hole to create the temporary file
 			    #   setgid to the wrong group
 			    set perm [removeSetgidPerm $perm]
@@ -3516,26 +4200,48 @@ proc copyPortableTemps {nupContentsName} {
 			    fcopy $fd1 $fd2
 			}
 		    }
-		    unset nupContents([list paths $path otherRevreloc])
+		    pathtable unset $table $path otherRevreloc
+		} elseif {($objectStore != "") &&
+			![pathtable exists $table $path group] &&
+			[objectStoreGet $objectStore $mdType [list \
+			    [pathtable get $table $path length] \
+			    [pathtable get $table $path digest]] $toPath \
+			    [pathtable get $table $path perm] \
+			    [expr {[pathtable exists $table $path mtime] ?
+				[pathtable get $table $path mtime] : ""}]]} {
+		    transfermsg "Duplicating $loadPath from object store"
 		} else {
 		    transfermsg "Duplicating $loadPath"
 		    file copy -force \
-			$nupContents([list paths $path otherLoadPath]) $toPath
+			[pathtable get $table $path otherLoadPath] $toPath
 		}
 	    } $toPath}
-	    unset nupContents([list paths $path otherLoadPath])
-	} elseif {[info exists nupContents([list paths $path nonPortable])]} {
-	    unset nupContents([list paths $path nonPortable])
+	    pathtable unset $table $path otherLoadPath
+	} else {
+	    if {[pathtable exists $table $path nonPortable]} {
+		pathtable unset $table $path nonPortable
+	    }
+	    if {($objectStore != "") &&
+			![pathtable exists $table $path group]} {
+		set loadPath [pathtable get $table $path loadPath]
+		objectStorePut $objectStore $mdType \
+			[list [pathtable get $table $path length] \
+			    [pathtable get $table $path digest]] \
+			[file join $temporaryTop $loadPath]
+	    }
 	}
-	unset nupContents([list paths $path length])
-	unset nupContents([list paths $path $mdType])
-	unset nupContents([list paths $path mode])
+	pathtable unset $table $path length
+	pathtable unset $table $path digest
+	pathtable unset $table $path mode
     }
 
     unset nupContents(loadReloc)
     unset nupContents(loadRevreloc)
     catch {unset nupContents(topUrl)}
     catch {unset nupContents(multigetUrl)}
+    catch {unset nupContents(topUrlMirrors)}
+    catch {unset nupContents(multigetUrlMirrors)}
+    catch {unset nupContents(packUrl)}
 }
 
 #
@@ -3547,20 +4253,51 @@ proc isRsyncFetch {contentsName} {
     global cfgContents
     if {[info exists contents(topUrl)] &&
 	    [regexp -nocase "^rsync://" $contents(topUrl)] &&
-		(![info exists contents(multigetUrl)] ||
-		    [info exists cfgContents(rsync)])} {
+		((![info exists contents(multigetUrl)] &&
+		    ![info exists contents(packUrl)]) ||
+			[info exists cfgContents(rsync)])} {
 	# topUrl starts with rsync, and there is either no multigetUrl or
-	#   the user has explicitly set the rsync configuration keyword
+	#   packUrl or the user has explicitly set the rsync configuration
+	#   keyword
 	return 1
     }
     return 0
 }
 
 #
-# If using rsync or if the multigetUrl keyword is available, get the
-#   paths in pathsInfo together, otherwise get each one separately
+# Get the paths in pathsInfo, first from the downloadCache if there is
+#   one and then from the network, and put the ones fetched from the
+#   network into the downloadCache
 #
 proc multiFetchPaths {contentsName pathsInfo executableTypes versions} {
+    upvar $contentsName contents
+
+    if {$pathsInfo == ""} {
+	return
+    }
+    set cache ""
+    if {![isRsyncFetch contents]} {
+	set cache [getDownloadCache]
+    }
+    if {$cache == ""} {
+	fetchUncachedPaths contents $pathsInfo $executableTypes $versions
+	return
+    }
+    set mdType $contents(mdType)
+    set pathsInfo [downloadCacheGet $cache $mdType $pathsInfo]
+    fetchUncachedPaths contents $pathsInfo $executableTypes $versions
+    downloadCachePut $cache $mdType $pathsInfo
+}
+
+#
+# If using rsync get the paths in pathsInfo from the topUrl.  Otherwise
+#   get them from the multigetUrl and its mirrors if there are any, then
+#   the packUrl, and then the topUrl and its mirrors, trying the fastest
+#   responding mirror of each first.  When a fetch fails the paths that
+#   did not arrive intact are fetched from the next url, and the error is
+#   raised only when there are no more.
+#
+proc fetchUncachedPaths {contentsName pathsInfo executableTypes versions} {
     global cfgContents
     upvar $contentsName contents
     set package $contents(package)
@@ -3570,31 +4307,211 @@ proc multiFetchPaths {contentsName pathsInfo executableTypes versions} {
     }
     set mdType $contents(mdType)
 
-    if {[info exists contents(topUrl)]} {
+    if {[isRsyncFetch contents]} {
 	set urls [substituteUrl $contents(topUrl) \
 		    $package $executableTypes $versions]
 	if {[llength $urls] > 1} {
 	    nsbderror "topUrl $contents(topUrl) substitutes to [llength $urls] values; must be only one"
 	}
-	set topUrl [lindex $urls 0]
-	if {[isRsyncFetch contents]} {
-	    urlRsyncMultiMdCopy $topUrl $mdType $pathsInfo
+	urlRsyncMultiMdCopy [lindex $urls 0] $mdType $pathsInfo
+	return
+    }
+
+    if {[info exists cfgContents(multigetPeers)] &&
+				($cfgContents(multigetPeers) != "")} {
+	set pathsInfo [urlPeersMultiMdCopy $cfgContents(multigetPeers) \
+					    $package $mdType $pathsInfo]
+	if {$pathsInfo == ""} {
 	    return
 	}
     }
 
-    if {[info exists contents(multigetUrl)]} {
-	set urls [substituteUrl $contents(multigetUrl) \
+    global cmdKeytable
+    set sources ""
+    foreach key {multigetUrl packUrl topUrl} {
+	if {![info exists contents($key)]} {
+	    continue
+	}
+	set urls [substituteUrl $contents($key) \
 		    $package $executableTypes $versions]
 	if {[llength $urls] > 1} {
-	    nsbderror "multigetUrl $contents(multigetUrl) substitutes to [llength $urls] values; must be only one"
+	    nsbderror "$key $contents($key) substitutes to [llength $urls] values; must be only one"
+	}
+	if {[info exists contents(${key}Mirrors)] &&
+				![info exists cmdKeytable($key)]} {
+	    foreach mirror $contents(${key}Mirrors) {
+		set mirror [lindex [substituteUrl $mirror \
+			    $package $executableTypes $versions] 0]
+		if {[lsearch -exact $urls $mirror] < 0} {
+		    lappend urls $mirror
+		}
+	    }
+	    set urls [urlRankMirrors $urls]
+	}
+	foreach url $urls {
+	    if {($key == "topUrl") && ($sources != "") &&
+			![regexp -nocase {^(http|ftp)://} $url]} {
+		# only http and ftp can take over from a multigetUrl or packUrl
+		continue
+	    }
+	    lappend sources $key $url
 	}
-	urlMultiMdCopy [lindex $urls 0] $mdType $pathsInfo
+    }
+    if {$sources == ""} {
+	nsbderror "topUrl, multigetUrl and packUrl keywords all missing"
+    }
+
+    set pathsInfo [fetchSegmentedPaths $sources $mdType $pathsInfo]
+    if {$pathsInfo == ""} {
 	return
     }
-    if {![info exists contents(topUrl)]} {
-	nsbderror "topUrl and multigetUrl keyword both missing"
+
+    set numsources [expr {[llength $sources] / 2}]
+    foreach {key url} $sources {
+	incr numsources -1
+	set code [catch {fetchSourcePaths $key $url $mdType $pathsInfo} msg]
+	if {($code != 0) && [resumedPathsFailed $mdType pathsInfo]} {
+	    debugmsg "fetching from $url with resumed files failed: $msg"
+	    if {$pathsInfo == ""} {
+		return
+	    }
+	    set code [catch {fetchSourcePaths $key $url $mdType $pathsInfo} msg]
+	}
+	if {$code == 0} {
+	    return
+	}
+	global errorInfo errorCode
+	if {$numsources == 0} {
+	    return -code $code -errorinfo $errorInfo -errorcode $errorCode $msg
+	}
+	warnmsg "Fetching from $url failed, trying another url:\n    $msg"
+	set pathsInfo [urlUnfetchedPaths $mdType $pathsInfo]
+	if {$pathsInfo == ""} {
+	    return
+	}
+    }
+}
+
+#
+# Get the paths in pathsInfo from url, which is the value of key
+#
+proc fetchSourcePaths {key url mdType pathsInfo} {
+    if {$key == "multigetUrl"} {
+	urlMultiMdCopy $url $mdType $pathsInfo
+    } elseif {$key == "packUrl"} {
+	urlPackMdCopy $url $mdType $pathsInfo
+    } else {
+	fetchTopUrlPaths $url $mdType $pathsInfo
+    }
+}
+
+#
+# After a failed fetch, if any of the files in the pathsInfo variable was
+#   resumed after bytes left by an interrupted run and did not arrive
+#   intact, those bytes may not have belonged to this version of the file.
+#   In that case delete those files, set the variable to the pathsInfo of
+#   the files that still need to be fetched, all from the start, and
+#   return 1.  Otherwise return 0.
+#
+proc resumedPathsFailed {mdType pathsInfoName} {
+    upvar $pathsInfoName pathsInfo
+    set resumed 0
+    foreach pathInfo $pathsInfo {
+	set resumeFrom [lindex $pathInfo 7]
+	if {($resumeFrom != "") && ($resumeFrom > 0)} {
+	    set resumedPaths([lindex $pathInfo 0]) ""
+	    set resumed 1
+	}
+    }
+    if {!$resumed} {
+	return 0
+    }
+    set unfetchedInfo [urlUnfetchedPaths $mdType $pathsInfo]
+    set failed 0
+    foreach pathInfo $unfetchedInfo {
+	set fromPath [lindex $pathInfo 0]
+	if {[info exists resumedPaths($fromPath)]} {
+	    warnmsg "Partially fetched $fromPath was bad, fetching it from the start"
+	    catch {file delete [file join [lindex $pathInfo 1] $fromPath]}
+	    set failed 1
+	}
+    }
+    if {!$failed} {
+	return 0
     }
+    set pathsInfo $unfetchedInfo
+    return 1
+}
+
+#
+# Get the files in pathsInfo that are at least minSegmentedSize bytes from
+#   the http topUrls in sources (as built by fetchUncachedPaths) in
+#   fetchSegments pieces at the same time, and return the pathsInfo of the
+#   rest.  Files whose segmented fetch fails, for example because the
+#   server doesn't support ranges, are left to be fetched the usual way,
+#   and so are files that a multigetUrl can send as a delta from the
+#   installed version.
+#
+proc fetchSegmentedPaths {sources mdType pathsInfo} {
+    global cfgContents
+    if {![info exists cfgContents(minSegmentedSize)]} {
+	return $pathsInfo
+    }
+    set minSize $cfgContents(minSegmentedSize)
+    if {![regexp {^[0-9]+$} $minSize]} {
+	nsbderror "minSegmentedSize must be a number, not \"$minSize\""
+    }
+    set numSegments 4
+    if {[info exists cfgContents(fetchSegments)]} {
+	set numSegments $cfgContents(fetchSegments)
+	if {![regexp {^[0-9]+$} $numSegments] || ($numSegments < 1)} {
+	    nsbderror "fetchSegments must be a positive number, not \"$numSegments\""
+	}
+    }
+    set topUrls ""
+    set minDeltaSize 0
+    foreach {key url} $sources {
+	if {($key == "topUrl") && [regexp -nocase {^http://} $url]} {
+	    regsub {/$} $url "" url
+	    lappend topUrls $url
+	} elseif {$key == "multigetUrl"} {
+	    set minDeltaSize 65536
+	    if {[info exists cfgContents(minDeltaSize)]} {
+		set minDeltaSize $cfgContents(minDeltaSize)
+	    }
+	}
+    }
+    if {($minSize == 0) || ($numSegments < 2) || ($topUrls == "")} {
+	return $pathsInfo
+    }
+    set restInfo ""
+    foreach pathInfo $pathsInfo {
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc \
+						    resumeFrom} $pathInfo {break}
+	if {([lindex $expectedMdData 0] < $minSize) ||
+		(($resumeFrom != "") && ($resumeFrom > 0)) ||
+		    (($minDeltaSize > 0) && ($finalPath != "") &&
+			![catch {file size [file join $xx $finalPath]} size] &&
+						($size >= $minDeltaSize))} {
+	    lappend restInfo $pathInfo
+	    continue
+	}
+	if {[catch {urlSegmentedMdCopy $topUrls $fromPath $mdType \
+			$expectedMdData [file join $toTop $fromPath] \
+			$reloc $mode $numSegments} msg] != 0} {
+	    debugmsg "segmented fetch of $fromPath failed: $msg"
+	    lappend restInfo [lreplace $pathInfo 7 7 ""]
+	}
+    }
+    return $restInfo
+}
+
+#
+# Get the paths in pathsInfo from topUrl, all at once if maxParallelFetches
+#   is set or otherwise one at a time
+#
+proc fetchTopUrlPaths {topUrl mdType pathsInfo} {
+    global cfgContents
 
     set endTop [expr [string length $topUrl] - 1]
     if {[string index $topUrl $endTop] == "/"} {
@@ -3617,8 +4534,19 @@ proc multiFetchPaths {contentsName pathsInfo executableTypes versions} {
 	    progressmsg "Copy-from top $topPath"
 	}
     }
+    if {($topPath == "") && [info exists cfgContents(maxParallelFetches)]} {
+	set maxParallel $cfgContents(maxParallelFetches)
+	if {![regexp {^[0-9]+$} $maxParallel] || ($maxParallel < 1)} {
+	    nsbderror "maxParallelFetches must be a positive number, not \"$maxParallel\""
+	}
+	if {$maxParallel > 1} {
+	    urlParallelMdCopy $topUrl $mdType $pathsInfo $maxParallel
+	    return
+	}
+    }
     foreach pathInfo $pathsInfo {
-	foreach {fromPath toTop finalPath mode expectedMdData xx reloc} $pathInfo {}
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc \
+						    resumeFrom} $pathInfo {break}
 	set toPath [file join $toTop $fromPath]
 	if {$topPath != ""} {
 	    # read from local file
@@ -3634,11 +4562,206 @@ proc multiFetchPaths {contentsName pathsInfo executableTypes versions} {
 	    }
 	    compareMdDataFor $fromPath $expectedMdData $mdData
 	} else {
-	    urlMdCopy $topUrl $fromPath $mdType $expectedMdData $toPath $reloc $mode
+	    urlMdCopy $topUrl $fromPath $mdType $expectedMdData $toPath \
+						    $reloc $mode $resumeFrom
 	}
     }
 }
 
+#
+# Return the downloadCache directory, or an empty string if there is none
+#
+proc getDownloadCache {} {
+    global cfgContents
+    if {![info exists cfgContents(downloadCache)] ||
+				($cfgContents(downloadCache) == "")} {
+	return ""
+    }
+    return [expandTildes $cfgContents(downloadCache)]
+}
+
+#
+# Make the files in pathsInfo (as for urlMultiMdCopy) that are in the
+#   downloadCache directory cache, relocating them as they are copied, and
+#   return the pathsInfo of the rest.  The message digest of each cached
+#   file is checked while it is copied and a bad one is deleted.  The
+#   modification time of the cached files that are used is set to now so
+#   the least recently used ones are the first to be evicted.
+#
+proc downloadCacheGet {cache mdType pathsInfo} {
+    set missingInfo ""
+    set now [clock seconds]
+    foreach pathInfo $pathsInfo {
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc \
+						    resumeFrom} $pathInfo {break}
+	set cached [objectStorePath $cache $mdType $expectedMdData]
+	set toPath [file join $toTop $fromPath]
+	if {[catch {open $cached "r"} fdFrom] != 0} {
+	    lappend missingInfo $pathInfo
+	    continue
+	}
+	set code [catch {
+	    alwaysEvalFor "" {close $fdFrom} {
+		fconfigure $fdFrom -translation binary
+		notrace {file delete -force $toPath}
+		set fdTo [withParentDir \
+			    {openbreloc $toPath $reloc "w" $mode} $toPath]
+		alwaysEvalFor "" {closebreloc $fdTo} {
+		    set mdData [$mdType -copychan $fdTo -chan $fdFrom]
+		}
+	    }
+	    compareMdDataFor $fromPath $expectedMdData $mdData
+	} string]
+	if {$code != 0} {
+	    warnmsg "Deleting bad cached file $cached: $string"
+	    catch {file delete $cached}
+	    catch {file delete -force $toPath}
+	    lappend missingInfo $pathInfo
+	    continue
+	}
+	transfermsg "Using cached $fromPath"
+	catch {changeMtime $cached $now}
+    }
+    return $missingInfo
+}
+
+#
+# Put the files in pathsInfo that have just been fetched into the
+#   downloadCache directory cache, undoing their relocation, and then
+#   evict the least recently used cached files if that makes the cache
+#   larger than downloadCacheSize.  Each file is written under a name of
+#   its own and renamed into place so that other nsbd runs sharing the
+#   cache never see a partial file.  Failures are only reported as debug
+#   messages because the cache is only an optimization.
+#
+proc downloadCachePut {cache mdType pathsInfo} {
+    if {$pathsInfo == ""} {
+	return
+    }
+    set tmpname [info hostname].[pid]
+    set added 0
+    foreach pathInfo $pathsInfo {
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc \
+						    resumeFrom} $pathInfo {break}
+	set cached [objectStorePath $cache $mdType $expectedMdData]
+	if {[file exists $cached]} {
+	    continue
+	}
+	set toPath [file join $toTop $fromPath]
+	set revreloc ""
+	if {[regexp {^(.*)=(.*)$} $reloc x from to]} {
+	    set revreloc "$to=$from"
+	}
+	set tmpcached "$cached.$tmpname"
+	if {[catch {
+	    set fdFrom [openbreloc $toPath $revreloc "r"]
+	    alwaysEvalFor "" {closebreloc $fdFrom} {
+		set fdTo [withParentDir {open $tmpcached "w" 0666} $tmpcached]
+		alwaysEvalFor "" {close $fdTo} {
+		    fconfigure $fdTo -translation binary
+		    set mdData [$mdType -copychan $fdTo -chan $fdFrom]
+		}
+	    }
+	    compareMdDataFor $fromPath $expectedMdData $mdData
+	    # another run may have put the same file in first, that's fine
+	    if {[catch {file rename $tmpcached $cached}] == 0} {
+		set added [expr {$added + [lindex $mdData 0]}]
+	    }
+	} string] != 0} {
+	    debugmsg "could not add $fromPath to download cache: $string"
+	}
+	catch {file delete $tmpcached}
+    }
+    if {$added > 0} {
+	downloadCacheEvict $cache $added
+    }
+}
+
+#
+# Add added bytes to the running total size of the files in the
+#   downloadCache directory cache, which is kept in its "size" file, and
+#   if that is more than downloadCacheSize megabytes delete the least
+#   recently used files until it isn't.  The files are only all looked at
+#   when the total has to be found again or the cache is too big; the
+#   total is found again if there is no size file or it is more than
+#   downloadCacheRescan seconds old, in case some additions were missed.
+#   Only one nsbd run changes the total or evicts at a time.
+#
+set downloadCacheRescan 86400
+proc downloadCacheEvict {cache added} {
+    global cfgContents downloadCacheRescan
+    set maxSize 1024
+    if {[info exists cfgContents(downloadCacheSize)]} {
+	set maxSize $cfgContents(downloadCacheSize)
+	if {![regexp {^[0-9]+$} $maxSize]} {
+	    nsbderror "downloadCacheSize must be a number, not \"$maxSize\""
+	}
+    }
+    set maxSize [expr {$maxSize * 1048576.0}]
+    set lockname [file join $cache evict]
+    if {[catch {lockFile $lockname} string] != 0} {
+	debugmsg "not evicting from download cache: $string"
+	return
+    }
+    alwaysEvalFor "" {unlockFile $lockname} {
+	set sizeFile [file join $cache size]
+	set now [clock seconds]
+	set total ""
+	if {![catch {withOpen fd $sizeFile "r" {gets $fd line}}] &&
+		[regexp {^([0-9.]+) ([0-9]+)$} $line x oldTotal scanTime] &&
+		    ($now - $scanTime < $downloadCacheRescan)} {
+	    set total [expr {$oldTotal + $added}]
+	}
+	if {($total != "") && ($total <= $maxSize)} {
+	    downloadCacheSaveSize $sizeFile $total $scanTime
+	    return
+	}
+	set total 0
+	set entries ""
+	foreach cached [glob -nocomplain [file join $cache * * *]] {
+	    if {[string first "." [file tail $cached]] >= 0} {
+		# being written by downloadCachePut under a temporary name
+		continue
+	    }
+	    if {[catch {file stat $cached statb}] ||
+					($statb(type) != "file")} {
+		continue
+	    }
+	    set total [expr {$total + $statb(size)}]
+	    lappend entries [list $statb(mtime) $statb(size) $cached]
+	}
+	if {$total > $maxSize} {
+	    foreach entry [lsort -integer -index 0 $entries] {
+		foreach {mtime size cached} $entry {}
+		debugmsg "evicting $cached from download cache"
+		if {[catch {file delete $cached}] == 0} {
+		    set total [expr {$total - $size}]
+		    if {$total <= $maxSize} {
+			break
+		    }
+		}
+	    }
+	}
+	downloadCacheSaveSize $sizeFile $total $now
+    }
+}
+
+#
+# Write the total size of the downloadCache files and the time they were
+#   all looked at into sizeFile
+#
+proc downloadCacheSaveSize {sizeFile total scanTime} {
+    if {[catch {
+	set tmpFile "$sizeFile.new"
+	withOpen fd $tmpFile "w" {
+	    puts $fd "[format %.0f $total] $scanTime"
+	}
+	file rename -force $tmpFile $sizeFile
+    } string] != 0} {
+	debugmsg "could not save download cache size: $string"
+    }
+}
+
 #
 # install all the paths listed in nupContents from the temporaryTop directory
 #  to the installTop directory, and clean out the temporaryTop directory.
@@ -3652,6 +4775,7 @@ proc installNupPaths {} {
     set temporaryTop $nupContents(temporaryTop)
     set installTop $nupContents(installTop)
     set package $nupContents(package)
+    set table $nupContents(pathTable)
     set createMask $cfgContents(createMask)
     # dirperm is the default permission used by mkdir
     set dirperm [format "0%o" [expr "0777" & ~$createMask]]
@@ -3665,9 +4789,9 @@ proc installNupPaths {} {
     }
     foreach path $nupContents(paths) {
 	set toPath [file join $installTop $path]
-	if {[info exists nupContents([list paths $path backupPath])]} {
+	if {[pathtable exists $table $path backupPath]} {
 	    if {[file exists $toPath]} {
-		set bPath $nupContents([list paths $path backupPath])
+		set bPath [pathtable get $table $path backupPath]
 		installNupUpdatemsg "Backing up $path to $bPath"
 		set backupPath [file join $installTop $bPath]
 		robustDelete $backupPath $temporaryTop
@@ -3676,14 +4800,14 @@ proc installNupPaths {} {
 	}
 	set group ""
 	set groupmsg ""
-	if {[info exists nupContents([list paths $path group])]} {
-	    set group $nupContents([list paths $path group])
-	    unset nupContents([list paths $path group])
+	if {[pathtable exists $table $path group]} {
+	    set group [pathtable get $table $path group]
+	    pathtable unset $table $path group
 	    set groupmsg " group $group"
 	}
 	if {[isDirectory $path]} {
-	    set perm $nupContents([list paths $path perm])
-	    unset nupContents([list paths $path perm])
+	    set perm [pathtable get $table $path perm]
+	    pathtable unset $table $path perm
 	    if {[set toPathType [robustFileType $toPath]] != "directory"} {
 		installNupUpdatemsg "Making directory $path mode $perm$groupmsg"
 		if {$toPathType != ""} {
@@ -3698,8 +4822,8 @@ proc installNupPaths {} {
 		    changeMode $toPath $perm
 		}
 	    }
-	} elseif {[info exists nupContents([list paths $path linkTo])]} {
-	    set link [relativeLinkPath $nupContents([list paths $path linkTo]) $path]
+	} elseif {[pathtable exists $table $path linkTo]} {
+	    set link [relativeLinkPath [pathtable get $table $path linkTo] $path]
 	    installNupUpdatemsg "Linking $path to $link"
 	    if {[set toPathType [robustFileType $toPath]] == "directory"} {
 		# keep track of directories deleted so we don't try to
@@ -3710,18 +4834,18 @@ proc installNupPaths {} {
 		robustDelete $toPath $temporaryTop
 	    }
 	    notrace {withParentDir {symLink $link $toPath}}
-	} elseif {[info exists nupContents([list paths $path hardLinkTo])]} {
-	    set link $nupContents([list paths $path hardLinkTo])
+	} elseif {[pathtable exists $table $path hardLinkTo]} {
+	    set link [pathtable get $table $path hardLinkTo]
 	    installNupUpdatemsg "Hard-linking $path to $link"
 	    set link [file join $installTop $link]
 	    robustDelete $toPath $temporaryTop
 	    notrace {withParentDir {hardLink $link $toPath}}
 	} else {
-	    set perm $nupContents([list paths $path perm])
-	    unset nupContents([list paths $path perm])
+	    set perm [pathtable get $table $path perm]
+	    pathtable unset $table $path perm
 	    installNupUpdatemsg "Installing $path mode $perm$groupmsg"
 	    robustDelete $toPath $temporaryTop
-	    set loadPath $nupContents([list paths $path loadPath])
+	    set loadPath [pathtable get $table $path loadPath]
 	    notrace {withParentDir \
 		{file rename [file join $temporaryTop $loadPath] $toPath}}
 	    if {$group != ""} {
@@ -3732,15 +4856,15 @@ proc installNupPaths {} {
 	    #   uses the original file permissions less umask bits
 	    changeMode $toPath $perm
 
-	    if {[info exists nupContents([list paths $path mtime])]} {
+	    if {[pathtable exists $table $path mtime]} {
 		if {$preserveMtimes} {
-		    changeMtime $toPath $nupContents([list paths $path mtime])
+		    changeMtime $toPath [pathtable get $table $path mtime]
 		}
-		unset nupContents([list paths $path mtime])
+		pathtable unset $table $path mtime
 	    }
 	}
-	if {[info exists nupContents([list paths $path new])]} {
-	    unset nupContents([list paths $path new])
+	if {[pathtable exists $table $path new]} {
+	    pathtable unset $table $path new
 	}
     }
 
@@ -3780,6 +4904,13 @@ proc installNupPaths {} {
 	    }
 	}
     }
+    if {[info exists nupContents(oldObjects)]} {
+	set objectStore [getObjectStore]
+	if {$objectStore != ""} {
+	    objectStoreRelease $objectStore $nupContents(oldObjects)
+	}
+	unset nupContents(oldObjects)
+    }
     if {($firstmsg != "") && ($procNsbType != "remove")} {
 	updatemsg "No updates to files in package for install top $installTop"
     }
@@ -4105,6 +5236,7 @@ integrity of the person or package.  Register for packages at your own risk.
 		substitutePaths $package nsbContents subContents \
 					    $executableTypes $versions 1
 		set value [calculateValidPaths subContents]
+		clearSubstitutedContents subContents
 	    }
 	    preUpdateCommands {
 		if {$value != ""} {
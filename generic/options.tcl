@@ -53,7 +53,7 @@ proc ensure-options-loaded {} {
 # keywords on the command line.  Instead when the dumpRegistry and dumpConfig
 # options are processed, we go load any specified cfg or nrd files at that
 # time.
-set infoOnlyOptions "-help -? -version -V -license -multigetFiles -dumpRegistry -dumpConfig"
+set infoOnlyOptions "-help -? -version -V -license -multigetFiles -dumpRegistry -dumpConfig -blockDelta"
 
 set optionList {
  {{Print command-line help.}}
@@ -152,6 +152,43 @@ set optionList {
   {gets a $PATH_INFO of /etype and a $QUERY_STRING of pname assuming multiget}
   {is a CGI script.  A leading slash on executableTypes is ignored here.}}
 "-multigetPackage" 4
+
+ {{Run as a long-running http server on the following port number, which may}
+  {be preceded by a host name or address and a colon to listen on only that}
+  {address.  The server answers the same requests as CGI scripts that invoke}
+  {-multigetPackage and -changedPaths, and also serves the stored '.nsb' files}
+  {of registered packages, but it keeps the registry, the stored '.nsb' files}
+  {and the path substitutions of packages loaded between requests and serves}
+  {many clients at the same time.  The requests are:}
+  {    POST /multiget[/executableTypes]?package   (like -multigetPackage)}
+  {    POST /changedPaths?package                 (like -changedPaths)}
+  {    GET /nsb[/executableTypes]?package         (the stored '.nsb' file)}
+  {The registry is read again whenever it changes, and a package's stored}
+  {'.nsb' file whenever the package is updated.}}
+"-multigetServer" 1
+
+ {{Keep running, polling each registered package as soon as its minPollPeriod}
+  {has elapsed, instead of running '-poll all' from cron.  The configuration,}
+  {the registry, good signatures and other things that -poll loads stay in}
+  {memory from one poll to the next, and packages that come due together are}
+  {polled together.  The following parameter is [host:]port on which to take}
+  {requests from other programs, one per line, each answered by "ok" or}
+  {"error: message" when it is done:}
+  {    poll packages       (like -poll; packages may be "all")}
+  {    update packages     (like -update, for urgent releases)}
+  {    schedule            (list the packages in order of next poll time)}
+  {    reload              (read the registry again)}
+  {    stop                (finish the current request and exit)}
+  {The host must be 127.0.0.1 (the default) or localhost, so only programs on}
+  {the same computer can connect.  Any user on it can, though, so the first}
+  {line sent on each connection must be the random key that is written at}
+  {start up into the file pollDaemon.key in the nsbdpath directory, which}
+  {only the user running the daemon can read and which is removed when it}
+  {stops.  A package whose poll fails is polled again after 5 minutes, then}
+  {after twice as long each time it fails again, up to its minPollPeriod.}
+  {The registry is also read again whenever another nsbd changes it, but}
+  {configuration files are only read at start up.}}
+"-pollDaemon" 1
 }
 append optionList {
  {{Display list of paths that have changed for the following registered package}
@@ -267,6 +304,12 @@ append optionList {
   {the command line.}}
 "-dumpConfig" 1
 
+ {}
+"-blockDelta" 1
+
+ {}
+"-auditShare" 3
+
 }
 catch {unset optionTable}
 foreach {c k v} $optionList {
@@ -484,6 +527,9 @@ proc option-register {nsbfile} {
 
 proc procnsbpackages {packages} {
     global procNsbType
+    if {[parallelnsbpackages $packages]} {
+	return
+    }
     set batchList ""
     set batchTop ""
     set batchUrl ""
@@ -570,6 +616,299 @@ proc procnsbpackages {packages} {
     }
 }
 
+#
+# Process packages in up to parallelPackages nsbd processes at the same
+#   time if that is configured, each one running -poll or -update on a
+#   share of the packages.  Packages that share an installTop are given to
+#   the same process.  The processes commit their own registry updates,
+#   which nrdCommitUpdates merges with those of the others.  Return 0 if
+#   the packages are to be processed here instead.
+#
+proc parallelnsbpackages {packages} {
+    global procNsbType guiStarted askReason
+    set maxProcesses [parallelProcesses]
+    if {($maxProcesses == 1) || ([llength $packages] < 2) ||
+	    (($procNsbType != "poll") && ($procNsbType != "update")) ||
+		$guiStarted || [info exists askReason]} {
+	return 0
+    }
+    set groups [groupPackagesByInstallTop $packages]
+    if {[llength $groups] < 2} {
+	return 0
+    }
+    progressmsg "Processing [llength $packages] packages in up to $maxProcesses processes"
+    return [parallelnsbworkers -$procNsbType \
+		[parallelShares $groups [llength $packages] $maxProcesses] \
+		$maxProcesses]
+}
+
+#
+# Return the maximum number of nsbd processes to work on packages at the
+#   same time, from the parallelPackages keyword
+#
+proc parallelProcesses {} {
+    global cfgContents
+    if {![info exists cfgContents(parallelPackages)]} {
+	return 1
+    }
+    set maxProcesses $cfgContents(parallelPackages)
+    if {![regexp {^[0-9]+$} $maxProcesses] || ($maxProcesses < 1)} {
+	nsbderror "parallelPackages must be a positive number, not \"$maxProcesses\""
+    }
+    return $maxProcesses
+}
+
+#
+# Put groups of numItems items in total together into shares for
+#   parallelnsbworkers, keeping each group in one share.  There are several
+#   shares per process so that one slow share doesn't hold up the end of
+#   the run.
+#
+set parallelSharesPerProcess 4
+proc parallelShares {groups numItems maxProcesses} {
+    global parallelSharesPerProcess
+    set numShares [expr {$maxProcesses * $parallelSharesPerProcess}]
+    set shareSize [expr {($numItems + $numShares - 1) / $numShares}]
+    set shares ""
+    set share ""
+    foreach group $groups {
+	eval lappend share $group
+	if {[llength $share] >= $shareSize} {
+	    lappend shares $share
+	    set share ""
+	}
+    }
+    if {$share != ""} {
+	lappend shares $share
+    }
+    return $shares
+}
+
+#
+# Run nsbd option on each of the shares, up to maxProcesses at a time,
+#   and wait for them all to finish.  The output and messages of each
+#   process are shown when it finishes.  If outputsName is given, a list
+#   of the standard output and the messages of each process is instead
+#   saved in a list in that variable in the order of the shares.  Return 0
+#   if the nsbd program couldn't be found, so the work has to be done here.
+#
+proc parallelnsbworkers {option shares maxProcesses {outputsName ""}} {
+    set nsbd [nsbdExecutable]
+    if {$nsbd == ""} {
+	warnmsg "Couldn't find the nsbd program, processing packages one at a time"
+	return 0
+    }
+    set workerArgs [nsbdWorkerArgs]
+    global parallelProcessesRunning parallelOutputs
+    set parallelProcessesRunning 0
+    catch {unset parallelOutputs}
+    set n 0
+    foreach share $shares {
+	while {$parallelProcessesRunning >= $maxProcesses} {
+	    vwait parallelProcessesRunning
+	}
+	set errFile [scratchAddName "par$n"]
+	if {$outputsName == ""} {
+	    set outputVar ""
+	} else {
+	    set outputVar parallelOutputs($n)
+	}
+	debugmsg "Starting nsbd $option $share"
+	set fd [notrace {open [concat | [list $nsbd] $workerArgs \
+		$option $share [list < /dev/null 2> $errFile]] "r"}]
+	fconfigure $fd -blocking 0
+	fileevent $fd readable \
+		[list parallelnsbreadable $fd $errFile $share $outputVar]
+	incr parallelProcessesRunning
+	incr n
+    }
+    while {$parallelProcessesRunning > 0} {
+	vwait parallelProcessesRunning
+    }
+    if {$outputsName != ""} {
+	upvar $outputsName outputs
+	set outputs ""
+	for {set i 0} {$i < $n} {incr i} {
+	    lappend outputs $parallelOutputs($i)
+	}
+	unset parallelOutputs
+    }
+    return 1
+}
+
+#
+# Run nsbd option on shares of the groups of numItems items in up to
+#   parallelPackages processes at the same time if that is configured and
+#   there is more than one group, saving the standard output and messages
+#   of each process in a list in outputsName.  Return 0 if the work is to
+#   be done here instead.
+#
+proc parallelnsbquery {option groups numItems outputsName} {
+    global guiStarted
+    set maxProcesses [parallelProcesses]
+    if {($maxProcesses == 1) || ([llength $groups] < 2) || $guiStarted} {
+	return 0
+    }
+    upvar $outputsName outputs
+    return [parallelnsbworkers $option \
+		[parallelShares $groups $numItems $maxProcesses] \
+		$maxProcesses outputs]
+}
+
+#
+# Divide packages into groups that have no installTop in common.  Packages
+#   with overlapping validPaths always have the same installTop, so they
+#   end up in the same group.  The groups and the packages in them are in
+#   the original order of their first package.
+#
+proc groupPackagesByInstallTop {packages} {
+    applyCmdkeys cmdContents nsb
+    set installTopLists ""
+    foreach package $packages {
+	set installTops ""
+	# any error is left for the package's own processing to report
+	catch {
+	    set executableTypes [getExecutableTypes $package cmdContents 1]
+	    set versions [getVersions $package cmdContents]
+	    set installTops [calculateInstallTops $package \
+					    $executableTypes $versions]
+	}
+	lappend installTopLists $installTops
+    }
+    return [groupOverlapping $packages $installTopLists]
+}
+
+#
+# Divide items into groups such that no two groups have a key in common,
+#   where keyLists has the list of keys of each item.  The groups and the
+#   items in them are in the original order of their first item.
+#
+proc groupOverlapping {items keyLists} {
+    set ids ""
+    set n 0
+    foreach keys $keyLists {
+	# merge all the groups that have one of these keys into a new
+	#   group, numbered by the index of its item
+	set members($n) [list $n]
+	set groupKeys($n) $keys
+	foreach key $keys {
+	    if {![info exists keyGroup($key)]} {
+		continue
+	    }
+	    set id $keyGroup($key)
+	    if {![info exists members($id)]} {
+		# already merged
+		continue
+	    }
+	    eval lappend members($n) $members($id)
+	    eval lappend groupKeys($n) $groupKeys($id)
+	    unset members($id) groupKeys($id)
+	    set idx [lsearch -exact $ids $id]
+	    set ids [lreplace $ids $idx $idx]
+	}
+	foreach key $groupKeys($n) {
+	    set keyGroup($key) $n
+	}
+	lappend ids $n
+	incr n
+    }
+    set firsts ""
+    foreach id $ids {
+	set members($id) [lsort -integer $members($id)]
+	lappend firsts [list [lindex $members($id) 0] $id]
+    }
+    set groups ""
+    foreach first [lsort -integer -index 0 $firsts] {
+	set group ""
+	foreach idx $members([lindex $first 1]) {
+	    lappend group [lindex $items $idx]
+	}
+	lappend groups $group
+    }
+    return $groups
+}
+
+#
+# Return the command line options and keyword settings for an nsbd process
+#   started by parallelnsbworkers to process packages the same way as
+#   this one
+#
+proc nsbdWorkerArgs {} {
+    global cmdKeylist ignoreSecurity unsignedNsbfiles cvsExclude
+    set workerArgs ""
+    foreach {key value} $cmdKeylist {
+	if {$key != "parallelPackages"} {
+	    lappend workerArgs "$key=$value"
+	}
+    }
+    lappend workerArgs "parallelPackages=1"
+    if {$ignoreSecurity} {
+	lappend workerArgs "-ignoreSecurity"
+    }
+    if {$unsignedNsbfiles == 1} {
+	lappend workerArgs "-unsigned"
+    } elseif {$unsignedNsbfiles == 2} {
+	lappend workerArgs "-wait4signature"
+    }
+    if {[info exists cvsExclude]} {
+	lappend workerArgs "-cvsExclude"
+    }
+    return $workerArgs
+}
+
+#
+# Read the output of an nsbd process started by parallelnsbworkers, and
+#   when it finishes show all its messages together.  If outputVar isn't
+#   empty a list of the standard output and the messages is saved in that
+#   global variable instead of being shown.
+#
+proc parallelnsbreadable {fd errFile packages outputVar} {
+    upvar #0 parallelOutput$fd output
+    append output [read $fd]
+    if {![eof $fd]} {
+	return
+    }
+    # wait for the exit status
+    fconfigure $fd -blocking 1
+    set code [catch {close $fd} message]
+    global errorCode
+    set childStatus [lindex $errorCode 0]
+    set messages ""
+    if {[catch {
+	withOpen errFd $errFile "r" {
+	    set messages [read $errFd]
+	}
+    } errMessage] != 0} {
+	debugmsg "couldn't read $errFile: $errMessage"
+    }
+    if {$outputVar != ""} {
+	upvar #0 $outputVar savedOutput
+	set savedOutput [list $output $messages]
+    } else {
+	puts -nonewline $output
+	flush stdout
+	puts -nonewline stderr $messages
+	flush stderr
+    }
+    unset output
+    scratchClean [list $errFile]
+    if {$code != 0} {
+	global nsbPackageFailed
+	foreach package $packages {
+	    set nsbPackageFailed($package) 1
+	}
+	if {$childStatus == "CHILDSTATUS"} {
+	    # the process has already reported its errors
+	    global nsbdExitCode
+	    incr nsbdExitCode
+	} else {
+	    nonfatalerror "Error processing packages $packages:\n  $message"
+	}
+    }
+    global parallelProcessesRunning
+    incr parallelProcessesRunning -1
+}
+
 #
 # process a batch of nsb urls
 # batchList is a list of {package subsitutedNsbUrl} pairs
@@ -579,13 +918,19 @@ proc procnsbpackages {packages} {
 #
 proc donsbpackages {batchList nsbUrl installTop nsbStoreDir} {
     #
-    # when an http 1.1 client is available could also aggregate http
-    #   but for now do only rsync
-    # also, make sure that there is no per-package variation in $nsbUrl
-    #   in the dirname level, because urlRsyncMultiCopy copies relative
-    #   to the directory top
+    # http is aggregated by pipelining the requests on one connection
     #
     global procNsbType
+    if {[regexp -nocase {^http://} $nsbUrl] && ([llength $batchList] > 1) &&
+	    (($procNsbType == "poll") || ($procNsbType == "update"))} {
+	donsbhttppackages $batchList
+	return
+    }
+    #
+    # for rsync make sure that there is no per-package variation in
+    #   $nsbUrl in the dirname level, because urlRsyncMultiCopy copies
+    #   relative to the directory top
+    #
     if {![regexp -nocase {^rsync://} $nsbUrl] ||
 	    ([string first %P [file dirname $nsbUrl]] > 0) ||
 		    ($procNsbType == "audit-update")} {
@@ -642,6 +987,126 @@ proc donsbpackages {batchList nsbUrl installTop nsbStoreDir} {
     catch {file delete $tmpTop $installTmp}
 }
 
+#
+# Process a batch of http nsb urls, keeping up to nsbPipelineDepth
+#   requests pipelined on one kept-alive connection so that an unchanged
+#   '.nsb' file costs a "not modified" response header instead of a round
+#   trip of its own.  The responses outstanding are collected together and
+#   their signatures checked at the same time, then each package is
+#   processed while the next requests are coming.  If a request fails it
+#   is done over the usual way so that the error is reported as before.
+#
+set nsbPipelineDepth 32
+proc donsbhttppackages {batchList} {
+    global procNsbType nsbPipelineDepth
+    set num [llength $batchList]
+    set started 0
+    set received 0
+    for {set n 0} {$n < $num} {incr n} {
+	while {($started < $num) && ($started < ($n + $nsbPipelineDepth))} {
+	    foreach {package url} [lindex $batchList $started] {}
+	    set since ""
+	    if {$procNsbType == "poll"} {
+		set since [nrdLookup $package lastServerPollTime]
+	    }
+	    # fetch the delta from the stored '.nsb' file if there is one
+	    if {[catch {nsbDeltaSource $package} sources($started)] != 0} {
+		set sources($started) ""
+	    }
+	    set fetchUrls($started) $url
+	    if {$sources($started) != ""} {
+		set fetchUrls($started) [lindex $sources($started) 0]
+	    }
+	    set scratchName [scratchAddName "ucp$started"]
+	    if {[catch {urlPipelinedCopyStart $fetchUrls($started) \
+			$scratchName $since} pending($started)] != 0} {
+		debugmsg "couldn't start fetch of $fetchUrls($started): $pending($started)"
+		set pending($started) ""
+	    }
+	    set sinces($started) $since
+	    incr started
+	}
+	if {$n == $received} {
+	    # collect all the responses started so far
+	    set signedFiles ""
+	    for {} {$received < $started} {incr received} {
+		set results($received) [donsbhttpreceive \
+		    [lindex [lindex $batchList $received] 0] \
+		    $received $pending($received) $fetchUrls($received) \
+		    $sinces($received) $sources($received)]
+		foreach {code serverTime scratchName} $results($received) {}
+		if {($code == 0) && ($serverTime != "")} {
+		    lappend signedFiles $scratchName
+		}
+		unset pending($received) sinces($received) \
+			sources($received) fetchUrls($received)
+	    }
+	    global ignoreSecurity
+	    if {!$ignoreSecurity && ([llength $signedFiles] > 1)} {
+		if {[catch {pgpCheckFiles $signedFiles} message] != 0} {
+		    debugmsg "couldn't check the signatures together: $message"
+		}
+	    }
+	}
+	foreach {package url} [lindex $batchList $n] {}
+	foreach {code serverTime scratchName} $results($n) {}
+	unset results($n)
+	if {$code != 0} {
+	    scratchClean [list $scratchName]
+	    catchprocnsbpackage $url $package
+	} elseif {$serverTime == ""} {
+	    # not modified since the last poll
+	    scratchClean [list $scratchName]
+	    nrdUpdate $package set lastTimePolled [currentTime]
+	    nrdCommitUpdates
+	} else {
+	    if {$procNsbType == "poll"} {
+		nrdUpdate $package set lastServerPollTime $serverTime
+	    }
+	    catchprocnsbpackage $url $package $scratchName
+	    scratchClean [list $scratchName]
+	}
+    }
+}
+
+#
+# Wait for the pipelined response n of donsbhttppackages for package, and
+#   apply it if it is a delta.  Return a list of the error code (0 if
+#   successful), the server time (empty if not modified) and the scratch
+#   file holding the '.nsb' file.
+#
+proc donsbhttpreceive {package n pending fetchUrl since source} {
+    set scratchName [scratchName "ucp$n"]
+    set code 1
+    set serverTime ""
+    if {$pending != ""} {
+	foreach {token fd} $pending {}
+	set code [catch {urlPipelinedCopyWait $fetchUrl \
+			    $scratchName $token $fd $since} serverTime]
+	if {$code != 0} {
+	    debugmsg "pipelined fetch of $fetchUrl failed: $serverTime"
+	}
+    }
+    if {($code == 0) && ($serverTime != "") && ($source != "")} {
+	set deltaName $scratchName
+	set scratchName [scratchAddName "ucpd$n"]
+	set baseFile [lindex $source 1]
+	set code [catch {applyNsbDelta $baseFile $deltaName $scratchName} \
+								    message]
+	scratchClean [list $deltaName]
+	if {$code != 0} {
+	    debugmsg "couldn't use $fetchUrl: $message"
+	} else {
+	    progressmsg "Applied $fetchUrl to $baseFile"
+	}
+    }
+    if {($code != 0) && ($source != "")} {
+	# fetch the whole '.nsb' file instead
+	global nsbDeltaFailed
+	set nsbDeltaFailed($package) 1
+    }
+    return [list $code $serverTime $scratchName]
+}
 
 #
 # Catch errors when processing a package
@@ -669,6 +1134,8 @@ proc catchprocnsbpackage {url package {scratchName ""}} {
 	#
 	nonfatalerror "Error processing package $package:\n  $message"
 	nrdAbortUpdates
+	global nsbPackageFailed
+	set nsbPackageFailed($package) 1
     } else {
 	if {$scratchName != ""} {
 	    # suceeded but the scratch file may have been left
@@ -724,43 +1191,22 @@ proc option-updateOnePackage {package} {
 # Process -poll option
 #
 proc option-poll {packages} {
-    global cfgContents procNsbType
+    global procNsbType
     set procNsbType "poll"
     set dopackages ""
     foreach package [expandRegisteredPackages $packages "-poll"] {
-	set minPollPeriod [nrdLookup $package "minPollPeriod"]
-	if {$minPollPeriod == ""} {
-	    if {[info exists cfgContents(minPollPeriod)]} {
-		set minPollPeriod $cfgContents(minPollPeriod)
-	    } else {
-		set minPollPeriod "1d"
-	    }
-	}
-	set number 0
-	set unit "d"
-	scan $minPollPeriod "%d%s" number unit
-	if {$number == 0} {
+	set minPollSeconds [minPollSeconds $package]
+	if {$minPollSeconds == 0} {
 	    progressmsg "Package $package is never polled"
 	    continue
 	}
 	set lastTimePolled [nrdLookup $package lastTimePolled]
 	if {$lastTimePolled != ""} {
-	    set multiplier 0
-	    switch -regexp $unit {
-		m|M {set multiplier 60}
-		h|H {set multiplier [expr {60 * 60}]}
-		d|D {set multiplier [expr {60 * 60 * 24}]}
-		w|W {set multiplier [expr {60 * 60 * 24 * 7}]}
-		default {
-		    nsbderror \
-"minPollPeriod for package $package ($minPollPeriod)
-  must have units of m, h, d, or w"
-		}
-	    }
-	    set number [expr {round($number * $multiplier * 0.98)}]
-	    set nextTime [httpTime [expr {[scanAnyTime $lastTimePolled] + $number}]]
+	    set nextTime [httpTime [expr {[scanAnyTime $lastTimePolled] + $minPollSeconds}]]
 	    if {[compareTimes [currentTime] $nextTime] < 0} {
 		updatemsg "Poll time for package $package not yet arrived: $nextTime"
+		global nsbPackageSkipped
+		set nsbPackageSkipped($package) 1
 		continue
 	    }
 	}
@@ -769,6 +1215,42 @@ proc option-poll {packages} {
     procnsbpackages $dopackages
 }
 
+#
+# Return the number of seconds after a package was last polled that it may
+#   be polled again, from its minPollPeriod less 2 percent, or 0 if it is
+#   never polled
+#
+proc minPollSeconds {package} {
+    global cfgContents
+    set minPollPeriod [nrdLookup $package "minPollPeriod"]
+    if {$minPollPeriod == ""} {
+	if {[info exists cfgContents(minPollPeriod)]} {
+	    set minPollPeriod $cfgContents(minPollPeriod)
+	} else {
+	    set minPollPeriod "1d"
+	}
+    }
+    set number 0
+    set unit "d"
+    scan $minPollPeriod "%d%s" number unit
+    if {$number == 0} {
+	return 0
+    }
+    set multiplier 0
+    switch -regexp $unit {
+	m|M {set multiplier 60}
+	h|H {set multiplier [expr {60 * 60}]}
+	d|D {set multiplier [expr {60 * 60 * 24}]}
+	w|W {set multiplier [expr {60 * 60 * 24 * 7}]}
+	default {
+	    nsbderror \
+"minPollPeriod for package $package ($minPollPeriod)
+  must have units of m, h, d, or w"
+	}
+    }
+    return [expr {round($number * $multiplier * 0.98)}]
+}
+
 #
 # Process -preview option
 #
@@ -810,6 +1292,16 @@ proc option-audit {packages} {
     auditpackages $packages
 }
 
+#
+# Process -auditShare option.  It isn't in the help because it is only run
+#  by auditpackages, to audit one share of the packages in a separate
+#  process and then write the number of errors found to standard output
+#  on a line by itself beginning with "auditErrors: ".
+#
+proc option-auditShare {packages} {
+    auditpackages $packages 1
+}
+
 #
 # Process -remove option
 #
@@ -864,6 +1356,7 @@ proc option-multiget {gettype arg} {
 	set cfgContents(logLevel) -1
 
 	set prefix $arg
+	set revreloc ""
     } elseif {$gettype != "package"} {
 	nsbderror "internal error; gettype not files or package"
     } else {
@@ -876,83 +1369,331 @@ proc option-multiget {gettype arg} {
 	    nsbderror "\"$package\" not registered; -multigetPackage requires registered package"
 	}
 
-	#
-	# figure out everything it takes to apply substitutions
-	#
+	foreach {installTop PathSubstitutions x revreloc} \
+		[multigetPackageInfo $package [getCmdkey executableTypes] \
+						[getCmdkey version]] {break}
+    }
 
-	set executableTypes [getCmdkey executableTypes]
-	if {[string index $executableTypes 0] == "/"} {
-	    # remove leading slash from a $PATH_INFO
-	    set executableTypes [string range $executableTypes 1 end]
-	}
-	if {$executableTypes == ""} {
-	    set executableTypes [nrdLookup $package executableTypes]
-	}
-	set version [getCmdkey version]
-	if {$version == ""} {
-	    set versions [nrdLookup $package versions]
+    # the headers of each file are written together just before its data
+    fconfigure stdout -buffering full
+    puts "Content-Type: application/x-multiget\n"
+
+    # compress files with an encoding that the client accepts, if any
+    set encoding ""
+    if {[info exists env(HTTP_ACCEPT_ENCODING)]} {
+	set encoding [urlChooseEncoding $env(HTTP_ACCEPT_ENCODING)]
+    }
+
+    # Spool the request into a scratch file and read it back a line at a
+    #   time so memory use doesn't grow with the number of paths.  The
+    #   paths are not answered as they arrive on stdin because many web
+    #   servers write the whole request to a CGI program before they
+    #   read any of its output.
+    set request [scratchAddName mgr]
+    withOpen fd $request "w" {
+	fconfigure stdin -translation binary
+	fconfigure $fd -translation binary
+	if {[info exists env(CONTENT_LENGTH)] && ($env(CONTENT_LENGTH) != "")} {
+	    fcopy stdin $fd -size $env(CONTENT_LENGTH)
 	} else {
-	    set versions [list $version]
+	    fcopy stdin $fd
 	}
+    }
+    set rfd [open $request "r"]
+    fconfigure $rfd -translation binary
+    fconfigure stdout -translation binary
+    alwaysEvalFor "" {close $rfd; scratchClean [list $request]} {
+	while {[gets $rfd path] >= 0} {
+	    if {$path == ""} {
+		continue
+	    }
+	    foreach {path offset delta} [multigetParseLine $path] {break}
+	    set sigFile ""
+	    if {$delta != ""} {
+		# the block signatures follow the line
+		set sigFile [scratchAddName "mgk"]
+		withOpen sfd $sigFile "w" {
+		    fconfigure $sfd -translation binary
+		    set n [multigetSignatureBytes $delta]
+		    if {[fcopy $rfd $sfd -size $n] != $n} {
+			nsbderror "block signatures for $path ended early"
+		    }
+		}
+		lappend delta $sigFile
+	    }
+	    if {$gettype == "files"} {
+		set fullPath [file join $prefix $path]
+		set checkPath $fullPath
+	    } else {
+		set fullPath [file join $installTop \
+					[lindex [substitutePath $path] 1]]
+		set checkPath $path
+	    }
+	    if {[set msg [relativePathCheck $checkPath]] != ""} {
+		nsbderror $msg
+	    }
 
-	set nsbStoreFiles [findNsbStoreFiles $package $executableTypes]
-	if {[llength $nsbStoreFiles] < 1} {
-	    nsbderror "can't find any stored '.nsb' files for package $package\n    with executableTypes $executableTypes"
-	}
-	if {[llength $nsbStoreFiles] > 1} {
-	    nsbderror "more than one stored '.nsb' file for package $package\n    with executableTypes $executableTypes"
+	    alwaysEvalFor "" {scratchClean [list $sigFile]} {
+		foreach {fd length} [multigetOpenFile stdout $fullPath $path \
+				    $offset $encoding $delta $revreloc] {}
+		if {$length != ""} {
+		    alwaysEvalFor $fullPath {close $fd} {
+			sendchannel stdout $fd $length
+		    }
+		} else {
+		    alwaysEvalFor $fullPath {closefilter $fd} {
+			while {[set data [read $fd 65536]] != ""} {
+			    multigetPutChunk stdout $data
+			}
+		    }
+		    multigetPutChunk stdout ""
+		}
+	    }
+	    puts ""
 	}
-	set nsbStoreFile [lindex $nsbStoreFiles 0]
+    }
+}
 
-	nsbdParseFile $nsbStoreFile "nsb" contents
+#
+# Process -pollDaemon option
+#
+proc option-pollDaemon {arg} {
+    if {$arg == ""} {
+	nsbderror "port missing for -pollDaemon option"
+    }
+    pollDaemon $arg
+}
 
-	initPathSubstitutions $package contents $executableTypes $versions
+#
+# Process -multigetServer option
+#
 
-	# Since only one '.nsb' file is allowed, if the paths to stored nsb
-	#   files contain %E or %V there must be exactly one in the
-	#   executableTypes or versions arguments respectively.  We cannot
-	#   have fewer nsbfiles than installTops, so we can safely take the
-	#   first one of each when getting installTop.
+proc option-multigetServer {arg} {
+    global procNsbType
+    if {$arg == ""} {
+	nsbderror "port missing for -multigetServer option"
+    }
+    set procNsbType "multigetServer"
+    multigetServer $arg
+}
 
-	set installTop [getInstallTop $package [lindex $executableTypes 0] \
-						[lindex $versions 0]]
+#
+# Figure out everything it takes to apply substitutions to the paths of
+#  registered package for a multiget, for the given executableTypes and
+#  version (or all registered ones if they are empty).  Returns a list of
+#  the installTop, the PathSubstitutions for substitutePath, the stored
+#  '.nsb' file name, and the reverse relocation to undo a relocTop the
+#  files were installed with (or empty if there was none).
+#
+proc multigetPackageInfo {package executableTypes version} {
+    if {[string index $executableTypes 0] == "/"} {
+	# remove leading slash from a $PATH_INFO
+	set executableTypes [string range $executableTypes 1 end]
+    }
+    if {$executableTypes == ""} {
+	set executableTypes [nrdLookup $package executableTypes]
+    }
+    if {$version == ""} {
+	set versions [nrdLookup $package versions]
+    } else {
+	set versions [list $version]
     }
 
-    puts "Content-Type: application/x-multiget\n"
+    set nsbStoreFiles [findNsbStoreFiles $package $executableTypes]
+    if {[llength $nsbStoreFiles] < 1} {
+	nsbderror "can't find any stored '.nsb' files for package $package\n    with executableTypes $executableTypes"
+    }
+    if {[llength $nsbStoreFiles] > 1} {
+	nsbderror "more than one stored '.nsb' file for package $package\n    with executableTypes $executableTypes"
+    }
+    set nsbStoreFile [lindex $nsbStoreFiles 0]
+
+    nsbdParseFile $nsbStoreFile "nsb" nsbContents
+
+    initPathSubstitutions $package nsbContents $executableTypes $versions
+
+    # Since only one '.nsb' file is allowed, if the paths to stored nsb
+    #   files contain %E or %V there must be exactly one in the
+    #   executableTypes or versions arguments respectively.  We cannot
+    #   have fewer nsbfiles than installTops, so we can safely take the
+    #   first one of each when getting installTop.
+
+    set executableType [lindex $executableTypes 0]
+    set version [lindex $versions 0]
+    set installTop [getInstallTop $package $executableType $version]
+
+    # the clients check the files against the message digests in the
+    #   '.nsb' file, which are from before any relocation
+    set revreloc ""
+    set relocTop [getRelocTop $package $executableType $version]
+    if {$relocTop != ""} {
+	set origInstallTop [getOrigInstallTop $package $executableType $version]
+	if {($origInstallTop != "") && ($origInstallTop != $relocTop)} {
+	    set revreloc "$relocTop=$origInstallTop"
+	}
+    }
 
-    foreach path [split [expr {([info exists env(CONTENT_LENGTH)] &&
-				    ($env(CONTENT_LENGTH) != "")) ?
-				[read stdin $env(CONTENT_LENGTH)] :
-				[read stdin]}] "\n"] {
-	if {$path == ""} {
-	    continue
+    return [list $installTop $PathSubstitutions $nsbStoreFile $revreloc]
+}
+
+#
+# Split a line of a multiget request into a list of the path, the number
+#  of bytes of it that the client already has from an interrupted transfer,
+#  and the block size and length of the client's older version of the file
+#  if it wants a delta from that.  The path may be followed by a tab and
+#  the number of bytes, and that may be followed by a tab, the word
+#  "delta", the block size and the length of the older version.  The
+#  block signatures of the older version follow a line with a delta,
+#  making up multigetSignatureBytes bytes with no newline.  The block size
+#  can't be more than multigetMaxBlockSize, which is also the most that
+#  blockdelta in tcldelta.c takes.
+#
+set multigetMaxBlockSize 1048576
+proc multigetParseLine {line} {
+    set offset 0
+    set delta ""
+    if {![regexp "^(\[^\t\]*)\t(\[0-9\]+)(\tdelta (\[0-9\]+) (\[0-9\]+))?\$" \
+			$line x path offset x blocksize length]} {
+	return [list $line $offset $delta]
+    }
+    if {$blocksize != ""} {
+	global multigetMaxBlockSize
+	# scan so leading zeroes don't make it octal
+	if {([string length $blocksize] > 8) ||
+		([scan $blocksize "%d" blocksize] != 1) ||
+		($blocksize <= 0) || ($blocksize > $multigetMaxBlockSize)} {
+	    nsbderror "bad block size $blocksize for a delta of $path"
 	}
-	if {$gettype == "files"} {
-	    set fullPath [file join $prefix $path]
-	    set checkPath $fullPath
-	} else {
-	    set fullPath [file join $installTop [lindex [substitutePath $path] 1]]
-	    set checkPath $path
+	set length [string trimleft $length "0"]
+	if {$length == ""} {
+	    set length 0
 	}
-	if {[set msg [relativePathCheck $checkPath]] != ""} {
-	    nsbderror $msg
+	set delta [list $blocksize $length]
+    }
+    return [list $path $offset $delta]
+}
+
+#
+# Return the number of bytes of block signatures that follow a multiget
+#  request line with delta, the block size and length from multigetParseLine
+#
+proc multigetSignatureBytes {delta} {
+    foreach {blocksize length} $delta {break}
+    if {$blocksize <= 0} {
+	nsbderror "bad block size $blocksize for a delta"
+    }
+    # the length may be too big for an integer
+    return [expr {int(ceil(double($length) / $blocksize)) * 24}]
+}
+
+#
+# Return the command to make a delta of standard input against block
+#  signatures, or an empty string if there is no way to do that here.
+#  The fallback blockdelta procedure in nsbdTclshLib.tcl makes no deltas.
+#
+proc multigetDeltaCommand {} {
+    global multigetDeltaProgram
+    if {![info exists multigetDeltaProgram]} {
+	set multigetDeltaProgram ""
+	if {([info commands blockdelta] != "") &&
+					([info procs blockdelta] == "")} {
+	    set multigetDeltaProgram [nsbdExecutable]
 	}
+    }
+    if {$multigetDeltaProgram == ""} {
+	return ""
+    }
+    return [list $multigetDeltaProgram -blockDelta]
+}
 
-	withOpen fd $fullPath "r" {
-	    file stat $fullPath statb
-	    if {$statb(type) != "file"} {
-		nsbderror "$fullPath is not a file"
-	    }
-	    puts "Content-Name: $path"
-	    puts "Content-Length: $statb(size)\n"
-	    fconfigure $fd -translation binary
-	    set stdoutConfig [fconfigure stdout -translation]
-	    fconfigure stdout -translation binary
-	    fcopy $fd stdout
-	    fconfigure stdout -translation $stdoutConfig
+#
+# Put data on channel out as one chunk of a multiget file sent with
+#  "Transfer-Encoding: chunked": its length in hex on a line and then
+#  the data.  An empty chunk marks the end of the file.
+#
+proc multigetPutChunk {out data} {
+    puts $out [format "%x" [string length $data]]
+    puts -nonewline $out $data
+}
+
+#
+# Open fullPath to send it as path in a multiget response on channel out,
+#  and put out its headers.  The data starts after offset bytes if the
+#  client asked for that.  If delta is not empty it is a list of the block
+#  size and the length of the client's older version of the file and the
+#  name of a file holding its block signatures, and only a delta from that
+#  is sent, with a Content-Delta: header.  The data is compressed with
+#  encoding if that is not empty, with a Content-Encoding: header.  If
+#  revreloc is not empty the relocation of the installed file is undone
+#  first, so the data is the same as what was in the '.nsb' file.  Returns
+#  a list of a file descriptor and the number of bytes in the
+#  Content-Length header, which is how many bytes remain to be copied from
+#  the file descriptor to out.  When any of that is done it is done by a
+#  pipeline of filters as the data is sent, so then the number of bytes
+#  is empty and the file descriptor is the filter to be read to the end
+#  and closed with closefilter, and its data is to be sent in chunks with
+#  multigetPutChunk.
+#
+proc multigetOpenFile {out fullPath path offset encoding {delta ""}
+							    {revreloc ""}} {
+    set fd [notrace {open $fullPath "r"}]
+    set code [catch {
+	file stat $fullPath statb
+	if {$statb(type) != "file"} {
+	    nsbderror "$fullPath is not a file"
+	}
+	puts $out "Content-Name: $path"
+	set start 0
+	set commands ""
+	if {$revreloc != ""} {
+	    # the relocation is undone as the file is read, so it can't be
+	    #   started in the middle
+	    lappend commands [concat [brelocCommand] [list $revreloc]]
+	} elseif {($offset > 0) && ($offset <= $statb(size))} {
+	    set start $offset
+	    puts $out "Content-Offset: $offset"
+	    seek $fd $offset
+	    incr statb(size) -$offset
+	}
+	fconfigure $fd -translation binary
+	# very small files aren't worth starting a compress program for,
+	#   and compressed files aren't worth compressing again
+	set compress [expr {($encoding != "") && ($statb(size) >= 512) &&
+			    ([compressedFileEncoding $fullPath] == "")}]
+	if {($delta != "") && ($start == 0) &&
+			([set command [multigetDeltaCommand]] != "")} {
+	    # the delta is made by a separate process
+	    lappend command $delta
+	    lappend commands $command
+	    puts $out "Content-Delta: [lindex $delta 0]"
+	    set compress [expr {$encoding != ""}]
+	}
+	if {$compress} {
+	    lappend commands [urlEncodingCommand $encoding compress]
+	    puts $out "Content-Encoding: $encoding"
+	}
+	if {$commands != ""} {
+	    # the data comes out of the filter as it is made, so its
+	    #   length isn't known ahead
+	    set filter [openfilterfrom $commands [list <@ $fd]]
+	    close $fd
+	    set fd $filter
+	    puts $out "Transfer-Encoding: chunked\n"
+	    set statb(size) ""
+	} else {
+	    puts $out "Content-Length: $statb(size)\n"
 	}
-	puts ""
+    } string]
+    if {$code != 0} {
+	if {[info exists filter]} {
+	    catch {closefilter $fd}
+	} else {
+	    catch {close $fd}
+	}
+	global errorInfo errorCode
+	return -code $code -errorinfo $errorInfo -errorcode $errorCode $string
     }
+    return [list $fd $statb(size)]
 }
 
 
@@ -1162,40 +1903,40 @@ proc option-getPathPackages {paths} {
 
 	#
 	# Matched more than one package by wildcard, need to look inside
-	#   the packages for a match
+	#   the packages for a match.  Save them to look in all at once.
 	#
+	set pathPackages ""
 	foreach answer $answers {
 	    set package [lindex $answer 0]
-	    set gotone 0
-	    set executableTypes [getExecutableTypes $package cmdContents 1]
-	    set versions [getVersions $package cmdContents]
-	    # as a side effect calculateInstallTops sets a topNsbStoreNames
-	    #  indexed by the installTops, and storeExecutableTypes and
-	    #  storeVersions indexed by the topNsbStoreNames
-	    set installTops \
-		[calculateInstallTops $package $executableTypes $versions]
-	    foreach installTop $installTops {
-		foreach nsbStoreName $topNsbStoreNames($installTop) {
-		    loadOldNsbFile 1 $nsbStoreName $package \
-			    $storeExecutableTypes($nsbStoreName) \
-			    $storeVersions($nsbStoreName)
-		    if {![info exists oldnupContents(paths)]} {
-			continue
-		    }
-		    # Look through the substituted paths for a match
-		    #   with the patterns
-		    foreach otherPath $oldnupContents(paths) {
-			if {$path == $otherPath} {
-			    lappend packages $package
-			    set gotone 1
-			    break
-			}
-		    }
-		    if {$gotone} {
-			break
-		    }
-		}
-		if {$gotone} {
+	    lappend pathPackages $package
+	    lappend lookInPackages $package
+	    lappend lookForPaths($package) $path
+	}
+	lappend lookPaths $path
+	lappend lookPathPackages $pathPackages
+    }
+
+    if {[info exists lookInPackages] &&
+	    [parallelnsbquery -getPathPackages \
+		[groupOverlapping $lookPaths $lookPathPackages] \
+		[llength $lookPaths] outputs]} {
+	# the paths that need to look in the same packages were given to
+	#   the same process, so each package is loaded only once
+	foreach output $outputs {
+	    eval lappend packages [split [string trim [lindex $output 0]] "\n"]
+	    puts -nonewline stderr [lindex $output 1]
+	}
+    } elseif {[info exists lookInPackages]} {
+	foreach loaded [loadOldNsbFiles [lsortUnique $lookInPackages] \
+							    cmdContents] {
+	    set package [lindex $loaded 0]
+	    upvar #0 nupContents_[lindex $loaded 1] contents
+	    if {![info exists contents(pathTable)]} {
+		continue
+	    }
+	    foreach path $lookForPaths($package) {
+		if {[pathtable exists $contents(pathTable) $path loadPath]} {
+		    lappend packages $package
 		    break
 		}
 	    }
@@ -1233,25 +1974,31 @@ proc option-getPackagePaths {packages} {
 	    nonfatalerror "\"$package\" not registered; \"-getPackagePaths\" requires registered package"
 	    continue
 	}
-	set executableTypes [getExecutableTypes $package cmdContents 1]
-	set versions [getVersions $package cmdContents]
-	# as a side effect calculateInstallTops sets a topNsbStoreNames
-	#  indexed by the installTops, and storeExecutableTypes and
-	#  storeVersions indexed by the topNsbStoreNames
-	set installTops \
-	    [calculateInstallTops $package $executableTypes $versions]
-	foreach installTop $installTops {
-	    foreach nsbStoreName $topNsbStoreNames($installTop) {
-		loadOldNsbFile 1 $nsbStoreName $package \
-			$storeExecutableTypes($nsbStoreName) \
-			$storeVersions($nsbStoreName)
-		if {![info exists oldnupContents(paths)]} {
-		    continue
-		}
-		foreach path $oldnupContents(paths) {
-		    puts $path
-		}
-	    }
+	lappend registeredPackages $package
+    }
+    if {![info exists registeredPackages]} {
+	return
+    }
+    set groups ""
+    foreach package $registeredPackages {
+	lappend groups [list $package]
+    }
+    if {[parallelnsbquery -getPackagePaths $groups \
+			    [llength $registeredPackages] outputs]} {
+	foreach output $outputs {
+	    puts -nonewline [lindex $output 0]
+	    puts -nonewline stderr [lindex $output 1]
+	}
+	return
+    }
+
+    foreach loaded [loadOldNsbFiles $registeredPackages cmdContents] {
+	upvar #0 nupContents_[lindex $loaded 1] contents
+	if {![info exists contents(paths)]} {
+	    continue
+	}
+	foreach path $contents(paths) {
+	    puts $path
 	}
     }
 }
@@ -1296,6 +2043,26 @@ proc option-signFile {file} {
     pgpSignFile $file $file
 }
 
+#
+# Process -blockDelta option.  It isn't in the help because it is only run
+#  by multigetOpenFile, to write to standard output a delta of standard
+#  input against block signatures.  The parameter is a list of the block
+#  size, the length of the file the signatures are of and the name of the
+#  file holding them.
+#
+
+proc option-blockDelta {arg} {
+    foreach {blocksize length sigFile} $arg {break}
+    fconfigure stdin -translation binary
+    fconfigure stdout -translation binary
+    withOpen fd $sigFile "r" {
+	fconfigure $fd -translation binary
+	blockdelta delta stdin stdout $blocksize $length $fd
+    }
+    # exit here because this is an infoOnlyOption
+    nsbdExit
+}
+
 #
 # Process -getUrl option
 #
@@ -258,35 +258,13 @@ proc pgpSignFile {inFile outFile} {
 }
 
 #
-# Check the pgp signature in $sigFile.  sigFile may be a temporary name, so
-#   use forFile as the name for error messages instead; if forFile is empty
-#   no name will be added to the error messages.
-# Return value is in 4 parts:
-#   1. The pgp variant.
-#   2. A boolean (1 or 0) that indicates if the signature was good or not.
-#   3. A list of the ids of the signature, if they could be determined
-#      (good or bad).  If the public key could not be found, the id returned
-#      is "*UNKNOWN*".
-#   4. Any warning or error messages, possibly including newlines.
-
-proc pgpCheckFile {signedFile {forFile ""}} {
-    # Note: there are two reasons to separate the plaintext from the signature
-    #  into two temporary files.  One is to allow multiple signatures in the
-    #  future, and the other is that with a combined file pgp will attempt to
-    #  create a plaintext file without the signature.  The only way around that
-    #  is to apply the option "-o $signedFile" so the default filename will be
-    #  the same as $inFile and it won't overwrite an existing file and it will
-    #  return an error code.
-    progressmsg "Checking PGP signature on [expr {$forFile == "" ? $signedFile : $forFile}]"
-    set ans [getpgp verify]
-    set pgp [lindex $ans 0]
-    set variant [lindex $ans 1]
-    set signedFile [expandTildes $signedFile]
-    # pgp5 requires extension on a detached signature !@$%
-    set sigFile [scratchAddName "pln.sig"]
-    set plainFile [scratchAddName "pln"]
+# Separate the signed text in signedFile, which may be compressed, from its
+#   signature into plainFile and sigFile.  Return 1 if a complete signature
+#   block was found, otherwise 0.
+#
+proc pgpSplitSigned {signedFile plainFile sigFile} {
     set foundsig 0
-    withOpen fd $signedFile "r" {
+    withOpenUncompressed fd $signedFile {
 	withOpen fdplain $plainFile "w" {
 	    gets $fd line
 	    while {[string range $line 0 4] == "-----"} {
@@ -336,6 +314,44 @@ proc pgpCheckFile {signedFile {forFile ""}} {
 	    }
 	}
     }
+    return $foundsig
+}
+
+#
+# Check the pgp signature in $sigFile.  sigFile may be a temporary name, so
+#   use forFile as the name for error messages instead; if forFile is empty
+#   no name will be added to the error messages.
+# Return value is in 4 parts:
+#   1. The pgp variant.
+#   2. A boolean (1 or 0) that indicates if the signature was good or not.
+#   3. A list of the ids of the signature, if they could be determined
+#      (good or bad).  If the public key could not be found, the id returned
+#      is "*UNKNOWN*".
+#   4. Any warning or error messages, possibly including newlines.
+
+proc pgpCheckFile {signedFile {forFile ""}} {
+    # Note: there are two reasons to separate the plaintext from the signature
+    #  into two temporary files.  One is to allow multiple signatures in the
+    #  future, and the other is that with a combined file pgp will attempt to
+    #  create a plaintext file without the signature.  The only way around that
+    #  is to apply the option "-o $signedFile" so the default filename will be
+    #  the same as $inFile and it won't overwrite an existing file and it will
+    #  return an error code.
+    progressmsg "Checking PGP signature on [expr {$forFile == "" ? $signedFile : $forFile}]"
+    set ans [getpgp verify]
+    set pgp [lindex $ans 0]
+    set variant [lindex $ans 1]
+    set signedFile [expandTildes $signedFile]
+    set cacheKey [pgpSigCacheKey $signedFile $pgp $variant]
+    set ans [pgpSigCacheLookup $cacheKey]
+    if {$ans != ""} {
+	debugmsg "Found the good signature in the signatureCache"
+	return $ans
+    }
+    # pgp5 requires extension on a detached signature !@$%
+    set sigFile [scratchAddName "pln.sig"]
+    set plainFile [scratchAddName "pln"]
+    set foundsig [pgpSplitSigned $signedFile $plainFile $sigFile]
     if {!$foundsig} {
 	scratchClean "pln"
 	scratchClean "pln.sig"
@@ -343,10 +359,22 @@ proc pgpCheckFile {signedFile {forFile ""}} {
     }
 
     if {$variant == "gpg"} {
-	set pgpopts "--batch --verify"
-    } else {
-	set pgpopts "+batchmode"
+	set fd [pgpGpgStatusOpen $pgp $sigFile $plainFile]
+	alwaysEvalFor "" {catch {close $fd}} {
+	    while {[gets $fd line] >= 0} {
+		pgpGpgStatusLine result $line
+	    }
+	}
+	scratchClean "pln.sig"
+	scratchClean "pln"
+	set ans [pgpGpgStatusResult result]
+	if {[lindex $ans 1]} {
+	    pgpSigCacheAdd $cacheKey $ans
+	}
+	return $ans
     }
+
+    set pgpopts "+batchmode"
     set fd [notrace {popen "$pgp $pgpopts $sigFile $plainFile" "r"}]
     set good 0
     set ids ""
@@ -536,7 +564,149 @@ proc pgpCheckFile {signedFile {forFile ""}} {
     set ids $newids
     scratchClean "pln.sig"
     scratchClean "pln"
-    return [list $variant $good $ids $warning]
+    set ans [list $variant $good $ids $warning]
+    if {$good} {
+	pgpSigCacheAdd $cacheKey $ans
+    }
+    return $ans
+}
+
+#
+# Return the name of the signatureCache file, or empty if there is none
+#
+proc pgpSigCacheFile {} {
+    global cfgContents
+    set cacheFile "sigcache"
+    if {[info exists cfgContents(signatureCache)]} {
+	set cacheFile $cfgContents(signatureCache)
+    }
+    if {($cacheFile == "") || ![info exists cfgContents(nsbdpath)] ||
+		    ($cfgContents(nsbdpath) == "")} {
+	return ""
+    }
+    return [file join $cfgContents(nsbdpath) [expandTildes $cacheFile]]
+}
+
+#
+# Return the key ring files that pgp, of the given variant, might check
+#   signatures with
+#
+proc pgpKeyringFiles {pgp variant} {
+    global cfgContents env
+    if {[info exists cfgContents(pgppath)]} {
+	set dirs [list [expandTildes $cfgContents(pgppath)]]
+    } elseif {($variant == "gpg") && [info exists env(GNUPGHOME)]} {
+	set dirs [list $env(GNUPGHOME)]
+    } elseif {$variant == "gpg"} {
+	set dirs [list [expandTildes "~/.gnupg"]]
+    } elseif {[info exists env(PGPPATH)]} {
+	set dirs [list $env(PGPPATH)]
+    } else {
+	set dirs [list [expandTildes "~/.pgp"]]
+    }
+    set files ""
+    set option ""
+    foreach word [split $pgp " \t="] {
+	if {$option == "--homedir"} {
+	    lappend dirs [expandTildes $word]
+	} elseif {$option == "--keyring"} {
+	    lappend files [expandTildes $word]
+	}
+	set option $word
+    }
+    foreach dir $dirs {
+	foreach name {pubring.gpg pubring.kbx trustdb.gpg pubring.pgp \
+							    pubring.pkr} {
+	    lappend files [file join $dir $name]
+	}
+    }
+    return $files
+}
+
+#
+# Return the signatureCache key for checking the signature on signedFile,
+#   which may be compressed, with pgp
+#
+proc pgpSigCacheKey {signedFile pgp variant} {
+    set stamp [list $pgp]
+    foreach keyring [pgpKeyringFiles $pgp $variant] {
+	if {[file exists $keyring]} {
+	    file stat $keyring statb
+	    lappend stamp [list $keyring $statb(size) $statb(mtime)]
+	}
+    }
+    withOpenUncompressed fd $signedFile {
+	fconfigure $fd -translation binary
+	set fileDigest [lindex [sha1 -chan $fd] 1]
+    }
+    return "$fileDigest [sha1 -string $stamp]"
+}
+
+set pgpSigCacheMax 10000
+
+#
+# Return the result cached for cacheKey, or empty if there is none.
+#   Reads the signatureCache file the first time, and if it has grown
+#   past pgpSigCacheMax entries rewrites it with just the newest half.
+#
+proc pgpSigCacheLookup {cacheKey} {
+    global pgpSigCache pgpSigCacheMax
+    if {![info exists pgpSigCache]} {
+	set pgpSigCache(loaded) ""
+	set cacheFile [pgpSigCacheFile]
+	if {($cacheFile == "") || ![file exists $cacheFile]} {
+	    return ""
+	}
+	set entries ""
+	withOpen fd $cacheFile "r" {
+	    while {[gets $fd line] >= 0} {
+		if {[catch {llength $line} n] || ($n != 2)} {
+		    continue
+		}
+		set pgpSigCache([lindex $line 0]) [join [lindex $line 1] "\n"]
+		lappend entries $line
+	    }
+	}
+	set numEntries [llength $entries]
+	if {$numEntries > $pgpSigCacheMax} {
+	    debugmsg "Trimming $cacheFile"
+	    # other nsbd processes may be trimming it at the same time
+	    set newCacheFile "$cacheFile.new[pid]"
+	    withOpen fd $newCacheFile "w" {
+		foreach line [lrange $entries \
+			    [expr {$numEntries - $pgpSigCacheMax / 2}] end] {
+		    puts $fd $line
+		}
+	    }
+	    file rename -force $newCacheFile $cacheFile
+	}
+    }
+    if {[info exists pgpSigCache($cacheKey)]} {
+	return $pgpSigCache($cacheKey)
+    }
+    return ""
+}
+
+#
+# Remember the result of a good signature check under cacheKey, for the
+#   rest of the run and in the signatureCache file if there is one
+#
+proc pgpSigCacheAdd {cacheKey ans} {
+    global pgpSigCache
+    pgpSigCacheLookup $cacheKey
+    set pgpSigCache($cacheKey) $ans
+    set cacheFile [pgpSigCacheFile]
+    if {$cacheFile == ""} {
+	return
+    }
+    if {[catch {
+	withOpen fd $cacheFile "a" {
+	    # split so that warnings with newlines stay on one line
+	    puts $fd [list $cacheKey [split $ans "\n"]]
+	}
+    } message] != 0} {
+	debugmsg "couldn't add to signatureCache: $message"
+    }
 }
 
 #
@@ -679,3 +849,170 @@ proc pgpAddKey {id keyfile} {
 	nsbderror "pgpAddKey for variant $variant not implemented yet"
     }
 }
+
+#
+# Start gpg checking the detached signature in sigFile of plainFile, and
+#   return a channel on its machine-readable --status-fd output
+#
+proc pgpGpgStatusOpen {pgp sigFile plainFile} {
+    return [notrace {popen "$pgp --batch --status-fd 1 --verify $sigFile $plainFile 2>/dev/null" "r"}]
+}
+
+#
+# Interpret a line of gpg --status-fd output, gathering the result into
+#   the array named resultName.  These lines are meant for programs, so
+#   unlike the messages for people they don't change between versions.
+#
+proc pgpGpgStatusLine {resultName line} {
+    upvar $resultName result
+    if {![info exists result(good)]} {
+	set result(good) 0
+	set result(bad) 0
+	set result(ids) ""
+	set result(warning) ""
+    }
+    debugmsg "gpg sent: $line"
+    if {![regexp {^\[GNUPG:\] ([A-Z_]+) ?(.*)$} $line x keyword rest]} {
+	return
+    }
+    set keyid ""
+    set user ""
+    if {[regexp {^([0-9A-F]+) ?(.*)$} $rest x keyid user]} {
+	# the same short key id that gpg shows people
+	set len [string length $keyid]
+	set keyid "0x[string range $keyid [expr {$len - 8}] end]"
+    }
+    switch -- $keyword {
+	GOODSIG - EXPKEYSIG {
+	    set result(good) 1
+	    lappend result(ids) $keyid $user
+	    if {$keyword == "EXPKEYSIG"} {
+		lappend result(warning) \
+			"The key that made the signature has expired"
+	    }
+	}
+	BADSIG - EXPSIG - REVKEYSIG {
+	    set result(bad) 1
+	    lappend result(ids) $keyid $user
+	    if {$keyword == "EXPSIG"} {
+		lappend result(warning) "The signature has expired"
+	    } elseif {$keyword == "REVKEYSIG"} {
+		lappend result(warning) \
+			"The key that made the signature has been revoked"
+	    }
+	}
+	ERRSIG {
+	    set result(bad) 1
+	    if {[lindex [split $rest " "] 5] == 9} {
+		set result(ids) "*UNKNOWN*"
+		lappend result(warning) \
+			"Can't check signature: public key $keyid not found"
+	    } else {
+		lappend result(warning) "Can't check signature"
+	    }
+	}
+	NODATA {
+	    # this can come more than once for the same signature
+	    if {!$result(bad)} {
+		lappend result(warning) "No signature found"
+	    }
+	    set result(bad) 1
+	}
+	TRUST_UNDEFINED - TRUST_NEVER {
+	    lappend result(warning) \
+			"This key is not certified with a trusted signature!"
+	}
+    }
+}
+
+#
+# Return the result gathered by pgpGpgStatusLine in the form that
+#   pgpCheckFile returns
+#
+proc pgpGpgStatusResult {resultName} {
+    upvar $resultName result
+    if {![info exists result(good)]} {
+	return {gpg 0 "" "No status from gpg"}
+    }
+    return [list gpg [expr {$result(good) && !$result(bad)}] $result(ids) \
+					[join $result(warning) "\n"]]
+}
+
+set pgpMaxParallelChecks 8
+
+#
+# Check the signatures of many signed files ahead of pgpCheckFile, running
+#   up to pgpMaxParallelChecks gpg processes at once, and put the good ones
+#   into the signatureCache so that pgpCheckFile finds them there.  Does
+#   nothing for other pgp variants, and leaves bad signatures for
+#   pgpCheckFile to check and report one at a time.
+#
+proc pgpCheckFiles {signedFiles} {
+    set ans [getpgp verify]
+    set pgp [lindex $ans 0]
+    set variant [lindex $ans 1]
+    if {$variant != "gpg"} {
+	return
+    }
+    set scratchNames ""
+    alwaysEvalFor "" {
+	if {$scratchNames != ""} {
+	    scratchClean $scratchNames
+	}
+    } {
+	set checks ""
+	foreach signedFile $signedFiles {
+	    set cacheKey [pgpSigCacheKey $signedFile $pgp $variant]
+	    if {[pgpSigCacheLookup $cacheKey] != ""} {
+		continue
+	    }
+	    set n [expr {[llength $scratchNames] / 2}]
+	    set plainFile [scratchAddName "pgb$n"]
+	    set sigFile [scratchAddName "pgb$n.sig"]
+	    lappend scratchNames "pgb$n" "pgb$n.sig"
+	    if {[pgpSplitSigned $signedFile $plainFile $sigFile]} {
+		lappend checks [list $cacheKey $sigFile $plainFile]
+	    }
+	}
+	if {[llength $checks] > 1} {
+	    global pgpMaxParallelChecks pgpChecksRunning
+	    progressmsg "Checking [llength $checks] PGP signatures"
+	    set pgpChecksRunning 0
+	    foreach check $checks {
+		while {$pgpChecksRunning >= $pgpMaxParallelChecks} {
+		    vwait pgpChecksRunning
+		}
+		set fd [pgpGpgStatusOpen $pgp [lindex $check 1] [lindex $check 2]]
+		fconfigure $fd -blocking 0
+		fileevent $fd readable \
+			[list pgpCheckReadable $fd [lindex $check 0]]
+		incr pgpChecksRunning
+	    }
+	    while {$pgpChecksRunning > 0} {
+		vwait pgpChecksRunning
+	    }
+	}
+    }
+}
+
+#
+# Read the status output of a gpg started by pgpCheckFiles, and when it
+#   finishes add the result to the signatureCache if it is good
+#
+proc pgpCheckReadable {fd cacheKey} {
+    upvar #0 pgpCheckResult$fd result
+    while {[gets $fd line] >= 0} {
+	pgpGpgStatusLine result $line
+    }
+    if {![eof $fd]} {
+	return
+    }
+    catch {close $fd}
+    set ans [pgpGpgStatusResult result]
+    catch {unset result}
+    if {[lindex $ans 1]} {
+	pgpSigCacheAdd $cacheKey $ans
+    }
+    global pgpChecksRunning
+    incr pgpChecksRunning -1
+}
@@ -19,9 +19,9 @@
 # GNU General Public License for more details.
 
 proc nrdInit {} {
-    global nrdContentsCache nrdContentsCacheTime
+    global nrdContentsCache nrdContentsCacheStamp
     catch {unset nrdContentsCache}
-    set nrdContentsCacheTime 0
+    set nrdContentsCacheStamp ""
     global nrdUpdatePackage nrdUpdates nrdNumChanges
     set nrdUpdatePackage ""
     set nrdUpdates ""
@@ -41,7 +41,7 @@ proc nrdLookup {package keyword} {
     }
 
     global cfgContents nrdFileName
-    global nrdContentsCache nrdContentsCacheTime nrdPackagesCache
+    global nrdContentsCache nrdContentsCacheStamp nrdPackagesCache
     #
     # Only read the registry database file once during a run when
     #   looking things up.  I assume that writes by another NSBD program
@@ -49,14 +49,14 @@ proc nrdLookup {package keyword} {
     #
     if {![info exists nrdContentsCache(packages)]} {
 	if {[file exists $nrdFileName]} {
-	    file stat $nrdFileName statb
-	    set nrdContentsCacheTime $statb(mtime)
 	    if {[file writable [file dirname $nrdFileName]]} {
 		# lock out other writers while reading if possible
 		lockFile $nrdFileName
+		set nrdContentsCacheStamp [nrdFileStamp]
 		procfile $nrdFileName nrd nrdContentsCache
 		unlockFile $nrdFileName
 	    } else {
+		set nrdContentsCacheStamp [nrdFileStamp]
 		procfile $nrdFileName nrd nrdContentsCache
 	    }
 	} elseif {![info exists nrdPackagesCache]} {
@@ -236,20 +236,20 @@ proc nrdCommitUpdates {} {
 	# nothing to do
 	return ""
     }
-    global cfgContents nrdContentsCache nrdContentsCacheTime nrdFileName
+    global cfgContents nrdContentsCache nrdContentsCacheStamp nrdFileName
     lockFile $nrdFileName
     if {[file exists $nrdFileName]} {
-	file stat $nrdFileName statb
-	if {$statb(mtime) > $nrdContentsCacheTime} {
-	    # Old file has changed since we last checked
-	    # Re-read it, and re-apply updates
-	    catch {unset nrdContentsCache}
-	    procfile $nrdFileName nrd nrdContentsCache
-	    set nrdContentsCacheTime $statb(mtime)
-	    set nrdNumChanges 0
-	    foreach opKeyVal $nrdUpdates {
-		eval nrdApplyUpdate $nrdUpdatePackage $opKeyVal
-	    }
+	# Another nsbd process, such as one running packages in parallel,
+	#   may have written it since we last read or wrote it without
+	#   changing its nrdFileStamp, because an inode number can be used
+	#   again for a file of the same size in the same second
+	# Re-read it while it is locked, and re-apply updates
+	catch {unset nrdContentsCache}
+	set nrdContentsCacheStamp [nrdFileStamp]
+	procfile $nrdFileName nrd nrdContentsCache
+	set nrdNumChanges 0
+	foreach opKeyVal $nrdUpdates {
+	    eval nrdApplyUpdate $nrdUpdatePackage $opKeyVal
 	}
     }
     progressmsg "Updating $nrdFileName"
@@ -270,14 +270,39 @@ proc nrdCommitUpdates {} {
 	file rename -force $nrdFileName [addFilePrefix $nrdFileName old]
     }
     file rename $newRegName $nrdFileName
-    file stat $nrdFileName statb
-    set nrdContentsCacheTime $statb(mtime)
+    set nrdContentsCacheStamp [nrdFileStamp]
     unlockFile $nrdFileName
     set nrdUpdatePackage ""
     set nrdUpdates ""
     set nrdNumChanges 0
 }
 
+#
+# Return what tells apart versions of the registry database file, or an
+#  empty string if there is none.  Every update writes a new file and
+#  renames it into place, so its inode number usually changes even when
+#  the modification time, which is only to the second, does not.  The
+#  inode number of a removed old file can be given to the new one, so
+#  this is only good enough to decide when to read the file again to look
+#  things up, not before writing it.
+#
+proc nrdFileStamp {} {
+    global nrdFileName
+    if {[catch {file stat $nrdFileName statb}] != 0} {
+	return ""
+    }
+    return [list $statb(ino) $statb(mtime) $statb(size)]
+}
+
+#
+# Return 1 if the registry database file is not the one this program
+#  last read or wrote, otherwise 0
+#
+proc nrdFileChanged {} {
+    global nrdContentsCacheStamp
+    return [expr {[string compare [nrdFileStamp] $nrdContentsCacheStamp] != 0}]
+}
+
 #
 # Abort cached database changes
 #
@@ -0,0 +1,712 @@
+#
+# Long-running http server for the -multigetServer option.  It answers the
+#   same requests as CGI scripts that invoke nsbd -multigetPackage and
+#   -changedPaths, and serves the stored '.nsb' files of registered packages,
+#   but the registry, the stored '.nsb' files and the path substitutions of
+#   packages stay loaded between requests instead of being read again by a
+#   new process for every request.  All the connections are handled from
+#   the event loop so many clients can be served at the same time.
+#
+# Copyright (C) 1996-2003 by Dave Dykstra and Lucent Technologies
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# If those terms are not sufficient for you, contact the author to
+# discuss the possibility of an alternate license.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+#
+# Serve requests on address, which is a port number optionally preceded
+#  by a host name or address and a colon.  Does not return until
+#  multigetServerStop is set.
+#
+proc multigetServer {address} {
+    if {![regexp {^(([^:]*):)?([0-9]+)$} $address x y host port]} {
+	nsbderror "-multigetServer parameter must be \[host:\]port, got $address"
+    }
+    # nothing is ever updated, so the signatures of '.nsb' files that
+    #   are posted for changedPaths don't need to be checked
+    option-ignoreSecurity
+
+    if {$host != ""} {
+	set listener [notrace {socket -server multigetServerAccept \
+						    -myaddr $host $port}]
+    } else {
+	set listener [notrace {socket -server multigetServerAccept $port}]
+    }
+    noticemsg "Serving multiget requests on port $port"
+    global multigetServerStop
+    vwait multigetServerStop
+    close $listener
+}
+
+#
+# Accept a new connection.  It is closed if nothing at all happens on it
+#  for multigetServerIdleSeconds.
+#
+set multigetServerIdleSeconds 300
+proc multigetServerAccept {sock addr port} {
+    upvar #0 multigetServer$sock conn
+    catch {unset conn}
+    set conn(addr) $addr
+    set conn(state) request
+    set conn(length) 0
+    # read the request header lines in text mode, and write everything in
+    #   binary so multiget data isn't translated
+    fconfigure $sock -blocking off -translation {auto binary}
+    fileevent $sock readable [list multigetServerEval $sock \
+					[list multigetServerRead $sock]]
+    multigetServerActive $sock
+}
+
+#
+# Start over the wait for the connection on sock to be idle
+#
+proc multigetServerActive {sock} {
+    upvar #0 multigetServer$sock conn
+    global multigetServerIdleSeconds
+    if {![info exists conn]} {
+	return
+    }
+    if {[info exists conn(idle)]} {
+	after cancel $conn(idle)
+    }
+    set conn(idle) [after [expr {$multigetServerIdleSeconds * 1000}] \
+					    [list multigetServerIdle $sock]]
+}
+
+#
+# Close the connection on sock because nothing has happened on it
+#
+proc multigetServerIdle {sock} {
+    upvar #0 multigetServer$sock conn
+    global multigetServerIdleSeconds
+    unset conn(idle)
+    warnmsg "closing connection from $conn(addr) after $multigetServerIdleSeconds seconds idle"
+    multigetServerClose $sock
+}
+
+#
+# Evaluate script for the connection on sock, and if it has an error
+#  report it to the client and close the connection.
+#
+proc multigetServerEval {sock script} {
+    multigetServerActive $sock
+    if {[catch {uplevel #0 $script} msg] != 0} {
+	multigetServerError $sock $msg
+    }
+}
+
+#
+# Read the request from sock as it arrives, and respond when it is complete
+#
+proc multigetServerRead {sock} {
+    upvar #0 multigetServer$sock conn
+    if {$conn(state) == "paths"} {
+	multigetServerReadPaths $sock
+	return
+    }
+    if {$conn(state) == "body"} {
+	set data [read $sock $conn(length)]
+	incr conn(length) -[string length $data]
+	puts -nonewline $conn(bodyfd) $data
+	if {$conn(length) == 0} {
+	    close $conn(bodyfd)
+	    unset conn(bodyfd)
+	    fileevent $sock readable {}
+	    multigetServerRespond $sock
+	} elseif {[eof $sock]} {
+	    multigetServerClose $sock
+	}
+	return
+    }
+    while {[gets $sock line] >= 0} {
+	if {$conn(state) == "request"} {
+	    if {$line == ""} {
+		# allowed before the request line
+		continue
+	    }
+	    if {![regexp {^([A-Z]+) +([^ ]+)} $line x method uri]} {
+		nsbderror "bad http request line: [string range $line 0 60]"
+	    }
+	    set conn(method) $method
+	    set conn(uri) $uri
+	    set conn(state) headers
+	} elseif {$line != ""} {
+	    if {[regexp {^([^:]+):(.*)$} $line x keyword value]} {
+		set conn(h,[string tolower $keyword]) [string trim $value]
+	    }
+	} else {
+	    if {[info exists conn(h,content-length)]} {
+		# no more than 9 digits so it fits in an integer, and scanned
+		#   so leading zeroes don't make it octal
+		if {![regexp {^[0-9]+$} $conn(h,content-length)] ||
+			([string length $conn(h,content-length)] > 9)} {
+		    nsbderror "bad Content-Length [string range $conn(h,content-length) 0 60]"
+		}
+		scan $conn(h,content-length) "%d" conn(length)
+	    }
+	    if {$conn(length) > 0} {
+		fconfigure $sock -translation binary
+		if {($conn(method) == "POST") &&
+			    [regexp {^/multiget(/[^?]*)?(\?|$)} $conn(uri)]} {
+		    # the paths of a multiget are answered as they arrive
+		    #   instead of after the whole request has been read
+		    set conn(state) paths
+		    multigetServerRespond $sock
+		} else {
+		    multigetServerStartBody $sock
+		}
+		multigetServerRead $sock
+	    } else {
+		fileevent $sock readable {}
+		multigetServerRespond $sock
+	    }
+	    return
+	}
+    }
+    if {[eof $sock]} {
+	multigetServerClose $sock
+    }
+}
+
+#
+# Get ready to save the body of the request on sock in a scratch file as
+#  it arrives.  Only a changedPaths request has one, the '.nsb' file, and
+#  it can't be more than multigetServerMaxBody bytes.
+#
+set multigetServerMaxBody [expr {32 * 1024 * 1024}]
+proc multigetServerStartBody {sock} {
+    upvar #0 multigetServer$sock conn
+    global multigetServerMaxBody multigetServerNsbCount
+    if {($conn(method) != "POST") ||
+		![regexp {^/changedPaths(\?|$)} $conn(uri)]} {
+	nsbderror "$conn(method) [string range $conn(uri) 0 60] doesn't take a request body"
+    }
+    if {$conn(length) > $multigetServerMaxBody} {
+	nsbderror "posted '.nsb' file of $conn(length) bytes is more than the limit of $multigetServerMaxBody"
+    }
+    set conn(nsbScratch) [scratchAddName "mgs[incr multigetServerNsbCount]"]
+    set conn(bodyfd) [open $conn(nsbScratch) "w"]
+    fconfigure $conn(bodyfd) -translation binary
+    set conn(state) body
+}
+
+#
+# Respond to a complete request
+#
+proc multigetServerRespond {sock} {
+    upvar #0 multigetServer$sock conn
+    regexp {^([^?]*)(\?(.*))?$} $conn(uri) x urlpath y package
+    transfermsg "$conn(method) $conn(uri) from $conn(addr)"
+    multigetServerRefresh
+    if {[regexp {^/multiget(/.*)?$} $urlpath x executableTypes] &&
+					($conn(method) == "POST")} {
+	multigetServerMultiget $sock $package $executableTypes
+    } elseif {[regexp {^/nsb(/.*)?$} $urlpath x executableTypes] &&
+		    (($conn(method) == "GET") || ($conn(method) == "HEAD"))} {
+	multigetServerNsb $sock $package $executableTypes
+    } elseif {($urlpath == "/changedPaths") && ($conn(method) == "POST")} {
+	multigetServerChangedPaths $sock $package
+    } else {
+	puts -nonewline $sock "HTTP/1.0 404 Not Found\r\n"
+	puts -nonewline $sock "Content-Type: text/plain\r\n\r\n"
+	puts $sock "$conn(method) $urlpath is not served here"
+	multigetServerClose $sock
+    }
+}
+
+#
+# Forget everything loaded from the registry when another nsbd has
+#  changed it
+#
+proc multigetServerRefresh {} {
+    global nrdFileName multigetServerPackages
+    if {[file exists $nrdFileName] && [nrdFileChanged]} {
+	debugmsg "reloading $nrdFileName"
+	nrdInit
+	catch {unset multigetServerPackages}
+    }
+}
+
+#
+# Return the same list as multigetPackageInfo does, followed by the
+#  modification time of the stored '.nsb' file.  It is kept from one
+#  request to the next until the stored '.nsb' file is replaced by an
+#  update of the package.
+#
+proc multigetServerPackage {package executableTypes} {
+    global multigetServerPackages
+    if {$package == ""} {
+	nsbderror "package name missing after ? in request"
+    }
+    if {![nrdPackageRegistered $package]} {
+	nsbderror "\"$package\" not registered"
+    }
+    set key [list $package $executableTypes]
+    if {[info exists multigetServerPackages($key)]} {
+	set info $multigetServerPackages($key)
+	set nsbStoreFile [lindex $info 2]
+	if {[file exists $nsbStoreFile] &&
+			([file mtime $nsbStoreFile] == [lindex $info 4])} {
+	    return $info
+	}
+    }
+    set info [multigetPackageInfo $package $executableTypes ""]
+    lappend info [file mtime [lindex $info 2]]
+    set multigetServerPackages($key) $info
+    return $info
+}
+
+#
+# Start a multiget response for the paths posted to sock.  The paths are
+#  queued by multigetServerReadPaths as they arrive and each is checked
+#  just before its file is sent, so an error in a path is reported after
+#  the files before it.
+#
+proc multigetServerMultiget {sock package executableTypes} {
+    upvar #0 multigetServer$sock conn
+    foreach {conn(installTop) conn(PathSubstitutions) x conn(revreloc)} \
+		[multigetServerPackage $package $executableTypes] {break}
+    set conn(type) multiget
+    set conn(head) 0
+    set conn(tail) 0
+    set conn(partial) ""
+    set conn(sigFile) ""
+    set conn(encoding) ""
+    if {[info exists conn(h,accept-encoding)]} {
+	set conn(encoding) [urlChooseEncoding $conn(h,accept-encoding)]
+    }
+    puts -nonewline $sock "HTTP/1.0 200 OK\r\n"
+    set conn(started) 1
+    puts -nonewline $sock "Content-Type: application/x-multiget\r\n\r\n"
+    if {$conn(state) != "paths"} {
+	# nothing was posted
+	multigetServerClose $sock
+    }
+}
+
+#
+# Queue the lines of a multiget request from sock as they arrive, and start
+#  sending files if none is being sent.  Reading stops while more than
+#  multigetServerMaxQueued paths are waiting, so memory use stays the same
+#  however many paths are requested, except while the client isn't taking
+#  any data because an older client sends its whole request before it
+#  reads anything.  The block signatures that follow a line with a delta
+#  are saved in a scratch file, and the line isn't queued until they have
+#  all arrived.
+#
+set multigetServerMaxQueued 1000
+proc multigetServerReadPaths {sock} {
+    upvar #0 multigetServer$sock conn
+    global multigetServerMaxQueued
+    set data [read $sock $conn(length)]
+    incr conn(length) -[string length $data]
+    # signatures never have a newline in them, so they can only be at the
+    #   beginning of a line
+    set lines [split $conn(partial)$data "\n"]
+    set conn(partial) ""
+    set last [expr {[llength $lines] - 1}]
+    set n 0
+    foreach line $lines {
+	if {[info exists conn(sigfd)]} {
+	    set line [multigetServerSignatures $sock $line]
+	}
+	if {($n == $last) && ($conn(length) > 0)} {
+	    # the rest of it hasn't arrived yet
+	    set conn(partial) $line
+	} elseif {$line != ""} {
+	    set conn(line,$conn(tail)) $line
+	    set delta [lindex [multigetParseLine $line] 2]
+	    if {$delta == ""} {
+		incr conn(tail)
+	    } else {
+		global multigetServerSigCount
+		set sigFile [scratchAddName "mgk[incr multigetServerSigCount]"]
+		set conn(sigs,$conn(tail)) $sigFile
+		set conn(sigfd) [open $sigFile "w"]
+		fconfigure $conn(sigfd) -translation binary
+		set conn(sigremaining) [multigetSignatureBytes $delta]
+		multigetServerSignatures $sock ""
+	    }
+	}
+	incr n
+    }
+    if {$conn(length) == 0} {
+	if {[info exists conn(sigfd)]} {
+	    nsbderror "block signatures for $conn(line,$conn(tail)) ended early"
+	}
+	set conn(state) done
+	fileevent $sock readable {}
+    } elseif {[eof $sock]} {
+	multigetServerClose $sock
+	return
+    } elseif {(($conn(tail) - $conn(head)) > $multigetServerMaxQueued) &&
+				![info exists conn(blocked)]} {
+	fileevent $sock readable {}
+	set conn(paused) 1
+    }
+    if {![info exists conn(fd)]} {
+	multigetServerNextFile $sock
+    }
+}
+
+#
+# Write the block signatures at the beginning of data into the scratch
+#  file of the request line waiting for them, and queue the line when they
+#  are complete.  Return the rest of data.
+#
+proc multigetServerSignatures {sock data} {
+    upvar #0 multigetServer$sock conn
+    set n [string length $data]
+    if {$n > $conn(sigremaining)} {
+	set n $conn(sigremaining)
+    }
+    puts -nonewline $conn(sigfd) [string range $data 0 [expr {$n - 1}]]
+    if {[incr conn(sigremaining) -$n] == 0} {
+	close $conn(sigfd)
+	unset conn(sigfd)
+	incr conn(tail)
+    }
+    return [string range $data $n end]
+}
+
+#
+# Resume reading the paths of a multiget request if it was paused
+#
+proc multigetServerResume {sock} {
+    upvar #0 multigetServer$sock conn
+    if {[info exists conn(paused)]} {
+	unset conn(paused)
+	fileevent $sock readable [list multigetServerEval $sock \
+					    [list multigetServerRead $sock]]
+    }
+}
+
+#
+# Send queued files of a multiget response until one has to wait for the
+#  client to be ready for more, or close the connection if there are no
+#  more and the whole request has been read.  If there are none queued
+#  but more of the request is coming, return and wait for it.
+#
+proc multigetServerNextFile {sock} {
+    upvar #0 multigetServer$sock conn
+    global multigetServerMaxQueued
+    set PathSubstitutions $conn(PathSubstitutions)
+    while {$conn(head) < $conn(tail)} {
+	set n $conn(head)
+	set line $conn(line,$n)
+	unset conn(line,$n)
+	incr conn(head)
+	if {($conn(tail) - $conn(head)) < ($multigetServerMaxQueued / 2)} {
+	    multigetServerResume $sock
+	}
+	foreach {path offset delta} [multigetParseLine $line] {break}
+	if {[info exists conn(sigs,$n)]} {
+	    set conn(sigFile) $conn(sigs,$n)
+	    unset conn(sigs,$n)
+	    lappend delta $conn(sigFile)
+	}
+	if {[set msg [relativePathCheck $path]] != ""} {
+	    nsbderror $msg
+	}
+	set fullPath [file join $conn(installTop) \
+					[lindex [substitutePath $path] 1]]
+	foreach {fd remaining} [multigetOpenFile $sock $fullPath \
+		$path $offset $conn(encoding) $delta $conn(revreloc)] {}
+	if {$remaining == ""} {
+	    # the data is sent in chunks as it comes out of a filter
+	    multigetServerStartRelay $sock $fd
+	    return
+	}
+	set conn(fd) $fd
+	set conn(remaining) $remaining
+	if {![multigetServerSend $sock]} {
+	    return
+	}
+    }
+    if {$conn(state) != "paths"} {
+	multigetServerClose $sock
+    }
+}
+
+#
+# Send as much of the open file as the client will take without blocking.
+#  Return 1 if it is all sent, or else wait for the client to be ready for
+#  more and return 0.  Reading of multiget paths is resumed while waiting
+#  so that a client that doesn't read until its whole request is sent
+#  can't hang.
+#
+proc multigetServerSend {sock} {
+    upvar #0 multigetServer$sock conn
+    set sent [sendchannel $sock $conn(fd) $conn(remaining)]
+    if {[incr conn(remaining) -$sent] > 0} {
+	fileevent $sock writable [list multigetServerEval $sock \
+					[list multigetServerSendMore $sock]]
+	set conn(blocked) 1
+	multigetServerResume $sock
+	return 0
+    }
+    catch {unset conn(blocked)}
+    close $conn(fd)
+    unset conn(fd)
+    if {$conn(type) == "multiget"} {
+	multigetServerEndFile $sock
+    }
+    return 1
+}
+
+#
+# Continue sending the open file when the client is ready for more, and
+#  then go on to the next file or close the connection
+#
+proc multigetServerSendMore {sock} {
+    upvar #0 multigetServer$sock conn
+    fileevent $sock writable {}
+    if {![multigetServerSend $sock]} {
+	return
+    }
+    if {$conn(type) == "multiget"} {
+	multigetServerNextFile $sock
+    } else {
+	multigetServerClose $sock
+    }
+}
+
+#
+# Send what has come out of the filter being read for a response, as a
+#  chunk if it is for a multiget file, and wait for the client to take it
+#  before reading more.  When the filter is finished end the file and go
+#  on to the next one, or close the connection if it isn't a multiget.
+#
+proc multigetServerRelay {sock} {
+    upvar #0 multigetServer$sock conn
+    set data [read $conn(fd) 65536]
+    if {$data != ""} {
+	if {$conn(type) == "multiget"} {
+	    multigetPutChunk $sock $data
+	} else {
+	    puts -nonewline $sock $data
+	}
+	flush $sock
+	fileevent $conn(fd) readable {}
+	fileevent $sock writable [list multigetServerEval $sock \
+					[list multigetServerRelayMore $sock]]
+	set conn(blocked) 1
+	multigetServerResume $sock
+	return
+    }
+    if {![eof $conn(fd)]} {
+	return
+    }
+    catch {unset conn(blocked)}
+    set fd $conn(fd)
+    unset conn(fd)
+    # wait for the filter to exit to find out if it failed
+    fconfigure $fd -blocking on
+    closefilter $fd
+    if {$conn(type) != "multiget"} {
+	multigetServerClose $sock
+	return
+    }
+    multigetPutChunk $sock ""
+    multigetServerEndFile $sock
+    multigetServerNextFile $sock
+}
+
+#
+# Start sending the output of the filter fd as the rest of the response
+#  on sock
+#
+proc multigetServerStartRelay {sock fd} {
+    upvar #0 multigetServer$sock conn
+    set conn(fd) $fd
+    set conn(remaining) ""
+    fconfigure $fd -blocking off
+    fileevent $fd readable [list multigetServerEval $sock \
+					    [list multigetServerRelay $sock]]
+}
+
+#
+# Go back to reading the filter for a multiget file when the client is
+#  ready for more
+#
+proc multigetServerRelayMore {sock} {
+    upvar #0 multigetServer$sock conn
+    fileevent $sock writable {}
+    fileevent $conn(fd) readable [list multigetServerEval $sock \
+					    [list multigetServerRelay $sock]]
+}
+
+#
+# Finish a file of a multiget response
+#
+proc multigetServerEndFile {sock} {
+    upvar #0 multigetServer$sock conn
+    if {$conn(sigFile) != ""} {
+	scratchClean [list $conn(sigFile)]
+	set conn(sigFile) ""
+    }
+    puts $sock ""
+}
+
+#
+# Send the stored '.nsb' file of a package, unless it hasn't been modified
+#  since the If-Modified-Since time
+#
+proc multigetServerNsb {sock package executableTypes} {
+    upvar #0 multigetServer$sock conn
+    set nsbStoreFile [lindex [multigetServerPackage $package \
+						$executableTypes] 2]
+    file stat $nsbStoreFile statb
+    set status "200 OK"
+    if {[info exists conn(h,if-modified-since)] &&
+		![catch {scanAnyTime $conn(h,if-modified-since)} since] &&
+						($statb(mtime) <= $since)} {
+	set status "304 Not Modified"
+    }
+    puts -nonewline $sock "HTTP/1.0 $status\r\n"
+    set conn(started) 1
+    puts -nonewline $sock "Date: [httpTime]\r\n"
+    puts -nonewline $sock "Last-Modified: [httpTime $statb(mtime)]\r\n"
+    if {($status != "200 OK") || ($conn(method) == "HEAD")} {
+	puts -nonewline $sock "\r\n"
+	multigetServerClose $sock
+	return
+    }
+    puts -nonewline $sock "Content-Type: application/x-nsbd\r\n"
+    set encoding [compressedFileEncoding $nsbStoreFile]
+    if {$encoding == ""} {
+	set conn(fd) [notrace {open $nsbStoreFile "r"}]
+    } elseif {[info exists conn(h,accept-encoding)] && \
+	    [lsearch -exact [urlAcceptedEncodings $conn(h,accept-encoding)] \
+							    $encoding] >= 0} {
+	puts -nonewline $sock "Content-Encoding: $encoding\r\n"
+	set conn(fd) [notrace {open $nsbStoreFile "r"}]
+    } else {
+	# the client can't uncompress it, so send it uncompressed as it is
+	#   uncompressed, until the connection is closed
+	set conn(type) nsb
+	puts -nonewline $sock "\r\n"
+	multigetServerStartRelay $sock [openfilterfrom [list \
+		[uncompressCommand $encoding $nsbStoreFile]] \
+		[list < $nsbStoreFile]]
+	return
+    }
+    puts -nonewline $sock "Content-Length: $statb(size)\r\n\r\n"
+    fconfigure $conn(fd) -translation binary
+    set conn(type) nsb
+    set conn(remaining) $statb(size)
+    if {[multigetServerSend $sock]} {
+	multigetServerClose $sock
+    }
+}
+
+#
+# Send the changed paths of a package compared to the posted '.nsb' file.
+#  They are found by a separate "nsbd -changedPaths" process so that other
+#  connections are served meanwhile, unless the nsbd program can't be
+#  found.
+#
+proc multigetServerChangedPaths {sock package} {
+    upvar #0 multigetServer$sock conn
+    global procNsbType changedPathsChannel
+    if {![nrdPackageRegistered $package]} {
+	nsbderror "\"$package\" not registered; changedPaths requires registered package"
+    }
+    if {![info exists conn(nsbScratch)]} {
+	nsbderror "no '.nsb' file posted for changedPaths"
+    }
+    set conn(type) changedPaths
+    set nsbd [nsbdExecutable]
+    if {$nsbd != ""} {
+	set fd [openfilterfrom [list [concat [list $nsbd] [nsbdWorkerArgs] \
+		[list -changedPaths $package]]] [list < $conn(nsbScratch)]]
+    }
+    puts -nonewline $sock "HTTP/1.0 200 OK\r\n"
+    set conn(started) 1
+    puts -nonewline $sock "Content-Type: application/octet-stream\r\n\r\n"
+    if {$nsbd != ""} {
+	multigetServerStartRelay $sock $fd
+	return
+    }
+    set procNsbType "changedPaths"
+    set changedPathsChannel $sock
+    alwaysEvalFor "" {
+	set procNsbType "multigetServer"
+	unset changedPathsChannel
+    } {
+	procfile "posted '.nsb' file" "nsb" $package $conn(nsbScratch)
+    }
+    multigetServerClose $sock
+}
+
+#
+# Report an error to the client on sock and close the connection
+#
+proc multigetServerError {sock err} {
+    upvar #0 multigetServer$sock conn
+    if {![info exists conn]} {
+	return
+    }
+    errormsg "request from $conn(addr) failed: $err"
+    regsub -all "\n\[ \t\n\]*" $err " " oneLineErr
+    catch {
+	if {![info exists conn(started)]} {
+	    # the same as a CGI error from -multigetPackage
+	    puts -nonewline $sock "HTTP/1.0 200 OK\r\n"
+	    puts -nonewline $sock "X-Multiget-Error: $oneLineErr\r\n"
+	    puts -nonewline $sock "Content-Type: text/plain\r\n\r\n"
+	    puts $sock "Error from nsbd:\n  $err"
+	} else {
+	    # multiget clients check for this in each file's headers too
+	    puts $sock "X-Multiget-Error: $oneLineErr"
+	}
+    }
+    multigetServerClose $sock
+}
+
+#
+# Close the connection on sock
+#
+proc multigetServerClose {sock} {
+    upvar #0 multigetServer$sock conn
+    if {[info exists conn(idle)]} {
+	after cancel $conn(idle)
+    }
+    if {[info exists conn(fd)]} {
+	if {[info exists conn(remaining)] && ($conn(remaining) == "")} {
+	    catch {closefilter $conn(fd)}
+	} else {
+	    catch {close $conn(fd)}
+	}
+    }
+    if {[info exists conn(sigfd)]} {
+	catch {close $conn(sigfd)}
+    }
+    if {[info exists conn(bodyfd)]} {
+	catch {close $conn(bodyfd)}
+    }
+    set names ""
+    foreach name [array names conn sigs,*] {
+	lappend names $conn($name)
+    }
+    if {[info exists conn(sigFile)] && ($conn(sigFile) != "")} {
+	lappend names $conn(sigFile)
+    }
+    if {[info exists conn(nsbScratch)]} {
+	lappend names $conn(nsbScratch)
+    }
+    if {$names != ""} {
+	scratchClean $names
+    }
+    catch {close $sock}
+    catch {unset conn}
+}
@@ -150,6 +150,16 @@ pgpVariant 0
   {it couldn't be included in the 'pgp' keyword.}}
 pgppath 0
 
+ {{Path to a file in which to remember good PGP signatures, so that polls}
+  {and audits do not run PGP again on a '.nsb' file that has not changed}
+  {since its signature was checked.  Entries are found by the sha1 digest of}
+  {the whole signed file together with the 'pgp' and 'pgppath' keywords and}
+  {the sizes and modification times of the key ring files, so changing the}
+  {key rings causes signatures to be checked again.  If a relative path, it}
+  {is relative to the "nsbdpath" keyword (normally ~/.nsbd).  Default is}
+  {"sigcache".  Set to empty to always run PGP.}}
+signatureCache 0
+
  {{Pathname for the rsync program, used for retrieving rsync:// URLs.  Command}
   {line options can also be included here.  Default is 'rsync -z', but if you}
   {have rsync it is a good idea to set this keyword because if a package}
@@ -161,6 +171,16 @@ rsync 0
   {keyword.  Default is 'breloc -r'.}}
 breloc 0
 
+ {{Pathname for the gzip program, used to compress files sent to and from}
+  {"multigetUrl" servers.  Command line options can also be included here.}
+  {Default is to look for gzip in $PATH.}}
+gzip 0
+
+ {{Pathname for the zstd program, used like the "gzip" keyword.  Zstd is}
+  {preferred over gzip when both ends of a multiget have it because it}
+  {uncompresses faster.  Default is to look for zstd in $PATH.}}
+zstd 0
+
  {{URL (of form "http://proxyhost[:portno][/]") of HTTP proxy server, if any.}
   {Default portno is 8080.  If not set here, default is from environment}
   {$HTTP_PROXY or $http_proxy.}}
@@ -183,6 +203,48 @@ proxyAuthorization 0
 
  {{User-Agent value to put in HTTP headers.}}
 httpUserAgent 0
+
+ {{Maximum number of files to fetch at the same time from the topUrl of a}
+  {package that has no multigetUrl.  Fetching several at a time hides the}
+  {delay of each request on slow or distant links.  Default is 1.}}
+maxParallelFetches 0
+
+ {{Maximum number of packages to poll or update at the same time with -poll}
+  {or -update of several packages, each in a separate nsbd process with its}
+  {own scratch files.  Packages that have an installTop in common, which}
+  {includes all packages with overlapping validPaths, are always done one}
+  {after another in the same process.  The messages of each process are}
+  {shown together when it finishes.  The processes can't ask questions, so}
+  {this is only used without -askreason or a graphical interface.  The}
+  {same number of processes load the stored '.nsb' files for -audit without}
+  {the extra auditOption, -getPathPackages and -getPackagePaths.  Default}
+  {is 1.}}
+parallelPackages 0
+
+ {{Minimum size in bytes of an installed file for which a newer version is}
+  {fetched from a multigetUrl as a delta.  The block signatures of the}
+  {installed file are sent with the request and the server sends only the}
+  {blocks that changed.  0 turns deltas off.  Default is 65536.}}
+minDeltaSize 0
+
+ {{List of multiget urls of other nsbd clients running -multigetServer, for}
+  {example http://host:port/multiget, that are tried in turn before the}
+  {multigetUrl or topUrl of a package.  The package name is appended after a}
+  {question mark.  A peer that installed the package with a "relocTop" undoes}
+  {the relocation before it sends a file.  Files from them are checked}
+  {against the '.nsb' file just the same, and any that they can't provide}
+  {are fetched as usual.}}
+multigetPeers 0
+
+ {{Minimum size in bytes of a file that is fetched from an http topUrl in}
+  {several pieces at the same time, using Range requests spread over the}
+  {topUrlMirrors if there are any.  This fills fast links with a long delay}
+  {better than a single connection.  Default is 0, which means never.}}
+minSegmentedSize 0
+
+ {{Number of pieces to fetch files of at least minSegmentedSize bytes in.}
+  {Default is 4.}}
+fetchSegments 0
 }
 append cfgKeylist {
  {{Directory in which to put small scratch files, usually a RAM disk.}
@@ -197,6 +259,30 @@ tmp 0
   {per-package installTop.  Default is ".nsbdtmp".}}
 installTmp 0
 
+ {{Directory of a store of installed files kept under their message digest}
+  {and length, shared by all the packages and installTops that use it.  Files}
+  {that relocation doesn't change are fetched into it only once and}
+  {hard-linked into each installTop where they have the same permissions}
+  {(copied otherwise), and a stored file is deleted when the last installed}
+  {file linked to it is replaced or removed.  Must be in the same filesystem}
+  {as the installTops, and must be an absolute path.  A stored file is only}
+  {checked against its message digest again after its modification time}
+  {changes.  Default is no store.}}
+objectStore 0
+
+ {{Directory of a cache of fetched files kept under their message digest and}
+  {length, before relocation.  It is checked before fetching files from the}
+  {network and files fetched from the network are added to it, so it may be}
+  {shared by all the users on a site that install the same packages; in that}
+  {case it must be writable by all of them.  Default is no cache.}}
+downloadCache 0
+
+ {{Maximum size in megabytes of the files in the downloadCache.  When it is}
+  {larger the least recently used files are deleted.  The total is kept up}
+  {to date in a file called "size" in the downloadCache so the files only}
+  {need to be looked at when some have to be deleted.  Default is 1024.}}
+downloadCacheSize 0
+
  {{File creation mask to use on new files.  This is the Unix umask, in octal.}
   {Note that the permissions that are distributed with files in NSBD packages}
   {only indicate "rwx", that is, read, write and execute; those will apply to}
@@ -328,6 +414,14 @@ relocTop 0
   {of nsbdpath.}}
 nsbStorePath 0
 
+ {{Compression to store '.nsb' files with, either "gzip" or "zstd" (see the}
+  {keywords of the same names).  The stored files keep their names and are}
+  {uncompressed as they are read, so previously stored uncompressed files}
+  {keep working and are compressed the next time they are replaced.  The}
+  {"-multigetServer" option sends them as they are to clients that accept}
+  {the encoding and uncompressed to others.  Default is to not compress.}}
+nsbStoreEncoding 0
+
  {{List of additional substitutions to perform on "paths" when they are}
   {installed.  These are used when installing packages that were described in}
   {'.nsb' files, after the substitutions that were passed in the file and after}
@@ -416,11 +510,11 @@ auditOptions 1
   {integer followed by a letter (upper or lower case) 'm', 'h', 'd', or 'w'}
   {for minutes, hours, days, or weeks respectively.  If the integer is 0, no}
   {polling is done.  Default is 1d.  Note that this still requires that NSBD}
-  {be invoked periodically with the '-poll' option, for example from cron.}
-  {If it is invoked only once per day, for example, it won't make much sense}
-  {to set values here of small numbers of minutes or hours.  To allow for}
-  {slight differences in run time, 2 percent will be subtracted from the}
-  {specified value.}}
+  {be invoked periodically with the '-poll' option, for example from cron,}
+  {or be left running with the '-pollDaemon' option.  If it is invoked only}
+  {once per day, for example, it won't make much sense to set values here of}
+  {small numbers of minutes or hours.  To allow for slight differences in run}
+  {time, 2 percent will be subtracted from the specified value.}}
 minPollPeriod 0
 
  {{List of additional commands to run just before every package is about to be}
@@ -652,6 +746,39 @@ topUrl 0
   {respectively.}}
 multigetUrl 0
 
+ {{List of Uniform Resource Locators of mirrors of "topUrl", with the same}
+  {substitutions.  The mirror whose server answers first is tried first and}
+  {if fetching from one fails the files that did not arrive are fetched from}
+  {the next; the '.nsb' file is what is trusted, not the mirrors.}}
+topUrlMirrors 1
+
+ {{List of Uniform Resource Locators of mirrors of "multigetUrl", chosen the}
+  {same way as the "topUrlMirrors".}}
+multigetUrlMirrors 1
+
+ {{Uniform Resource Locator (URL) of a single file containing the data of all}
+  {the files in the package, which any http server can serve.  When this is}
+  {in a '.npd' file, the pack file is written next to the '.nsb' file along}
+  {with an index of where each file is in it, with the same name plus}
+  {".idx", to be put at the packUrl.  Clients fetch the index and then only}
+  {the parts of the pack file that they need, using http Range requests for}
+  {runs of files that are near each other.  May contain %P or %V, which are}
+  {replaced by the package name or the version.  Used when there is no}
+  {multigetUrl or it fails.}}
+packUrl 0
+
+ {{Uniform Resource Locator (URL) of a file that changes the previous '.nsb'}
+  {file of the package into the current one.  When this is in a '.npd' file}
+  {and the '.nsb' file being replaced is still there, the delta is written}
+  {next to the new '.nsb' file with the same name plus ".delta", to be put at}
+  {the nsbDeltaUrl.  It holds only the path entries that were added, removed}
+  {or changed, so clients that have the previous '.nsb' file stored fetch}
+  {that instead of the whole '.nsb' file, and fall back to the whole file if}
+  {they have an older one.  The result is checked against the signature of}
+  {the whole '.nsb' file as usual.  May contain %P, which is replaced by the}
+  {package name.}}
+nsbDeltaUrl 0
+
  {{List of substitutions to perform on "paths" when they are installed.  Each}
   {list item has two parts separated by whitespace: the first part is the part}
   {to match and the second part is the part to substitute.  The second part}
@@ -876,7 +1003,8 @@ foreach {c k v} $nupKeylist {
 # keys that are copied from nsb to nup
 set nsbNupKeys [concat [list generatedBy generatedAt] $npdNsbNupKeys]
 # keys that are copied from nsb to nup for only internal use (not written out)
-lappend nsbNupKeys topUrl multigetUrl urlPresubstitutions validPaths
+lappend nsbNupKeys topUrl multigetUrl topUrlMirrors multigetUrlMirrors \
+				packUrl urlPresubstitutions validPaths
 
 #
 # keylist and keytable for registry database
@@ -1019,10 +1147,11 @@ append nrdKeylist {
 	 {the integer is 0, no polling is done.  Defaults to value in}
 	 {configuration file or 1d.  Note that this still requires that NSBD}
 	 {be invoked periodically with the '-poll' option, for example from}
-	 {cron.  If it is invoked only once per day, for example, it won't}
-	 {make much sense to set values here of small numbers of minutes or}
-	 {hours.  To allow for slight differences in run time, 2 percent will}
-	 {be subtracted from the specified value.}}
+	 {cron, or be left running with the '-pollDaemon' option.  If it is}
+	 {invoked only once per day, for example, it won't make much sense to}
+	 {set values here of small numbers of minutes or hours.  To allow for}
+	 {slight differences in run time, 2 percent will be subtracted from}
+	 {the specified value.}}
 {packages minPollPeriod} 0
 
 	{{Automatically generated time of when the package was last polled}
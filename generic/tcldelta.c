@@ -0,0 +1,624 @@
+/*
+ * Block delta support for NSBD multiget transfers.
+ * A client that already has an older version of a file sends the
+ *   signatures of its fixed size blocks: a weak rolling checksum, which
+ *   can be cheaply moved along the new file a byte at a time, plus the
+ *   first half of the MD5 digest of the block to confirm a match.  The
+ *   server scans the new file for blocks the client has and writes
+ *   a delta made of "C block count\n" instructions, which copy count
+ *   blocks starting at block number block from the old file, and
+ *   "L length\n" instructions, which are followed by length bytes of
+ *   literal data.  The whole-file digest from the '.nsb' file is still
+ *   checked on the result, so a false match can't go unnoticed.
+ * The signatures are read from and written to channels rather than passed
+ *   as strings, because a big file has a lot of them, and file lengths are
+ *   longs so files over 2 gigabytes work where longs are 64 bits.
+ */
+/*
+ * Copyright (C) 1996-2003 by Dave Dykstra and Lucent Technologies
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * If those terms are not sufficient for you, contact the author to
+ * discuss the possibility of an alternate license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <tcl.h>
+#include <stdio.h>
+#include <string.h>
+#include "md5.h"
+
+#define STRONGSIZE 8			/* bytes of MD5 digest per block */
+#define SIGSIZE (8 + 2 * STRONGSIZE)	/* hex characters per block */
+#define MINBUFSIZE (256 * 1024)
+#define MAXBLOCKSIZE (1024 * 1024)	/* largest block size accepted */
+#define SIGSPERREAD 1024		/* signatures read at a time */
+
+typedef struct Signatures {
+    int blockSize;
+    int numBlocks;
+    int lastSize;		/* size of the last, possibly short, block */
+    unsigned int *weak;
+    unsigned char *strong;
+    int *next;			/* next block in the same hash chain */
+    int *heads;			/* first block of each hash chain */
+    unsigned int mask;
+} Signatures;
+
+typedef struct DeltaOut {
+    Tcl_Channel chan;
+    int copyStart;		/* first block of the pending copy */
+    int copyCount;		/* number of blocks in the pending copy */
+} DeltaOut;
+
+static char hexdigits[] = "0123456789abcdef";
+
+static int
+#ifdef _USING_PROTOTYPES_
+hexValue(int c)
+#else
+hexValue(c)
+    int c;
+#endif
+{
+    if ((c >= '0') && (c <= '9'))
+	return (c - '0');
+    if ((c >= 'a') && (c <= 'f'))
+	return (c - 'a' + 10);
+    return (-1);
+}
+
+/*
+ * Calculate the two halves of the weak checksum of n bytes
+ */
+static void
+#ifdef _USING_PROTOTYPES_
+weakSums(unsigned char *p, int n, unsigned int *aPtr, unsigned int *bPtr)
+#else
+weakSums(p, n, aPtr, bPtr)
+    unsigned char *p;
+    int n;
+    unsigned int *aPtr;
+    unsigned int *bPtr;
+#endif
+{
+    unsigned int a = 0, b = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	a += p[i];
+	b += (n - i) * p[i];
+    }
+    *aPtr = a;
+    *bPtr = b;
+}
+
+#define SIZEOFBLOCK(sigsPtr, i) (((i) == (sigsPtr)->numBlocks - 1) ? \
+		    (sigsPtr)->lastSize : (sigsPtr)->blockSize)
+#define WEAKSUM(a, b) (((a) & 0xffff) | (((b) & 0xffff) << 16))
+#define HASHSUM(sum, mask) (((sum) ^ ((sum) >> 16)) & (mask))
+
+static void
+#ifdef _USING_PROTOTYPES_
+strongSum(unsigned char *p, int n, unsigned char *digest)
+#else
+strongSum(p, n, digest)
+    unsigned char *p;
+    int n;
+    unsigned char *digest;
+#endif
+{
+    MD5_CTX context;
+
+    MD5Init(&context);
+    MD5Update(&context, p, (unsigned) n);
+    MD5Final(digest, &context);
+}
+
+/*
+ * Read until buf is full or the end of file, returning the number of
+ *   bytes read or -1 on error
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+readFull(Tcl_Channel chan, char *buf, int size)
+#else
+readFull(chan, buf, size)
+    Tcl_Channel chan;
+    char *buf;
+    int size;
+#endif
+{
+    int total = 0, n;
+
+    while (total < size) {
+	if ((n = Tcl_Read(chan, buf + total, size - total)) < 0)
+	    return (-1);
+	if (n == 0)
+	    break;
+	total += n;
+    }
+    return (total);
+}
+
+/*
+ * Write the signatures of all the blocks of size blockSize read from chan
+ *   to outChan
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+makeSignatures(Tcl_Interp *interp, Tcl_Channel chan, int blockSize,
+						Tcl_Channel outChan)
+#else
+makeSignatures(interp, chan, blockSize, outChan)
+    Tcl_Interp *interp;
+    Tcl_Channel chan;
+    int blockSize;
+    Tcl_Channel outChan;
+#endif
+{
+    char *buf;
+    char sig[SIGSIZE + 1];
+    unsigned char digest[16];
+    unsigned int a, b;
+    int n, i;
+
+    buf = ckalloc((unsigned) blockSize);
+    while ((n = readFull(chan, buf, blockSize)) > 0) {
+	weakSums((unsigned char *) buf, n, &a, &b);
+	sprintf(sig, "%08x", WEAKSUM(a, b));
+	strongSum((unsigned char *) buf, n, digest);
+	for (i = 0; i < STRONGSIZE; i++) {
+	    sig[8 + 2 * i] = hexdigits[digest[i] >> 4];
+	    sig[8 + 2 * i + 1] = hexdigits[digest[i] & 0xf];
+	}
+	if (Tcl_Write(outChan, sig, SIGSIZE) < 0) {
+	    ckfree(buf);
+	    Tcl_AppendResult(interp, "error writing ",
+		    Tcl_GetChannelName(outChan), ": ", Tcl_PosixError(interp),
+		    (char *) NULL);
+	    return TCL_ERROR;
+	}
+	if (n < blockSize)
+	    break;
+    }
+    ckfree(buf);
+    if (n < 0) {
+	Tcl_AppendResult(interp, "error reading ", Tcl_GetChannelName(chan),
+		": ", Tcl_PosixError(interp), (char *) NULL);
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static void
+#ifdef _USING_PROTOTYPES_
+freeSignatures(Signatures *sigsPtr)
+#else
+freeSignatures(sigsPtr)
+    Signatures *sigsPtr;
+#endif
+{
+    ckfree((char *) sigsPtr->weak);
+    ckfree((char *) sigsPtr->strong);
+    ckfree((char *) sigsPtr->next);
+    ckfree((char *) sigsPtr->heads);
+}
+
+/*
+ * Read the hex signatures of the blocks of a file of length bytes from
+ *   chan and put them in a hash table keyed by their weak checksum
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+readSignatures(Tcl_Interp *interp, Signatures *sigsPtr, int blockSize,
+					    long length, Tcl_Channel chan)
+#else
+readSignatures(interp, sigsPtr, blockSize, length, chan)
+    Tcl_Interp *interp;
+    Signatures *sigsPtr;
+    int blockSize;
+    long length;
+    Tcl_Channel chan;
+#endif
+{
+    long numBlocks;
+    int n, i, j, k, m, hi, lo, h;
+    unsigned int weak;
+    unsigned int size;
+    char *buf;
+
+    numBlocks = (length + blockSize - 1) / blockSize;
+    if ((length < 0) || (numBlocks > (long) (0x7fffffff / SIGSIZE))) {
+	Tcl_AppendResult(interp, "too many blocks for block signatures",
+							(char *) NULL);
+	return TCL_ERROR;
+    }
+    n = (int) numBlocks;
+    for (size = 1; size < 2 * (unsigned int) n; size <<= 1)
+	;
+    sigsPtr->blockSize = blockSize;
+    sigsPtr->numBlocks = n;
+    sigsPtr->lastSize = (n > 0) ?
+		(int) (length - (long) (n - 1) * blockSize) : 0;
+    sigsPtr->mask = size - 1;
+    sigsPtr->weak = (unsigned int *) ckalloc(
+				(unsigned) ((n + 1) * sizeof(unsigned int)));
+    sigsPtr->strong = (unsigned char *) ckalloc(
+				(unsigned) ((n + 1) * STRONGSIZE));
+    sigsPtr->next = (int *) ckalloc((unsigned) ((n + 1) * sizeof(int)));
+    sigsPtr->heads = (int *) ckalloc((unsigned) (size * sizeof(int)));
+    buf = ckalloc((unsigned) (SIGSPERREAD * SIGSIZE));
+    for (i = 0; i < n; i += m) {
+	m = n - i;
+	if (m > SIGSPERREAD)
+	    m = SIGSPERREAD;
+	k = readFull(chan, buf, m * SIGSIZE);
+	if (k < 0) {
+	    Tcl_AppendResult(interp, "error reading ",
+		    Tcl_GetChannelName(chan), ": ", Tcl_PosixError(interp),
+		    (char *) NULL);
+	    goto fail;
+	}
+	if (k < m * SIGSIZE) {
+	    Tcl_AppendResult(interp,
+		    "block signatures don't match the length of the file",
+		    (char *) NULL);
+	    goto fail;
+	}
+	for (k = 0; k < m; k++) {
+	    char *sig = buf + k * SIGSIZE;
+	    weak = 0;
+	    for (j = 0; j < 8; j++) {
+		if ((hi = hexValue(sig[j])) < 0)
+		    goto badHex;
+		weak = (weak << 4) | hi;
+	    }
+	    for (j = 0; j < STRONGSIZE; j++) {
+		if (((hi = hexValue(sig[8 + 2 * j])) < 0) ||
+			    ((lo = hexValue(sig[8 + 2 * j + 1])) < 0))
+		    goto badHex;
+		sigsPtr->strong[(i + k) * STRONGSIZE + j] = (hi << 4) | lo;
+	    }
+	    sigsPtr->weak[i + k] = weak;
+	}
+    }
+    ckfree(buf);
+    for (i = 0; i < (int) size; i++)
+	sigsPtr->heads[i] = -1;
+    /* add in reverse so each chain is in block order */
+    for (i = n - 1; i >= 0; i--) {
+	h = HASHSUM(sigsPtr->weak[i], sigsPtr->mask);
+	sigsPtr->next[i] = sigsPtr->heads[h];
+	sigsPtr->heads[h] = i;
+    }
+    return TCL_OK;
+
+badHex:
+    Tcl_AppendResult(interp, "block signatures are not in hex",
+							(char *) NULL);
+fail:
+    ckfree(buf);
+    freeSignatures(sigsPtr);
+    return TCL_ERROR;
+}
+
+/*
+ * Return the number of the block of size n that matches the weak checksum
+ *   sum and the data at p, or -1 if there is none.  The block following
+ *   the previous match is preferred so copies coalesce.
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+findBlock(Signatures *sigsPtr, unsigned int sum, unsigned char *p, int n,
+							int preferred)
+#else
+findBlock(sigsPtr, sum, p, n, preferred)
+    Signatures *sigsPtr;
+    unsigned int sum;
+    unsigned char *p;
+    int n;
+    int preferred;
+#endif
+{
+    unsigned char digest[16];
+    int haveDigest = 0;
+    int i;
+
+    if ((preferred >= 0) && (preferred < sigsPtr->numBlocks) &&
+		(sigsPtr->weak[preferred] == sum) &&
+		(SIZEOFBLOCK(sigsPtr, preferred) == n)) {
+	strongSum(p, n, digest);
+	haveDigest = 1;
+	if (memcmp(digest, sigsPtr->strong + preferred * STRONGSIZE,
+						    STRONGSIZE) == 0)
+	    return (preferred);
+    }
+    for (i = sigsPtr->heads[HASHSUM(sum, sigsPtr->mask)]; i >= 0;
+						    i = sigsPtr->next[i]) {
+	if (sigsPtr->weak[i] != sum)
+	    continue;
+	if (SIZEOFBLOCK(sigsPtr, i) != n)
+	    continue;
+	if (!haveDigest) {
+	    strongSum(p, n, digest);
+	    haveDigest = 1;
+	}
+	if (memcmp(digest, sigsPtr->strong + i * STRONGSIZE, STRONGSIZE) == 0)
+	    return (i);
+    }
+    return (-1);
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+flushCopy(DeltaOut *outPtr)
+#else
+flushCopy(outPtr)
+    DeltaOut *outPtr;
+#endif
+{
+    char line[64];
+    int n;
+
+    if (outPtr->copyCount == 0)
+	return (0);
+    n = sprintf(line, "C %d %d\n", outPtr->copyStart, outPtr->copyCount);
+    outPtr->copyCount = 0;
+    return (Tcl_Write(outPtr->chan, line, n) < 0 ? -1 : 0);
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+addCopy(DeltaOut *outPtr, int block)
+#else
+addCopy(outPtr, block)
+    DeltaOut *outPtr;
+    int block;
+#endif
+{
+    if ((outPtr->copyCount > 0) &&
+		(block == outPtr->copyStart + outPtr->copyCount)) {
+	outPtr->copyCount++;
+	return (0);
+    }
+    if (flushCopy(outPtr) < 0)
+	return (-1);
+    outPtr->copyStart = block;
+    outPtr->copyCount = 1;
+    return (0);
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+writeLiteral(DeltaOut *outPtr, char *p, int n)
+#else
+writeLiteral(outPtr, p, n)
+    DeltaOut *outPtr;
+    char *p;
+    int n;
+#endif
+{
+    char line[64];
+    int len;
+
+    if (n <= 0)
+	return (0);
+    if (flushCopy(outPtr) < 0)
+	return (-1);
+    len = sprintf(line, "L %d\n", n);
+    if (Tcl_Write(outPtr->chan, line, len) < 0)
+	return (-1);
+    return (Tcl_Write(outPtr->chan, p, n) < 0 ? -1 : 0);
+}
+
+/*
+ * Write the delta between the blocks described by sigsPtr and the data
+ *   read from inChan to outChan.  Only a buffer of a few blocks of the
+ *   new data is kept in memory at a time.
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+makeDelta(Tcl_Interp *interp, Signatures *sigsPtr, Tcl_Channel inChan,
+						Tcl_Channel outChan)
+#else
+makeDelta(interp, sigsPtr, inChan, outChan)
+    Tcl_Interp *interp;
+    Signatures *sigsPtr;
+    Tcl_Channel inChan;
+    Tcl_Channel outChan;
+#endif
+{
+    DeltaOut out;
+    unsigned char *buf;
+    int bs = sigsPtr->blockSize;
+    int bufSize, len = 0, k = 0, ls = 0, eof = 0, n, block;
+    int haveSum = 0, preferred = -1;
+    unsigned int a = 0, b = 0, x, y;
+    unsigned long size;
+
+    out.chan = outChan;
+    out.copyCount = 0;
+    size = 4 * (unsigned long) bs;
+    if (size < MINBUFSIZE)
+	size = MINBUFSIZE;
+    /* the buffer must have room for more than a block after a partial */
+    /*  one, or refilling it would never read anything */
+    if ((bs <= 0) || (bs > MAXBLOCKSIZE) || (size <= 2 * (unsigned long) bs)) {
+	Tcl_AppendResult(interp, "invalid block size for a delta",
+							(char *) NULL);
+	return TCL_ERROR;
+    }
+    bufSize = (int) size;
+    buf = (unsigned char *) ckalloc((unsigned) bufSize);
+
+    for (;;) {
+	if ((len - k < bs) && !eof) {
+	    /* write out the pending literal data, move the rest of the */
+	    /*  data to the front of the buffer, and read more */
+	    if (writeLiteral(&out, (char *) buf + ls, k - ls) < 0)
+		goto writeError;
+	    memmove(buf, buf + k, len - k);
+	    len -= k;
+	    ls = k = 0;
+	    if ((n = readFull(inChan, (char *) buf + len, bufSize - len)) < 0)
+		goto readError;
+	    if (n < bufSize - len)
+		eof = 1;
+	    len += n;
+	    haveSum = 0;
+	    continue;
+	}
+	if (len - k < bs)
+	    break;
+	if (!haveSum) {
+	    weakSums(buf + k, bs, &a, &b);
+	    haveSum = 1;
+	}
+	if ((block = findBlock(sigsPtr, WEAKSUM(a, b), buf + k, bs,
+						    preferred)) >= 0) {
+	    if (writeLiteral(&out, (char *) buf + ls, k - ls) < 0)
+		goto writeError;
+	    if (addCopy(&out, block) < 0)
+		goto writeError;
+	    preferred = block + 1;
+	    k += bs;
+	    ls = k;
+	    haveSum = 0;
+	    continue;
+	}
+	if (k + bs < len) {
+	    /* roll the checksum forward one byte */
+	    x = buf[k];
+	    y = buf[k + bs];
+	    a = a - x + y;
+	    b = b - bs * x + a;
+	} else {
+	    haveSum = 0;
+	}
+	k++;
+    }
+
+    /* the end of the data may match a short last block */
+    n = len - k;
+    if ((n > 0) && (sigsPtr->numBlocks > 0) && (n == sigsPtr->lastSize) &&
+							(n < bs)) {
+	weakSums(buf + k, n, &a, &b);
+	block = findBlock(sigsPtr, WEAKSUM(a, b), buf + k, n, -1);
+	if (block == sigsPtr->numBlocks - 1) {
+	    if (writeLiteral(&out, (char *) buf + ls, k - ls) < 0)
+		goto writeError;
+	    if (addCopy(&out, block) < 0)
+		goto writeError;
+	    ls = len;
+	}
+    }
+    if (writeLiteral(&out, (char *) buf + ls, len - ls) < 0)
+	goto writeError;
+    if (flushCopy(&out) < 0)
+	goto writeError;
+    ckfree((char *) buf);
+    return TCL_OK;
+
+readError:
+    ckfree((char *) buf);
+    Tcl_AppendResult(interp, "error reading ", Tcl_GetChannelName(inChan),
+	    ": ", Tcl_PosixError(interp), (char *) NULL);
+    return TCL_ERROR;
+
+writeError:
+    ckfree((char *) buf);
+    Tcl_AppendResult(interp, "error writing ", Tcl_GetChannelName(outChan),
+	    ": ", Tcl_PosixError(interp), (char *) NULL);
+    return TCL_ERROR;
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+Blockdelta (ClientData clientData, Tcl_Interp *interp, int argc, char *argv[])
+#else
+Blockdelta (clientData, interp, argc, argv)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    int argc;
+    char *argv[];
+#endif
+{
+    Tcl_Channel inChan, outChan, sigChan;
+    Signatures sigs;
+    int mode, blockSize, code;
+    long length;
+    char c;
+
+    if (argc < 2)
+	goto wrongArgs;
+    if (strcmp(argv[1], "signature") == 0) {
+	if (argc != 5)
+	    goto wrongArgs;
+	if ((inChan = Tcl_GetChannel(interp, argv[2], &mode)) == NULL)
+	    return TCL_ERROR;
+	if ((Tcl_GetInt(interp, argv[3], &blockSize) != TCL_OK) ||
+		(blockSize <= 0) || (blockSize > MAXBLOCKSIZE)) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "invalid block size \"", argv[3], "\"",
+							(char *) NULL);
+	    return TCL_ERROR;
+	}
+	if ((outChan = Tcl_GetChannel(interp, argv[4], &mode)) == NULL)
+	    return TCL_ERROR;
+	return makeSignatures(interp, inChan, blockSize, outChan);
+    }
+    if (strcmp(argv[1], "delta") == 0) {
+	if (argc != 7)
+	    goto wrongArgs;
+	if ((inChan = Tcl_GetChannel(interp, argv[2], &mode)) == NULL)
+	    return TCL_ERROR;
+	if ((outChan = Tcl_GetChannel(interp, argv[3], &mode)) == NULL)
+	    return TCL_ERROR;
+	if ((Tcl_GetInt(interp, argv[4], &blockSize) != TCL_OK) ||
+		(blockSize <= 0) || (blockSize > MAXBLOCKSIZE) ||
+		(sscanf(argv[5], "%ld%c", &length, &c) != 1) ||
+		(length < 0)) {
+	    Tcl_ResetResult(interp);
+	    Tcl_AppendResult(interp, "invalid block size \"", argv[4],
+		    "\" or length \"", argv[5], "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	if ((sigChan = Tcl_GetChannel(interp, argv[6], &mode)) == NULL)
+	    return TCL_ERROR;
+	if (readSignatures(interp, &sigs, blockSize, length, sigChan)
+							    != TCL_OK)
+	    return TCL_ERROR;
+	code = makeDelta(interp, &sigs, inChan, outChan);
+	freeSignatures(&sigs);
+	return code;
+    }
+
+wrongArgs:
+    Tcl_AppendResult (interp, "wrong # args: should be either:\n",
+	"  ", argv[0], " signature inchannel blocksize outchannel\n",
+	"  ", argv[0], " delta inchannel outchannel blocksize length sigchannel",
+	(char *) NULL);
+    return TCL_ERROR;
+}
+
+int
+#ifdef _USING_PROTOTYPES_
+Blockdelta_Init(Tcl_Interp *interp)
+#else
+Blockdelta_Init(interp)
+    Tcl_Interp *interp;
+#endif
+{
+        Tcl_CreateCommand (interp, "blockdelta", Blockdelta,
+                (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+        return TCL_OK;
+}
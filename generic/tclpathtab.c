@@ -0,0 +1,500 @@
+/*
+ * Compact table of per-path information for NSBD.
+ * Paths are interned once per table and each kind of information about
+ *   a path (length, digest, mode, etc.) is kept in its own column, so
+ *   a package with hundreds of thousands of paths does not need a
+ *   separate Tcl array element (each holding a copy of the path) for
+ *   every piece of information.  Column values other than the digest
+ *   are shared between all tables through a reference counted string
+ *   pool because values such as modes, lengths and mtimes repeat a lot.
+ *   Digests are kept in binary.
+ */
+/*
+ * Copyright (C) 1996-2003 by Dave Dykstra and Lucent Technologies
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * If those terms are not sufficient for you, contact the author to
+ * discuss the possibility of an alternate license.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <tcl.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The column names.  The first seven are the information that comes
+ *   from '.nsb' files, the rest are temporary internal information
+ *   used while installing an update.
+ */
+static char *columnNames[] = {
+    "length", "digest", "mode", "linkTo", "hardLinkTo", "mtime", "loadPath",
+    "perm", "group", "new", "nonPortable", "otherLoadPath", "otherRevreloc",
+    "backupPath", "localPath", NULL
+};
+#define NUMCOLUMNS 15
+#define DIGESTCOLUMN 1
+
+typedef struct PathTable {
+    Tcl_HashTable rowIndex;	/* path -> row number */
+    int numRows;		/* rows used, including deleted ones */
+    int maxRows;		/* rows allocated */
+    int liveRows;		/* rows not deleted */
+    char **paths;		/* interned path of each row, NULL if deleted */
+    char **cells[NUMCOLUMNS];	/* pooled value or packed digest, or NULL */
+} PathTable;
+
+static Tcl_HashTable tables;	/* handle -> PathTable */
+static Tcl_HashTable valuePool;	/* value -> reference count */
+static int tableCount = 0;
+
+/*
+ * Return a pooled copy of value, adding a reference to it
+ */
+static char *
+#ifdef _USING_PROTOTYPES_
+poolValue(char *value)
+#else
+poolValue(value)
+    char *value;
+#endif
+{
+    Tcl_HashEntry *entryPtr;
+    int isNew;
+
+    entryPtr = Tcl_CreateHashEntry(&valuePool, value, &isNew);
+    if (isNew) {
+	Tcl_SetHashValue(entryPtr, (ClientData) 1);
+    } else {
+	Tcl_SetHashValue(entryPtr,
+		(ClientData) ((long) Tcl_GetHashValue(entryPtr) + 1));
+    }
+    return Tcl_GetHashKey(&valuePool, entryPtr);
+}
+
+/*
+ * Remove a reference to a pooled value
+ */
+static void
+#ifdef _USING_PROTOTYPES_
+releaseValue(char *value)
+#else
+releaseValue(value)
+    char *value;
+#endif
+{
+    Tcl_HashEntry *entryPtr;
+    long refs;
+
+    if ((entryPtr = Tcl_FindHashEntry(&valuePool, value)) == NULL) {
+	return;
+    }
+    if ((refs = (long) Tcl_GetHashValue(entryPtr) - 1) <= 0) {
+	Tcl_DeleteHashEntry(entryPtr);
+    } else {
+	Tcl_SetHashValue(entryPtr, (ClientData) refs);
+    }
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+hexValue(int c)
+#else
+hexValue(c)
+    int c;
+#endif
+{
+    if ((c >= '0') && (c <= '9'))
+	return (c - '0');
+    if ((c >= 'a') && (c <= 'f'))
+	return (c - 'a' + 10);
+    return (-1);
+}
+
+/*
+ * Pack a digest.  The first byte is the number of binary bytes that
+ *   follow; if it is zero the digest was not lower case hex and the
+ *   original string follows instead.
+ */
+static char *
+#ifdef _USING_PROTOTYPES_
+packDigest(char *value)
+#else
+packDigest(value)
+    char *value;
+#endif
+{
+    int len, i, hi, lo;
+    unsigned char *packed;
+
+    len = strlen(value);
+    if ((len > 0) && ((len % 2) == 0) && (len <= 2 * 255)) {
+	packed = (unsigned char *) ckalloc((unsigned) (len / 2 + 1));
+	packed[0] = len / 2;
+	for (i = 0; i < len; i += 2) {
+	    if (((hi = hexValue(value[i])) < 0) ||
+				((lo = hexValue(value[i + 1])) < 0)) {
+		break;
+	    }
+	    packed[i / 2 + 1] = (hi << 4) | lo;
+	}
+	if (i == len) {
+	    return ((char *) packed);
+	}
+	ckfree((char *) packed);
+    }
+    packed = (unsigned char *) ckalloc((unsigned) (len + 2));
+    packed[0] = 0;
+    strcpy((char *) packed + 1, value);
+    return ((char *) packed);
+}
+
+static void
+#ifdef _USING_PROTOTYPES_
+unpackDigest(Tcl_Interp *interp, char *packed)
+#else
+unpackDigest(interp, packed)
+    Tcl_Interp *interp;
+    char *packed;
+#endif
+{
+    static char hexdigits[] = "0123456789abcdef";
+    unsigned char *bytes = (unsigned char *) packed;
+    char buf[2 * 255 + 1];
+    int n, i;
+
+    if ((n = bytes[0]) == 0) {
+	Tcl_SetResult(interp, packed + 1, TCL_VOLATILE);
+	return;
+    }
+    for (i = 0; i < n; i++) {
+	buf[2 * i] = hexdigits[bytes[i + 1] >> 4];
+	buf[2 * i + 1] = hexdigits[bytes[i + 1] & 0xf];
+    }
+    buf[2 * n] = '\0';
+    Tcl_SetResult(interp, buf, TCL_VOLATILE);
+}
+
+static void
+#ifdef _USING_PROTOTYPES_
+clearCell(PathTable *tablePtr, int column, int row)
+#else
+clearCell(tablePtr, column, row)
+    PathTable *tablePtr;
+    int column;
+    int row;
+#endif
+{
+    char *cell = tablePtr->cells[column][row];
+
+    if (cell == NULL)
+	return;
+    if (column == DIGESTCOLUMN)
+	ckfree(cell);
+    else
+	releaseValue(cell);
+    tablePtr->cells[column][row] = NULL;
+}
+
+static void
+#ifdef _USING_PROTOTYPES_
+deleteRow(PathTable *tablePtr, int row)
+#else
+deleteRow(tablePtr, row)
+    PathTable *tablePtr;
+    int row;
+#endif
+{
+    Tcl_HashEntry *entryPtr;
+    int column;
+
+    for (column = 0; column < NUMCOLUMNS; column++) {
+	clearCell(tablePtr, column, row);
+    }
+    entryPtr = Tcl_FindHashEntry(&tablePtr->rowIndex, tablePtr->paths[row]);
+    tablePtr->paths[row] = NULL;
+    if (entryPtr != NULL)
+	Tcl_DeleteHashEntry(entryPtr);
+    tablePtr->liveRows--;
+}
+
+/*
+ * Find the row for path, or -1 if there is none.  If create is non-zero,
+ *   add a new row if there is none.
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+findRow(PathTable *tablePtr, char *path, int create)
+#else
+findRow(tablePtr, path, create)
+    PathTable *tablePtr;
+    char *path;
+    int create;
+#endif
+{
+    Tcl_HashEntry *entryPtr;
+    int isNew, row, column;
+
+    if (!create) {
+	if ((entryPtr = Tcl_FindHashEntry(&tablePtr->rowIndex, path)) == NULL)
+	    return (-1);
+	return ((int) (long) Tcl_GetHashValue(entryPtr));
+    }
+    entryPtr = Tcl_CreateHashEntry(&tablePtr->rowIndex, path, &isNew);
+    if (!isNew)
+	return ((int) (long) Tcl_GetHashValue(entryPtr));
+    if (tablePtr->numRows == tablePtr->maxRows) {
+	/* grow all the columns together */
+	tablePtr->maxRows = (tablePtr->maxRows == 0) ? 256 :
+							2 * tablePtr->maxRows;
+	tablePtr->paths = (char **) ckrealloc((char *) tablePtr->paths,
+			(unsigned) (tablePtr->maxRows * sizeof(char *)));
+	for (column = 0; column < NUMCOLUMNS; column++) {
+	    tablePtr->cells[column] = (char **) ckrealloc(
+			(char *) tablePtr->cells[column],
+			(unsigned) (tablePtr->maxRows * sizeof(char *)));
+	}
+    }
+    row = tablePtr->numRows++;
+    tablePtr->liveRows++;
+    Tcl_SetHashValue(entryPtr, (ClientData) (long) row);
+    tablePtr->paths[row] = Tcl_GetHashKey(&tablePtr->rowIndex, entryPtr);
+    for (column = 0; column < NUMCOLUMNS; column++) {
+	tablePtr->cells[column][row] = NULL;
+    }
+    return (row);
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+findColumn(Tcl_Interp *interp, char *name)
+#else
+findColumn(interp, name)
+    Tcl_Interp *interp;
+    char *name;
+#endif
+{
+    int column;
+
+    for (column = 0; columnNames[column] != NULL; column++) {
+	if (strcmp(columnNames[column], name) == 0)
+	    return (column);
+    }
+    Tcl_AppendResult(interp, "unknown pathtable column \"", name, "\"",
+							    (char *) NULL);
+    return (-1);
+}
+
+static PathTable *
+#ifdef _USING_PROTOTYPES_
+findTable(Tcl_Interp *interp, char *handle)
+#else
+findTable(interp, handle)
+    Tcl_Interp *interp;
+    char *handle;
+#endif
+{
+    Tcl_HashEntry *entryPtr;
+
+    if ((entryPtr = Tcl_FindHashEntry(&tables, handle)) == NULL) {
+	Tcl_AppendResult(interp, "invalid pathtable descriptor \"", handle,
+						    "\"", (char *) NULL);
+	return (NULL);
+    }
+    return ((PathTable *) Tcl_GetHashValue(entryPtr));
+}
+
+static void
+#ifdef _USING_PROTOTYPES_
+deleteTable(PathTable *tablePtr)
+#else
+deleteTable(tablePtr)
+    PathTable *tablePtr;
+#endif
+{
+    int row, column;
+
+    for (row = 0; row < tablePtr->numRows; row++) {
+	if (tablePtr->paths[row] != NULL) {
+	    for (column = 0; column < NUMCOLUMNS; column++) {
+		clearCell(tablePtr, column, row);
+	    }
+	}
+    }
+    Tcl_DeleteHashTable(&tablePtr->rowIndex);
+    if (tablePtr->paths != NULL) {
+	ckfree((char *) tablePtr->paths);
+	for (column = 0; column < NUMCOLUMNS; column++) {
+	    ckfree((char *) tablePtr->cells[column]);
+	}
+    }
+    ckfree((char *) tablePtr);
+}
+
+/*
+ * The pathtable command.  Usage:
+ *   pathtable create
+ *	returns a descriptor for a new empty table
+ *   pathtable delete descriptor
+ *   pathtable set descriptor path column value
+ *   pathtable get descriptor path column
+ *	error if the column is not set for path
+ *   pathtable exists descriptor path ?column?
+ *   pathtable unset descriptor path ?column?
+ *	without a column, removes the whole path; no error if not set
+ *   pathtable paths descriptor
+ *	returns all paths in the order they were first set
+ *   pathtable size descriptor
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+Pathtable(ClientData clientData, Tcl_Interp *interp, int argc, char *argv[])
+#else
+Pathtable(clientData, interp, argc, argv)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    int argc;
+    char *argv[];
+#endif
+{
+    PathTable *tablePtr;
+    Tcl_HashEntry *entryPtr;
+    char *option;
+    int row, column, isNew;
+    char buf[32];
+
+    if (argc < 2)
+	goto wrongArgs;
+    option = argv[1];
+
+    if (strcmp(option, "create") == 0) {
+	if (argc != 2)
+	    goto wrongArgs;
+	tablePtr = (PathTable *) ckalloc(sizeof(PathTable));
+	memset((char *) tablePtr, 0, sizeof(PathTable));
+	Tcl_InitHashTable(&tablePtr->rowIndex, TCL_STRING_KEYS);
+	sprintf(buf, "pathtable%d", ++tableCount);
+	entryPtr = Tcl_CreateHashEntry(&tables, buf, &isNew);
+	Tcl_SetHashValue(entryPtr, (ClientData) tablePtr);
+	Tcl_SetResult(interp, buf, TCL_VOLATILE);
+	return TCL_OK;
+    }
+
+    if (argc < 3)
+	goto wrongArgs;
+    if ((tablePtr = findTable(interp, argv[2])) == NULL)
+	return TCL_ERROR;
+
+    if (strcmp(option, "delete") == 0) {
+	if (argc != 3)
+	    goto wrongArgs;
+	Tcl_DeleteHashEntry(Tcl_FindHashEntry(&tables, argv[2]));
+	deleteTable(tablePtr);
+	return TCL_OK;
+    }
+    if (strcmp(option, "paths") == 0) {
+	if (argc != 3)
+	    goto wrongArgs;
+	for (row = 0; row < tablePtr->numRows; row++) {
+	    if (tablePtr->paths[row] != NULL)
+		Tcl_AppendElement(interp, tablePtr->paths[row]);
+	}
+	return TCL_OK;
+    }
+    if (strcmp(option, "size") == 0) {
+	if (argc != 3)
+	    goto wrongArgs;
+	sprintf(buf, "%d", tablePtr->liveRows);
+	Tcl_SetResult(interp, buf, TCL_VOLATILE);
+	return TCL_OK;
+    }
+
+    if (argc < 4)
+	goto wrongArgs;
+    column = -1;
+    if (argc > 4) {
+	if ((column = findColumn(interp, argv[4])) < 0)
+	    return TCL_ERROR;
+    }
+
+    if (strcmp(option, "set") == 0) {
+	if (argc != 6)
+	    goto wrongArgs;
+	row = findRow(tablePtr, argv[3], 1);
+	clearCell(tablePtr, column, row);
+	if (column == DIGESTCOLUMN)
+	    tablePtr->cells[column][row] = packDigest(argv[5]);
+	else
+	    tablePtr->cells[column][row] = poolValue(argv[5]);
+	Tcl_SetResult(interp, argv[5], TCL_VOLATILE);
+	return TCL_OK;
+    }
+    if (strcmp(option, "get") == 0) {
+	if (argc != 5)
+	    goto wrongArgs;
+	if (((row = findRow(tablePtr, argv[3], 0)) < 0) ||
+		    (tablePtr->cells[column][row] == NULL)) {
+	    Tcl_AppendResult(interp, "no ", argv[4], " in pathtable for \"",
+					argv[3], "\"", (char *) NULL);
+	    return TCL_ERROR;
+	}
+	if (column == DIGESTCOLUMN)
+	    unpackDigest(interp, tablePtr->cells[column][row]);
+	else
+	    Tcl_SetResult(interp, tablePtr->cells[column][row], TCL_VOLATILE);
+	return TCL_OK;
+    }
+    if (strcmp(option, "exists") == 0) {
+	if (argc > 5)
+	    goto wrongArgs;
+	row = findRow(tablePtr, argv[3], 0);
+	Tcl_SetResult(interp, ((row >= 0) && ((column < 0) ||
+		    (tablePtr->cells[column][row] != NULL))) ? "1" : "0",
+		    TCL_STATIC);
+	return TCL_OK;
+    }
+    if (strcmp(option, "unset") == 0) {
+	if (argc > 5)
+	    goto wrongArgs;
+	if ((row = findRow(tablePtr, argv[3], 0)) < 0)
+	    return TCL_OK;
+	if (column < 0)
+	    deleteRow(tablePtr, row);
+	else
+	    clearCell(tablePtr, column, row);
+	return TCL_OK;
+    }
+
+wrongArgs:
+    Tcl_AppendResult (interp, "wrong # args: should be either:\n",
+	"  ", argv[0], " create (returns descriptor)\n",
+	"  ", argv[0], " {delete | paths | size} descriptor\n",
+	"  ", argv[0], " set descriptor path column value\n",
+	"  ", argv[0], " get descriptor path column\n",
+	"  ", argv[0], " {exists | unset} descriptor path ?column?",
+	(char *) NULL);
+    return TCL_ERROR;
+}
+
+int
+#ifdef _USING_PROTOTYPES_
+Pathtable_Init(Tcl_Interp *interp)
+#else
+Pathtable_Init(interp)
+    Tcl_Interp *interp;
+#endif
+{
+	Tcl_InitHashTable(&tables, TCL_STRING_KEYS);
+	Tcl_InitHashTable(&valuePool, TCL_STRING_KEYS);
+        Tcl_CreateCommand (interp, "pathtable", Pathtable,
+                (ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+        return TCL_OK;
+}
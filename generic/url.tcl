@@ -75,6 +75,8 @@ proc urlGet {args} {
 	progressmsg "POSTing to $url"
     } else {
 	progressmsg "Fetching $url"
+	# reuse connections to the same server for all the fetches in a run
+	lappend args -keepalive 1
     }
     global cfgContents
     if {[regexp -nocase "^http://(\[^/:\]+)" $url x host]} {
@@ -260,7 +262,15 @@ proc urlCopy {url localfile {ifModifiedSince ""} {extraArgs ""}} {
 	nsbderror "url must begin with http://, ftp://, or rsync://: $url"
     }
     if {$ifModifiedSince != ""} {
-	lappend extraArgs -headers [list "If-Modified-Since" $ifModifiedSince]
+	set headers [list "If-Modified-Since" $ifModifiedSince]
+	set idx [lsearch -exact $extraArgs "-headers"]
+	if {$idx >= 0} {
+	    incr idx
+	    set extraArgs [lreplace $extraArgs $idx $idx \
+				[concat [lindex $extraArgs $idx] $headers]]
+	} else {
+	    lappend extraArgs -headers $headers
+	}
     }
     if {$localfile != "-"} {
 	set fd [notrace {open $localfile "w"}]
@@ -286,6 +296,53 @@ proc urlCopy {url localfile {ifModifiedSince ""} {extraArgs ""}} {
 	notrace {http_wait $token}
 	fconfigure $fd -translation $savetranslation
     }
+    return [urlCopyDone $token $url $ifModifiedSince]
+}
+
+#
+# Start copying url to localfile like urlCopy does, but pipeline the
+#   request on a kept-alive connection to the same server that is still
+#   waiting for the responses to earlier requests.  Returns a list of the
+#   http token and the open localfile to pass to urlPipelinedCopyWait.
+#
+proc urlPipelinedCopyStart {url localfile {ifModifiedSince ""}} {
+    set extraArgs [list -pipeline 1]
+    # the '.nsb' files fetched this way are uncompressed after they arrive
+    set headers [urlAcceptEncodingHeaders]
+    if {$ifModifiedSince != ""} {
+	lappend headers "If-Modified-Since" $ifModifiedSince
+    }
+    if {$headers != ""} {
+	lappend extraArgs -headers $headers
+    }
+    set fd [notrace {open $localfile "w"}]
+    if {[catch {eval urlGet [list $url -handler "urlCopyHandler $fd"] \
+						$extraArgs} token] != 0} {
+	global errorInfo errorCode
+	close $fd
+	error $token $errorInfo $errorCode
+    }
+    return [list $token $fd]
+}
+
+#
+# Wait for a copy started by urlPipelinedCopyStart to finish, and return
+#   the same thing as urlCopy
+#
+proc urlPipelinedCopyWait {url localfile token fd {ifModifiedSince ""}} {
+    alwaysEvalFor "" {close $fd} {
+	alwaysEvalFor $localfile {} {
+	    notrace {http_wait $token}
+	}
+    }
+    return [urlCopyDone $token $url $ifModifiedSince]
+}
+
+#
+# Check the results of the urlCopy of url with token and return what
+#   urlCopy returns
+#
+proc urlCopyDone {token url ifModifiedSince} {
     httpCheck $token $url
     upvar #0 $token state
     if {$ifModifiedSince != ""} {
@@ -349,13 +406,55 @@ proc urlFile {urlOrFile {ifModifiedSince ""}} {
 	    notrace {file copy -force $topPath $scratchName}
 	    return [list $scratchName]
 	}
+	# offer compression; procfile uncompresses '.nsb' files
+	set extraArgs [list -progress urlProgress]
+	set headers [urlAcceptEncodingHeaders]
+	if {$headers != ""} {
+	    lappend extraArgs -headers $headers
+	}
 	return [list $scratchName \
-	    [urlCopy $urlOrFile $scratchName $ifModifiedSince "-progress urlProgress"]]
+	    [urlCopy $urlOrFile $scratchName $ifModifiedSince $extraArgs]]
     }
     notrace {file copy -force $urlOrFile $scratchName}
     return [list $scratchName]
 }
 
+#
+# Like urlFile for the '.nsb' file of package, but fetch the delta from
+#   the stored '.nsb' file and apply it.  Returns empty if there is no
+#   delta or it could not be used, so the whole '.nsb' file has to be
+#   fetched instead.
+#
+proc urlNsbDeltaFile {package {ifModifiedSince ""}} {
+    if {[catch {nsbDeltaSource $package} source] != 0} {
+	debugmsg "couldn't find a '.nsb' delta for $package: $source"
+	return ""
+    }
+    if {$source == ""} {
+	return ""
+    }
+    foreach {deltaUrl baseFile} $source {}
+    set deltaName [scratchAddName "ndl"]
+    set scratchName [scratchAddName "ucp"]
+    set code [catch {
+	set serverTime [urlCopy $deltaUrl $deltaName $ifModifiedSince \
+						    "-progress urlProgress"]
+	if {$serverTime != ""} {
+	    applyNsbDelta $baseFile $deltaName $scratchName
+	}
+    } message]
+    scratchClean [list $deltaName]
+    if {$code != 0} {
+	debugmsg "couldn't use $deltaUrl: $message"
+	scratchClean [list $scratchName]
+	return ""
+    }
+    if {$serverTime != ""} {
+	progressmsg "Applied $deltaUrl to $baseFile"
+    }
+    return [list $scratchName $serverTime]
+}
+
 #
 # Copy a url to a local file while calculating the message digest checksum.  
 #   mdType is message digest type.  When finished, compare the message digest
@@ -363,26 +462,70 @@ proc urlFile {urlOrFile {ifModifiedSince ""}} {
 # If not successful, an error will be raised.
 #
 
-proc urlMdCopy {url fromPath mdType expectedMdData localfile reloc {mode ""}} {
+proc urlMdCopy {url fromPath mdType expectedMdData localfile reloc {mode ""} \
+							{resumeFrom ""}} {
     set url "$url/$fromPath"
-    if {$mode == ""} {
-	set mode "0666"
-    }
-    set fd [withParentDir {openbreloc $localfile $reloc "w" $mode} $localfile]
-    set mdDescriptor [$mdType -init]
+    foreach {fd mdDescriptor resumeFrom} \
+	    [urlMdOpen $localfile $reloc $mode $mdType $resumeFrom] {}
     alwaysEvalFor "" {closebreloc $fd} {
-	set token [urlGet $url -handler "urlMdCopyHandler $fd" \
-						-progress urlProgress]
+	set token [eval urlGet {$url -handler "urlMdCopyHandler $fd"} \
+			-progress urlProgress [urlResumeArgs $resumeFrom]]
 	upvar #0 $token state
 	set state(mdType) $mdType
 	set state(mdDescriptor) $mdDescriptor
+	set state(resumeFrom) $resumeFrom
 	alwaysEvalFor $localfile {} {
 	    notrace {http_wait $token}
 	}
     }
     httpCheck $token $url
     http_reset $token
-    compareMdDataFor $fromPath $expectedMdData [$mdType -final $mdDescriptor] 
+    compareMdDataFor $fromPath $expectedMdData \
+				[$mdType -final $state(mdDescriptor)] 
+}
+
+#
+# Open localfile to receive the data of a file and return a list of the
+#   file descriptor, a message digest descriptor, and the number of bytes
+#   already in the file.  If resumeFrom is a number greater than zero,
+#   that many bytes left in the file by an earlier interrupted transfer
+#   are kept and read into the message digest, and the rest of the data
+#   will be written after them.  Resuming is only done without relocation
+#   because the earlier bytes have already been relocated.
+#
+
+proc urlMdOpen {localfile reloc mode mdType resumeFrom} {
+    if {$mode == ""} {
+	set mode "0666"
+    }
+    set mdDescriptor [$mdType -init]
+    if {($resumeFrom != "") && ($resumeFrom > 0) &&
+		(($reloc == "") || ($reloc == "=")) &&
+		    ![catch {open $localfile "r+"} fd]} {
+	fconfigure $fd -translation binary
+	set n [$mdType -update $mdDescriptor -chan $fd -maxbytes $resumeFrom]
+	if {$n == $resumeFrom} {
+	    transfermsg "Resuming $localfile after $n bytes"
+	    return [list $fd $mdDescriptor $resumeFrom]
+	}
+	close $fd
+	$mdType -final $mdDescriptor
+	set mdDescriptor [$mdType -init]
+    }
+    set fd [withParentDir {openbreloc $localfile $reloc "w" $mode} $localfile]
+    return [list $fd $mdDescriptor 0]
+}
+
+#
+# Return extra urlGet arguments to fetch only the part of a file after
+#   resumeFrom bytes
+#
+
+proc urlResumeArgs {resumeFrom} {
+    if {$resumeFrom > 0} {
+	return [list -headers [list Range "bytes=$resumeFrom-"]]
+    }
+    return ""
 }
 
 #
@@ -396,11 +539,456 @@ proc urlMdCopyHandler {fd socket token} {
 	fconfigure $socket -translation binary
 	fconfigure $fd -translation binary
 	set state(afterFirstBlock) 1
+	if {[info exists state(resumeFrom)] && ($state(resumeFrom) > 0) &&
+				([lindex $state(http) 1] != 206)} {
+	    # the server did not honor the Range, start over
+	    seek $fd 0
+	    $state(mdType) -final $state(mdDescriptor)
+	    set state(mdDescriptor) [$state(mdType) -init]
+	    set state(resumeFrom) 0
+	}
     }
     return [$state(mdType) -update $state(mdDescriptor) -chan $socket \
 			-copychan $fd -maxbytes $state(-blocksize)]
 }
 
+#
+# Copy files from a url to local files like urlMdCopy does, but keep up to
+#   maxParallel of the transfers going at the same time.  pathsInfo is as
+#   described for urlMultiMdCopy below.  Each transfer has its own message
+#   digest and relocation, and all of their message digests are compared
+#   as each one finishes.  If any transfer fails the rest are stopped and
+#   the first error is raised.
+#
+
+proc urlParallelMdCopy {url mdType pathsInfo maxParallel} {
+    upvar #0 urlParallel parallel
+    catch {unset parallel}
+    set parallel(done) ""
+    set active ""
+    set pathnum 0
+    set numpaths [llength $pathsInfo]
+    while {1} {
+	while {![info exists errorList] && ($pathnum < $numpaths) &&
+				([llength $active] < $maxParallel)} {
+	    set pathInfo [lindex $pathsInfo $pathnum]
+	    incr pathnum
+	    if {[catch {urlParallelStart $url $mdType $pathInfo} token]} {
+		global errorInfo errorCode
+		set errorList [list $token $errorInfo $errorCode]
+		break
+	    }
+	    lappend active $token
+	}
+	if {[info exists errorList]} {
+	    # stop all the other transfers
+	    foreach token $active {
+		upvar #0 $token state
+		catch {http_reset $token}
+		catch {closebreloc [lindex $state(parallelInfo) 0]}
+		catch {unset state}
+	    }
+	    catch {unset parallel}
+	    eval error $errorList
+	}
+	if {$active == ""} {
+	    break
+	}
+	if {$parallel(done) == ""} {
+	    vwait urlParallel(done)
+	}
+	set done $parallel(done)
+	set parallel(done) ""
+	foreach token $done {
+	    set idx [lsearch -exact $active $token]
+	    set active [lreplace $active $idx $idx]
+	    if {[catch {urlParallelFinish $token} msg]} {
+		global errorInfo errorCode
+		if {![info exists errorList]} {
+		    set errorList [list $msg $errorInfo $errorCode]
+		}
+	    }
+	}
+    }
+    catch {unset parallel}
+}
+
+#
+# Start one of the transfers for urlParallelMdCopy and return its token
+#
+
+proc urlParallelStart {url mdType pathInfo} {
+    foreach {fromPath toTop finalPath mode expectedMdData xx reloc resumeFrom} \
+								$pathInfo {break}
+    set localfile [file join $toTop $fromPath]
+    set url "$url/$fromPath"
+    foreach {fd mdDescriptor resumeFrom} \
+	    [urlMdOpen $localfile $reloc $mode $mdType $resumeFrom] {}
+    alwaysEvalFor "" {if {$token == ""} {closebreloc $fd}} {
+	set token ""
+	set token [eval urlGet {$url -handler "urlMdCopyHandler $fd"} \
+			-progress urlProgress -command urlParallelDone \
+			[urlResumeArgs $resumeFrom]]
+    }
+    upvar #0 $token state
+    set state(mdType) $mdType
+    set state(mdDescriptor) $mdDescriptor
+    set state(resumeFrom) $resumeFrom
+    set state(parallelInfo) \
+	    [list $fd $url $fromPath $expectedMdData $localfile]
+    return $token
+}
+
+proc urlParallelDone {token} {
+    # can't finish here because this is called while the transfer is
+    #   being finished, so queue it up for urlParallelMdCopy
+    upvar #0 urlParallel parallel
+    lappend parallel(done) $token
+}
+
+#
+# Check the results of one finished transfer for urlParallelMdCopy
+#
+
+proc urlParallelFinish {token} {
+    upvar #0 $token state
+    foreach {fd url fromPath expectedMdData localfile} $state(parallelInfo) {}
+    set mdType $state(mdType)
+    set mdDescriptor $state(mdDescriptor)
+    # the token, and the connection if it could be kept alive, are
+    #   released even if the transfer failed
+    set reset 0
+    alwaysEvalFor "" {
+	    if {!$reset} {
+		catch {http_reset $token}
+		catch {$mdType -final $mdDescriptor}
+	    }
+	    unset state
+	} {
+	alwaysEvalFor "" {closebreloc $fd} {
+	    alwaysEvalFor $localfile {} {
+		notrace {http_wait $token}
+	    }
+	}
+	httpCheck $token $url
+	set reset 1
+	http_reset $token
+    }
+    compareMdDataFor $fromPath $expectedMdData [$mdType -final $mdDescriptor]
+}
+
+#
+# Copy the file fromPath under the urls, which are mirrors of each other,
+#   to localfile in numSegments pieces at once.  Each piece is fetched
+#   with an http Range request from one of the urls in turn and written
+#   at its offset in the file.  The message digest is calculated on the
+#   whole file at the end, and if there is relocation it is done then too
+#   from a separate file of the unrelocated pieces.
+#
+
+proc urlSegmentedMdCopy {urls fromPath mdType expectedMdData localfile reloc \
+						    mode numSegments} {
+    if {$mode == ""} {
+	set mode "0666"
+    }
+    set length [lindex $expectedMdData 0]
+    set segfile $localfile
+    if {($reloc != "") && ($reloc != "=")} {
+	set segfile "$localfile.segments"
+    }
+    set segsize [expr {($length + $numSegments - 1) / $numSegments}]
+    transfermsg "Fetching $fromPath in $numSegments segments"
+    notrace {file delete -force $segfile}
+    close [withParentDir {open $segfile "w" $mode} $segfile]
+
+    upvar #0 urlSegmented segmented
+    catch {unset segmented}
+    set segmented(done) ""
+    set active ""
+    alwaysEvalFor "" {
+		foreach token $active {
+		    upvar #0 $token state
+		    catch {http_reset $token}
+		    catch {close [lindex $state(segmentInfo) 0]}
+		    catch {unset state}
+		}
+		catch {unset segmented}
+	    } {
+	for {set n 0} {$n < $numSegments} {incr n} {
+	    set offset [expr {$n * $segsize}]
+	    if {$offset >= $length} {
+		break
+	    }
+	    set last [expr {$offset + $segsize - 1}]
+	    if {$last >= $length} {
+		set last [expr {$length - 1}]
+	    }
+	    set url "[lindex $urls [expr {$n % [llength $urls]}]]/$fromPath"
+	    set fd [open $segfile "r+"]
+	    fconfigure $fd -translation binary
+	    seek $fd $offset
+	    set token ""
+	    alwaysEvalFor "" {if {$token == ""} {close $fd}} {
+		set token [urlGet $url -handler [list urlSegmentHandler $fd] \
+			    -command urlSegmentDone \
+			    -headers [list Range "bytes=$offset-$last"]]
+	    }
+	    upvar #0 $token state
+	    set state(segmentInfo) \
+		    [list $fd $url [expr {$last - $offset + 1}]]
+	    lappend active $token
+	}
+	while {$active != ""} {
+	    if {$segmented(done) == ""} {
+		vwait urlSegmented(done)
+	    }
+	    set done $segmented(done)
+	    set segmented(done) ""
+	    foreach token $done {
+		set idx [lsearch -exact $active $token]
+		set active [lreplace $active $idx $idx]
+		urlSegmentFinish $token
+	    }
+	}
+    }
+
+    if {$segfile == $localfile} {
+	withOpen fd $localfile "r" {
+	    fconfigure $fd -translation binary
+	    set mdData [$mdType -chan $fd]
+	}
+    } else {
+	alwaysEvalFor "" {catch {file delete $segfile}} {
+	    withOpen fdFrom $segfile "r" {
+		fconfigure $fdFrom -translation binary
+		set fdTo [openbreloc $localfile $reloc "w" $mode]
+		alwaysEvalFor "" {closebreloc $fdTo} {
+		    set mdData [$mdType -copychan $fdTo -chan $fdFrom]
+		}
+	    }
+	}
+    }
+    compareMdDataFor $fromPath $expectedMdData $mdData
+}
+
+#
+# This is called whenever data is available for a segment of
+#  urlSegmentedMdCopy.  Return the number of bytes read.
+#
+proc urlSegmentHandler {fd socket token} {
+    upvar #0 $token state
+    if {![info exists state(afterFirstBlock)]} {
+	fconfigure $socket -translation binary
+	set state(afterFirstBlock) 1
+	if {[lindex $state(http) 1] != 206} {
+	    nsbderror "server did not honor Range request: $state(http)"
+	}
+    }
+    set block [read $socket $state(-blocksize)]
+    puts -nonewline $fd $block
+    return [string length $block]
+}
+
+proc urlSegmentDone {token} {
+    # finished by urlSegmentedMdCopy, as for urlParallelDone
+    upvar #0 urlSegmented segmented
+    lappend segmented(done) $token
+}
+
+#
+# Check the results of one finished segment for urlSegmentedMdCopy
+#
+
+proc urlSegmentFinish {token} {
+    upvar #0 $token state
+    foreach {fd url length} $state(segmentInfo) {}
+    # as in urlParallelFinish, the token is released even after an error
+    set reset 0
+    alwaysEvalFor "" {
+	    if {!$reset} {
+		catch {http_reset $token}
+	    }
+	    unset state
+	} {
+	alwaysEvalFor "" {close $fd} {
+	    notrace {http_wait $token}
+	}
+	httpCheck $token $url
+	if {$state(currentsize) != $length} {
+	    nsbderror "$url segment length incorrect: expected $length, got $state(currentsize)"
+	}
+	set reset 1
+	http_reset $token
+    }
+}
+
+#
+# Copy files like urlMultiMdCopy does, but from the pack file at url that
+#   makePackFile wrote.  Its index at url.idx, keyed by the packPath of
+#   each file, is fetched first, and then
+#   the files are fetched in order with a Range request for each run of
+#   them that are no more than 64 kilobytes apart in the pack file, up to
+#   64 files at a time.
+#
+
+proc urlPackMdCopy {url mdType pathsInfo} {
+    set indexFile [scratchAddName "pki"]
+    alwaysEvalFor "" {scratchClean $indexFile} {
+	urlCopy "$url.idx" $indexFile
+	withOpen fd $indexFile "r" {
+	    while {[gets $fd line] >= 0} {
+		if {[regexp {^([0-9]+) ([0-9]+) (.*)$} $line \
+						x offset length path]} {
+		    set packIndex($path) [list $offset $length]
+		}
+	    }
+	}
+    }
+    set wanted ""
+    foreach pathInfo $pathsInfo {
+	set packPath [lindex $pathInfo 8]
+	if {$packPath == ""} {
+	    set packPath [lindex $pathInfo 0]
+	}
+	if {![info exists packIndex($packPath)]} {
+	    nsbderror "$packPath is not in $url.idx"
+	}
+	foreach {offset length} $packIndex($packPath) {}
+	if {$length != [lindex [lindex $pathInfo 4] 0]} {
+	    nsbderror "$packPath has length $length in $url.idx, expected [lindex [lindex $pathInfo 4] 0]"
+	}
+	lappend wanted [list $offset $length $pathInfo]
+    }
+    set run ""
+    set runEnd 0
+    foreach item [lsort -integer -index 0 $wanted] {
+	set offset [lindex $item 0]
+	if {($run != "") &&
+		((($offset - $runEnd) > 65536) || ([llength $run] >= 64))} {
+	    urlPackFetchRun $url $mdType $run
+	    set run ""
+	}
+	lappend run $item
+	set runEnd [expr {$offset + [lindex $item 1]}]
+    }
+    if {$run != ""} {
+	urlPackFetchRun $url $mdType $run
+    }
+}
+
+#
+# Fetch the files in run, a list of offset, length and pathInfo of files
+#   in the pack file at url, with one Range request
+#
+
+proc urlPackFetchRun {url mdType run} {
+    set start [lindex [lindex $run 0] 0]
+    set end [expr {$start - 1}]
+    set segments ""
+    alwaysEvalFor "" {
+		foreach segment $segments {
+		    catch {closebreloc [lindex $segment 2]}
+		}
+	    } {
+	foreach item $run {
+	    foreach {offset length pathInfo} $item {}
+	    foreach {fromPath toTop finalPath mode expectedMdData xx reloc} \
+							    $pathInfo {break}
+	    foreach {fd mdDescriptor x} [urlMdOpen [file join $toTop $fromPath] \
+					    $reloc $mode $mdType ""] {}
+	    lappend segments [list $offset $length $fd $mdDescriptor \
+						$fromPath $expectedMdData]
+	    transfermsg "Pack-fetching $fromPath"
+	    if {($offset + $length - 1) > $end} {
+		set end [expr {$offset + $length - 1}]
+	    }
+	}
+	if {$end >= $start} {
+	    set token [urlGet $url -handler urlPackHandler \
+			-headers [list Range "bytes=$start-$end"] \
+			-progress urlProgress]
+	    upvar #0 $token state
+	    set state(mdType) $mdType
+	    set state(packSegments) $segments
+	    set state(packPos) $start
+	    alwaysEvalFor $url {} {
+		notrace {http_wait $token}
+	    }
+	    httpCheck $token $url
+	    foreach segment $state(packSegments) {
+		if {[lindex $segment 1] > 0} {
+		    nsbderror "premature end of data from $url for [lindex $segment 4]"
+		}
+	    }
+	    http_reset $token
+	}
+    }
+    foreach segment $segments {
+	foreach {offset length fd mdDescriptor fromPath expectedMdData} \
+							    $segment {}
+	compareMdDataFor $fromPath $expectedMdData \
+					[$mdType -final $mdDescriptor]
+    }
+}
+
+#
+# This is called whenever data is available for a run of files from a pack
+#  file.  The bytes between the files are skipped.  Return the number of
+#  bytes read.
+#
+proc urlPackHandler {socket token} {
+    upvar #0 $token state
+    if {![info exists state(afterFirstBlock)]} {
+	fconfigure $socket -translation binary
+	set state(afterFirstBlock) 1
+	if {[lindex $state(http) 1] != 206} {
+	    nsbderror "server did not honor Range request: $state(http)"
+	}
+    }
+    set mdType $state(mdType)
+    set max $state(-blocksize)
+    set total 0
+    while {$max > 0} {
+	while {($state(packSegments) != "") &&
+		    ([lindex [lindex $state(packSegments) 0] 1] == 0)} {
+	    # nothing to read for an empty file
+	    set state(packSegments) [lrange $state(packSegments) 1 end]
+	}
+	if {$state(packSegments) == ""} {
+	    if {$total > 0} {
+		break
+	    }
+	    nsbderror "more data than requested from $state(url)"
+	}
+	foreach {offset length fd mdDescriptor} \
+				[lindex $state(packSegments) 0] {break}
+	if {$state(packPos) < $offset} {
+	    set n [expr {$offset - $state(packPos)}]
+	    if {$n > $max} {
+		set n $max
+	    }
+	    set got [string length [read $socket $n]]
+	} else {
+	    set n [expr {$offset + $length - $state(packPos)}]
+	    if {$n > $max} {
+		set n $max
+	    }
+	    set got [$mdType -update $mdDescriptor -chan $socket \
+				    -copychan $fd -maxbytes $n]
+	    if {($state(packPos) + $got) == ($offset + $length)} {
+		set state(packSegments) [lrange $state(packSegments) 1 end]
+	    }
+	}
+	incr state(packPos) $got
+	incr total $got
+	incr max -$got
+	if {$got < $n} {
+	    break
+	}
+    }
+    return $total
+}
+
 #
 # Fetch multiple files in one http connection, or from an open file
 #  descriptor if that is provided instead of a url, and check the
@@ -409,6 +997,10 @@ proc urlMdCopyHandler {fd socket token} {
 #  accepts file names in a POST to its standard input, and then for each file
 #  puts out the filename in a Content-Name: header and the length in
 #  Content-Length: followed by a blank line followed by the data for the file.
+#  The encodings from urlAcceptEncodings are offered in an Accept-Encoding
+#  header, and a file may come compressed with one of them as indicated by
+#  a Content-Encoding: header before its Content-Length:.  The data is
+#  uncompressed before its message digest is checked.
 # mdType is message digest type
 # pathsInfo is a list of info about each path.  Info is a list of
 #   1. fromPath - path to retrieve
@@ -422,29 +1014,259 @@ proc urlMdCopyHandler {fd socket token} {
 #		directory of where the file will be ultimately installed
 #   7. reloc - optional "from=to" translation to apply to relocating the
 #		data in the file after calculating the checksum
+#   8. resumeFrom - optional number of bytes of the file already fetched
+#		by an earlier interrupted transfer.  These are sent to the
+#		server after a tab following the path, and if the server
+#		answers with a Content-Offset: header only the rest of the
+#		file follows.
+#   9. packPath - optional path of the file in a pack file from a packUrl,
+#		which is its path in the '.nsb' file even when fromPath
+#		has had urlPresubstitutions applied
+# If an older version of a file is installed at finalPath under installTop,
+#   a tab, a zero offset, another tab, the word "delta", the block size
+#   and the length of the older version (after undoing reloc) are sent
+#   after the path, and the block signatures of it follow the line.  If
+#   the server answers with a Content-Delta: header only a delta from the
+#   older version follows, sent in chunks with "Transfer-Encoding: chunked"
+#   because its length isn't known until it has been made.
 # fd is file descriptor of an open file to use instead of a URL
 # maxBytes, if set, is the maximum number of bytes to read from fd
 #
 proc urlMultiMdCopy {url mdType pathsInfo {fd ""} {maxBytes ""}} {
-    set numpaths [llength $pathsInfo]
-    if {$numpaths == 0} {
+    if {[llength $pathsInfo] == 0} {
 	return ""
     }
-    set paths ""
-    set sep ""
+    if {$fd != ""} {
+	urlMultiMdFetch "" $mdType $pathsInfo "" "" $fd $maxBytes
+	return
+    }
+    foreach {queryFile bases usingExtras} [urlMultiQuery $pathsInfo 1] {break}
+    if {!$usingExtras} {
+	alwaysEvalFor "" {scratchClean [list $queryFile]} {
+	    urlMultiMdFetch $url $mdType $pathsInfo $queryFile ""
+	}
+	return
+    }
+    # multiget servers before resume or delta support was added fail on
+    #   the extras, so if anything goes wrong, including a delta that
+    #   doesn't reproduce the file, try again without them
+    alwaysEvalFor "" {urlCleanBases $bases; scratchClean [list $queryFile]} {
+	set code [catch {urlMultiMdFetch $url $mdType $pathsInfo \
+						    $queryFile $bases} msg]
+    }
+    if {$code != 0} {
+	debugmsg "multi-fetch with resume offsets or deltas failed: $msg"
+	set queryFile [lindex [urlMultiQuery $pathsInfo 0] 0]
+	alwaysEvalFor "" {scratchClean [list $queryFile]} {
+	    urlMultiMdFetch $url $mdType $pathsInfo $queryFile ""
+	}
+    }
+}
+
+#
+# Return urls, a list of mirrors of the same files, in the order that
+#   their servers accepted a connection, followed by the ones that did not
+#   accept one within two seconds in their original order.  All the
+#   connections are started at once.  When going through a proxy the
+#   order is not changed because all connections would go to the proxy.
+#
+proc urlRankMirrors {urls} {
+    global cfgContents urlProbe
+    if {([llength $urls] < 2) || [info exists cfgContents(http_proxy)]} {
+	return $urls
+    }
+    catch {unset urlProbe}
+    set urlProbe(waiting) 0
+    set urlProbe(ranked) ""
+    foreach url $urls {
+	if {![regexp -nocase {^http://([^/:]+)(:([0-9]+))?} $url \
+							x host y port]} {
+	    continue
+	}
+	if {$port == ""} {
+	    set port 80
+	}
+	if {[catch {socket -async $host $port} sock] != 0} {
+	    debugmsg "can't connect to $url: $sock"
+	    continue
+	}
+	fileevent $sock writable [list urlProbeDone $sock $url]
+	set urlProbe($sock) $url
+	incr urlProbe(waiting)
+    }
+    if {$urlProbe(waiting) > 0} {
+	set timer [after 2000 {set urlProbe(waiting) 0}]
+	while {$urlProbe(waiting) > 0} {
+	    vwait urlProbe(waiting)
+	}
+	after cancel $timer
+    }
+    foreach sock [array names urlProbe sock*] {
+	close $sock
+    }
+    set ranked $urlProbe(ranked)
+    foreach url $urls {
+	if {[lsearch -exact $ranked $url] < 0} {
+	    lappend ranked $url
+	}
+    }
+    unset urlProbe
+    debugmsg "mirrors ranked $ranked"
+    return $ranked
+}
+
+#
+# Called when the connection to url on sock started by urlRankMirrors has
+#   completed or failed
+#
+proc urlProbeDone {sock url} {
+    global urlProbe
+    if {[catch {fconfigure $sock -peername}] == 0} {
+	lappend urlProbe(ranked) $url
+    } else {
+	debugmsg "can't connect to $url"
+    }
+    close $sock
+    unset urlProbe($sock)
+    incr urlProbe(waiting) -1
+}
+
+#
+# Try to get the files in pathsInfo for package from the -multigetServer
+#   of other nsbd clients that have the package installed, one peer url
+#   after another starting at one picked by process id to spread the
+#   load, and return the pathsInfo of the files that no peer could
+#   provide.  A peer undoes its own relocation of the files it has
+#   installed, so what it sends is the same as from the multigetUrl and
+#   is relocated here as usual.  Every file is checked against its
+#   expected message digest just as when it comes from the multigetUrl,
+#   so a peer with a different version of the package can only cause a
+#   fallback.
+#
+proc urlPeersMultiMdCopy {peers package mdType pathsInfo} {
+    set numpeers [llength $peers]
+    set start [expr {[pid] % $numpeers}]
+    for {set n 0} {($n < $numpeers) && ($pathsInfo != "")} {incr n} {
+	set peer [lindex $peers [expr {($start + $n) % $numpeers}]]
+	if {[catch {urlMultiMdCopy "$peer?$package" $mdType $pathsInfo} \
+								msg] == 0} {
+	    return ""
+	}
+	debugmsg "multi-fetch from peer $peer failed: $msg"
+	set pathsInfo [urlUnfetchedPaths $mdType $pathsInfo]
+    }
+    return $pathsInfo
+}
+
+#
+# Return the pathsInfo of the files in pathsInfo that have not been
+#   completely fetched, as determined by their message digests after
+#   undoing relocation.  Partial files are not resumed because they may
+#   have come from somewhere with different contents.
+#
+proc urlUnfetchedPaths {mdType pathsInfo} {
+    set unfetchedInfo ""
+    foreach pathInfo $pathsInfo {
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc \
+						    resumeFrom} $pathInfo {break}
+	set revreloc ""
+	if {[regexp {^(.*)=(.*)$} $reloc x from to]} {
+	    set revreloc "$to=$from"
+	}
+	if {[catch {
+		set fd [openbreloc [file join $toTop $fromPath] $revreloc "r"]
+		alwaysEvalFor "" {closebreloc $fd} {
+		    compareMdDataFor $fromPath $expectedMdData \
+						    [$mdType -chan $fd]
+		}
+	    }] != 0} {
+	    lappend unfetchedInfo [lreplace $pathInfo 7 7 ""]
+	}
+    }
+    return $unfetchedInfo
+}
+
+#
+# Write the multiget request for pathsInfo into a scratch file, one line
+#   at a time so that a request for a huge number of files is never held
+#   in memory, and return a list of the file name, the list of the basis
+#   files for deltas of each path (empty if there is none), and whether
+#   or not any resume offsets or deltas are in the request.  If extras is
+#   false, there are none.
+#
+proc urlMultiQuery {pathsInfo extras} {
+    global urlMultiQueryCount
+    set queryFile [scratchAddName mgq[incr urlMultiQueryCount]]
+    set bases ""
+    set usingExtras 0
+    withOpen fd $queryFile "w" {
+	fconfigure $fd -translation binary
+	foreach pathInfo $pathsInfo {
+	    set line [lindex $pathInfo 0]
+	    set basis ""
+	    if {$extras} {
+		set resumeFrom [lindex $pathInfo 7]
+		if {($resumeFrom != "") && ($resumeFrom > 0)} {
+		    append line "\t$resumeFrom"
+		    set usingExtras 1
+		} elseif {[set ans [urlDeltaBasis $pathInfo]] != ""} {
+		    foreach {basis delta sigFile} $ans {break}
+		    append line "\t0\tdelta $delta"
+		    set usingExtras 1
+		}
+	    }
+	    puts $fd $line
+	    if {$basis != ""} {
+		alwaysEvalFor "" {scratchClean [list $sigFile]} {
+		    withOpen sfd $sigFile "r" {
+			fconfigure $sfd -translation binary
+			fcopy $sfd $fd
+		    }
+		}
+	    }
+	    lappend bases $basis
+	}
+    }
+    return [list $queryFile $bases $usingExtras]
+}
+
+#
+# Do the work of urlMultiMdCopy, sending the multiget request in queryFile
+#   to url, or reading from fd.  bases is the list of basis files for
+#   deltas from urlMultiQuery.  The request is sent while the response is
+#   being read, so a server that answers each path as it arrives can
+#   start sending files right away.
+#
+proc urlMultiMdFetch {url mdType pathsInfo queryFile bases {fd ""} {maxBytes ""}} {
+    set numpaths [llength $pathsInfo]
     if {$fd == ""} {
-	foreach pathInfo $pathsInfo { 
-	    append paths $sep[lindex $pathInfo 0]
-	    set sep "\n"
+	set qfd [open $queryFile "r"]
+	set query [list -querychannel $qfd \
+			    -querylength [file size $queryFile]]
+	set encodings [urlAcceptEncodings]
+	if {$encodings != ""} {
+	    lappend query -headers \
+			    [list Accept-Encoding [join $encodings ", "]]
+	}
+	if {[catch {eval urlGet [list $url] $query \
+			    -handler urlMultiMdCopyHandler} token] != 0} {
+	    global errorInfo errorCode
+	    close $qfd
+	    error $token $errorInfo $errorCode
 	}
-	set token [urlGet $url -query $paths -handler urlMultiMdCopyHandler]
     } else {
 	set token $fd
     }
     upvar #0 ${token}_multi multi
     set multi(mdType) $mdType
+    set multi(bases) $bases
     alwaysEvalFor "" {
+			if {[info exists qfd]} {close $qfd}
 			if {[info exists multi(fd)]} {close $multi(fd)}
+			if {[info exists multi(spoolfd)]} {
+			    catch {close $multi(spoolfd)}
+			    scratchClean $multi(spool)
+			}
 			set multistate $multi(state)
 			set pathnum $multi(pathnum)
 			set remaining $multi(remaining)
@@ -498,6 +1320,10 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
 		if {[regexp -nocase {^x-multiget-error$} $keyword]} {
 		    nsbderror "error from multiget remote:\n    $value"
 		}
+		if {[regexp -nocase {^content-encoding$} $keyword]} {
+		    # only individual files may be compressed
+		    nsbderror "multiget response has unsupported Content-Encoding $value"
+		}
 	    }
 	}
 	fconfigure $socket -translation binary
@@ -513,6 +1339,16 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
 	    return 0
 	}
 	set line [string trimright $line "\r"]
+	if {($multi(state) == "want-Chunk-Size") &&
+				    [regexp {^[0-9a-fA-F]+$} $line]} {
+	    scan $line "%x" multi(remaining)
+	    if {$multi(remaining) == 0} {
+		urlMultiMdFinish $token
+	    } else {
+		set multi(state) reading-Content
+	    }
+	    return $bytes
+	}
 	set keyword ""
 	if {[regexp {^([^:]+):(.+)$} $line x keyword value]} {
 	    set value [string trim $value]
@@ -532,7 +1368,8 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
 	    if {$pathInfo == ""} {
 		set pathInfo [list "" "" "" ""]
 	    }
-	    foreach {fromPath toTop finalPath mode mdData xx reloc} $pathInfo {}
+	    foreach {fromPath toTop finalPath mode mdData xx reloc resumeFrom} \
+								$pathInfo {break}
 	    if {$finalPath == ""} {
 		# there is no final path so just copy into the top
 		# this is for -fetchAll where the file is thrown out
@@ -550,9 +1387,14 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
 		set multi(fromPath) $fromPath
 		set multi(toPath) $toPath
 		set multi(mdData) $mdData
-		set multi(mdDescriptor) [$mdType -init]
-		set multi(fd) [withParentDir \
-			{openbreloc $toPath $reloc "w" $mode} $toPath]
+		set multi(mode) $mode
+		set multi(reloc) $reloc
+		set multi(resumeFrom) $resumeFrom
+		set multi(offset) 0
+		set multi(encoding) ""
+		set multi(basis) [lindex $multi(bases) $multi(pathnum)]
+		set multi(delta) ""
+		set multi(chunked) 0
 		set multi(state) want-Content-Length
 		incr multi(pathnum)
 		# moved to end to workaround bug in plus patch that causes this
@@ -564,17 +1406,69 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
 	    if {$line == ""} {
 		nsbderror "Content-Length header for $multi(fromPath) not found"
 	    }
+	    if {[regexp -nocase {^content-offset$} $keyword]} {
+		# the server is sending only the part after resumeFrom
+		if {$value != $multi(resumeFrom)} {
+		    nsbderror "Content-Offset $value for $multi(fromPath) was not requested"
+		}
+		set multi(offset) $value
+	    }
+	    if {[regexp -nocase {^content-encoding$} $keyword]} {
+		if {[urlEncodingCommand $value decompress] == ""} {
+		    nsbderror "Content-Encoding $value for $multi(fromPath) is not supported"
+		}
+		set multi(encoding) $value
+	    }
+	    if {[regexp -nocase {^content-delta$} $keyword]} {
+		# the server is sending only a delta from the older version
+		if {$multi(basis) == ""} {
+		    nsbderror "Content-Delta for $multi(fromPath) was not requested"
+		}
+		set multi(delta) $value
+	    }
+	    set started 0
 	    if {[regexp -nocase {^content-length$} $keyword]} {
 		if {![regexp {^[0-9]+$} $value]} {
 		    nsbderror "Content-Length value \"$value\" is not a number"
 		}
 		set multi(remaining) $value
 		set multi(expected) $value
+		set started 1
+	    }
+	    if {[regexp -nocase {^transfer-encoding$} $keyword]} {
+		# the length isn't known ahead, so the data comes in chunks
+		if {[string tolower $value] != "chunked"} {
+		    nsbderror "Transfer-Encoding $value for $multi(fromPath) is not supported"
+		}
+		set multi(chunked) 1
+		set multi(remaining) 0
+		set multi(expected) 0
+		set started 1
+	    }
+	    if {$started} {
+		set ans [urlMdOpen $multi(toPath) $multi(reloc) $multi(mode) \
+					    $mdType $multi(offset)]
+		set multi(fd) [lindex $ans 0]
+		set multi(mdDescriptor) [lindex $ans 1]
+		if {[lindex $ans 2] != $multi(offset)} {
+		    nsbderror "could not resume $multi(toPath) at $multi(offset) bytes"
+		}
+		if {($multi(encoding) != "") || ($multi(delta) != "")} {
+		    # the data is kept as it arrives, and uncompressed or
+		    #   applied as a delta after it has all arrived
+		    set multi(spool) [scratchAddName "mgd"]
+		    set multi(spoolfd) [open $multi(spool) "w"]
+		    fconfigure $multi(spoolfd) -translation binary
+		}
 		set multi(state) "want-blank-line"
 	    }
 	} elseif {$multi(state) == "want-blank-line"} {
 	    if {$line == ""} {
-		set multi(state) reading-Content
+		if {$multi(chunked)} {
+		    set multi(state) want-Chunk-Size
+		} else {
+		    set multi(state) reading-Content
+		}
 	    }
 	}
 	return $bytes
@@ -592,21 +1486,23 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
     if {($maxBytes != "") && ($blocksize > $maxBytes)} {
 	set blocksize $maxBytes
     }
-    if {$blocksize > 0} {
+    if {$blocksize <= 0} {
+	set bytes 0
+    } elseif {[info exists multi(spoolfd)]} {
+	set data [read $socket $blocksize]
+	set bytes [string length $data]
+	puts -nonewline $multi(spoolfd) $data
+    } else {
 	set bytes [$mdType -update $multi(mdDescriptor) -chan $socket \
 			-copychan $multi(fd) -maxbytes $blocksize]
-    } else {
-	set bytes 0
     }
     incr multi(remaining) -$bytes
     if {$multi(remaining) == 0} {
-	closebreloc $multi(fd)
-	unset multi(fd)
-	if {$multi(mdData) != ""} {
-	    set mdData [$mdType -final $multi(mdDescriptor)]
-	    compareMdDataFor $multi(fromPath) $multi(mdData) $mdData
+	if {$multi(chunked)} {
+	    set multi(state) want-Chunk-Size
+	} else {
+	    urlMultiMdFinish $token
 	}
-	set multi(state) want-Keyword
     }
     # moved to end to workaround bug in plus patch that causes this
     #  event handler to sometimes be nested when "update idletasks"
@@ -616,6 +1512,256 @@ proc urlMultiMdCopyHandler {socket token {maxBytes ""}} {
     return $bytes
 }
 
+#
+# Finish a file of a multi-fetch when all of it has arrived: uncompress it
+#  or apply the delta if it needs that, and check its message digest
+#
+proc urlMultiMdFinish {token} {
+    upvar #0 ${token}_multi multi
+    set mdType $multi(mdType)
+    if {[info exists multi(spoolfd)]} {
+	close $multi(spoolfd)
+	unset multi(spoolfd)
+	alwaysEvalFor "" {scratchClean $multi(spool)} {
+	    if {$multi(encoding) == ""} {
+		set fd [open $multi(spool) "r"]
+		fconfigure $fd -translation binary
+	    } else {
+		# uncompress it on its way to the message digest
+		set fd [openfilterfrom [list [urlEncodingCommand \
+				    $multi(encoding) decompress]] \
+				    [list < $multi(spool)]]
+	    }
+	    set code [catch {
+		if {$multi(delta) != ""} {
+		    urlApplyDelta $fd $multi(basis) $multi(delta) \
+			$mdType $multi(mdDescriptor) $multi(fd) \
+			$multi(fromPath)
+		} else {
+		    $mdType -update $multi(mdDescriptor) -chan $fd \
+						    -copychan $multi(fd)
+		}
+	    } string]
+	    if {$multi(encoding) == ""} {
+		close $fd
+	    } elseif {[catch {closefilter $fd} msg]} {
+		nsbderror "error uncompressing $multi(fromPath): $msg"
+	    }
+	    if {$code != 0} {
+		global errorInfo errorCode
+		error $string $errorInfo $errorCode
+	    }
+	}
+    }
+    closebreloc $multi(fd)
+    unset multi(fd)
+    if {$multi(mdData) != ""} {
+	set mdData [$mdType -final $multi(mdDescriptor)]
+	compareMdDataFor $multi(fromPath) $multi(mdData) $mdData
+    }
+    set multi(state) want-Keyword
+}
+
+#
+# Return a list of the basis file to use for a delta of the file described
+#  by pathInfo (as for urlMultiMdCopy), the block size and length of it to
+#  send to a multiget server, and the name of a scratch file holding its
+#  block signatures, or an empty string if there is no older version of
+#  the file installed that is worth sending a delta from.  If the
+#  installed file was relocated the relocation is undone into a scratch
+#  file first, because the server has the file before relocation.  Files
+#  smaller than the minDeltaSize configuration keyword are skipped.
+#
+proc urlDeltaBasis {pathInfo} {
+    global cfgContents urlDeltaBasisCount
+    foreach {fromPath toTop finalPath mode mdData installTop reloc} \
+							$pathInfo {break}
+    set minSize 65536
+    if {[info exists cfgContents(minDeltaSize)]} {
+	set minSize $cfgContents(minDeltaSize)
+    }
+    if {($minSize <= 0) || ($finalPath == "") || ($installTop == "")} {
+	return ""
+    }
+    set oldPath [file join $installTop $finalPath]
+    if {[catch {file stat $oldPath statb}] || ($statb(type) != "file") ||
+			    ($statb(size) < $minSize)} {
+	return ""
+    }
+    if {![info exists urlDeltaBasisCount]} {
+	set urlDeltaBasisCount 0
+    }
+    set basis $oldPath
+    if {($reloc != "") && ($reloc != "=")} {
+	regexp {^([^=]*)=(.*)$} $reloc x from to
+	set basis [scratchAddName "mgb[incr urlDeltaBasisCount]"]
+	if {[catch {
+		set fd [openbreloc $oldPath "$to=$from" "r"]
+		alwaysEvalFor "" {closebreloc $fd} {
+		    withOpen bfd $basis "w" {
+			fconfigure $bfd -translation binary
+			fcopy $fd $bfd
+		    }
+		}
+	    } msg]} {
+	    debugmsg "not using delta for $fromPath: $msg"
+	    scratchClean $basis
+	    return ""
+	}
+	set statb(size) [file size $basis]
+    }
+    # about as many blocks as bytes in a block, but not too small
+    global multigetMaxBlockSize
+    set blocksize [expr {int(sqrt($statb(size))) / 64 * 64}]
+    if {$blocksize < 2048} {
+	set blocksize 2048
+    } elseif {$blocksize > $multigetMaxBlockSize} {
+	set blocksize $multigetMaxBlockSize
+    }
+    set sigFile [scratchAddName "mgk[incr urlDeltaBasisCount]"]
+    withOpen fd $basis "r" {
+	fconfigure $fd -translation binary
+	withOpen sfd $sigFile "w" {
+	    fconfigure $sfd -translation binary
+	    blockdelta signature $fd $blocksize $sfd
+	}
+    }
+    if {[file size $sigFile] != [multigetSignatureBytes \
+					    "$blocksize $statb(size)"]} {
+	# the fallback blockdelta in nsbdTclshLib.tcl writes none
+	scratchClean [list $sigFile]
+	urlCleanBases [list $basis]
+	return ""
+    }
+    debugmsg "sending block signatures of $basis for $fromPath"
+    return [list $basis "$blocksize $statb(size)" $sigFile]
+}
+
+#
+# Clean up the scratch files among a list of delta basis files
+#
+proc urlCleanBases {bases} {
+    foreach basis $bases {
+	if {[string match "[scratchName mgb]*" $basis]} {
+	    scratchClean $basis
+	}
+    }
+}
+
+#
+# Reconstruct a file from the delta read from deltafd, made with block size
+#  blocksize against the file basis, into outfd and its message digest.
+#  The format of the delta is described in tcldelta.c.
+#
+proc urlApplyDelta {deltafd basis blocksize mdType mdDescriptor outfd path} {
+    withOpen bfd $basis "r" {
+	fconfigure $bfd -translation binary
+	while {[gets $deltafd line] >= 0} {
+	    if {[scan $line "C %d %d" block count] == 2} {
+		seek $bfd [expr {$block * $blocksize}]
+		$mdType -update $mdDescriptor -chan $bfd -copychan $outfd \
+				    -maxbytes [expr {$count * $blocksize}]
+	    } elseif {([scan $line "L %d" n] == 1) && ($n > 0)} {
+		if {[$mdType -update $mdDescriptor -chan $deltafd \
+				-copychan $outfd -maxbytes $n] != $n} {
+		    nsbderror "delta for $path ended early"
+		}
+	    } else {
+		nsbderror "bad delta instruction for $path: [string range $line 0 60]"
+	    }
+	}
+    }
+}
+
+#
+# Return the shell command that compresses (if direction is "compress") or
+#  uncompresses (if direction is "decompress") standard input to standard
+#  output for the multiget Content-Encoding encoding, or an empty string
+#  if the encoding is unknown or its program is not available.  The program
+#  is taken from the configuration keyword of the same name as the encoding
+#  if it is set, otherwise it is looked for in $PATH.
+#
+proc urlEncodingCommand {encoding direction} {
+    global urlEncodingPrograms
+    set encoding [string tolower $encoding]
+    if {[lsearch -exact {zstd gzip} $encoding] < 0} {
+	return ""
+    }
+    if {![info exists urlEncodingPrograms($encoding)]} {
+	global cfgContents
+	if {[info exists cfgContents($encoding)]} {
+	    set urlEncodingPrograms($encoding) $cfgContents($encoding)
+	} else {
+	    set urlEncodingPrograms($encoding) [whereExecutable $encoding]
+	}
+    }
+    set program $urlEncodingPrograms($encoding)
+    if {$program == ""} {
+	return ""
+    }
+    if {$direction == "compress"} {
+	return "$program -q -c"
+    }
+    return "$program -q -dc"
+}
+
+#
+# Return the list of encodings available for multiget, most preferred first
+#
+proc urlAcceptEncodings {} {
+    set encodings ""
+    foreach encoding {zstd gzip} {
+	if {[urlEncodingCommand $encoding decompress] != ""} {
+	    lappend encodings $encoding
+	}
+    }
+    return $encodings
+}
+
+#
+# Return the http headers that offer the encodings from urlAcceptEncodings,
+#  or an empty list if there are none
+#
+proc urlAcceptEncodingHeaders {} {
+    set encodings [urlAcceptEncodings]
+    if {$encodings == ""} {
+	return ""
+    }
+    return [list Accept-Encoding [join $encodings ", "]]
+}
+
+#
+# Return the encodings in the value of an Accept-Encoding header in lower
+#  case, leaving out any that are explicitly refused
+#
+proc urlAcceptedEncodings {acceptEncoding} {
+    set encodings ""
+    foreach item [split $acceptEncoding ","] {
+	set item [split $item ";"]
+	set encoding [string trim [lindex $item 0]]
+	if {[regexp {q=0(\.0*)?$} [string trim [lindex $item 1]]]} {
+	    # explicitly refused
+	    continue
+	}
+	lappend encodings [string tolower $encoding]
+    }
+    return $encodings
+}
+
+#
+# Choose the encoding to compress multiget files with from the value of an
+#  Accept-Encoding header.  Return an empty string if there is none in
+#  common.
+#
+proc urlChooseEncoding {acceptEncoding} {
+    foreach encoding [urlAcceptedEncodings $acceptEncoding] {
+	if {[urlEncodingCommand $encoding compress] != ""} {
+	    return $encoding
+	}
+    }
+    return ""
+}
+
 #
 # Compare expected message digest data to received data for $path 
 # Raise an error if they don't match
@@ -909,7 +2055,7 @@ proc urlRsyncMultiMdCopy {url mdType pathsInfo} {
     set paths ""
     set prevInstallTop ""
     foreach pathInfo $pathsInfo {
-	foreach {fromPath toTop finalPath xx xx installTop xx} $pathInfo {}
+	foreach {fromPath toTop finalPath xx xx installTop xx} $pathInfo {break}
 	if {($fromPath != $finalPath) && ($finalPath != "")} {
 	    # rsync cannot apply substitutions, so attempt to
 	    #  hardlink in substituted name from installTop into
@@ -939,7 +2085,7 @@ proc urlRsyncMultiMdCopy {url mdType pathsInfo} {
     set defaultperm [format "0%o" [expr ~$createMask & "0666"]]
 
     foreach pathInfo $pathsInfo {
-	foreach {fromPath toTop finalPath mode expectedMdData xx reloc} $pathInfo {}
+	foreach {fromPath toTop finalPath mode expectedMdData xx reloc} $pathInfo {break}
 
 	if {$reloc == "="} {
 	    set reloc ""
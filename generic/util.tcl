@@ -421,6 +421,29 @@ proc popen {command access} {
     return [open [list "|$shell" -c $com] $access]
 }
 
+#
+# Return the command that runs the binary relocate program, to which the
+#  "from=to" translation is added, and raise an error if it isn't found
+#
+proc brelocCommand {} {
+    global brelocPath
+    if {![info exists brelocPath]} {
+	global cfgContents
+	if {[info exists cfgContents(breloc)]} {
+	    set brelocPath $cfgContents(breloc)
+	} else {
+	    set brelocPath [whereExecutable "breloc"]
+	    if {$brelocPath != ""} {
+		set brelocPath "$brelocPath -r"
+	    }
+	}
+    }
+    if {$brelocPath == ""} {
+	nsbderror "breloc not found"
+    }
+    return $brelocPath
+}
+
 #
 # If "reloc" is not empty or is just "=", open a binary relocate running in a
 #  sub-process that applies the "reloc" translation, otherwise just open a
@@ -441,22 +464,7 @@ proc openbreloc {fname reloc access {mode ""}} {
 	fconfigure $fd -translation binary
 	return $fd
     }
-    global brelocPath
-    if {![info exists brelocPath]} {
-	global cfgContents
-	if {[info exists cfgContents(breloc)]} {
-	    set brelocPath $cfgContents(breloc)
-	} else {
-	    set brelocPath [whereExecutable "breloc"]
-	    if {$brelocPath != ""} {
-		set brelocPath "$brelocPath -r"
-	    }
-	}
-    }
-    set breloc $brelocPath
-    if {$breloc == ""} {
-	nsbderror "breloc not found"
-    }
+    set breloc [brelocCommand]
     global brelocTmpnames
     global brelocTmpnum
     if {(![info exists brelocTmpnum]) || ([incr brelocTmpnum] >= 100)} {
@@ -500,6 +508,146 @@ proc closebreloc {fd} {
     scratchClean $tmpname
 }
 
+#
+# Open a shell command that filters what is written to it into file fname,
+#  such as a compress or uncompress program.  Error messages from the
+#  command are saved in a scratch file and reported by closefilter.
+#
+proc openfilter {command fname} {
+    global filterTmpnames
+    set tmpname [scratchAddName "flt"]
+    set fd [notrace {popen "exec $command 2>$tmpname >$fname" "w"}]
+    set filterTmpnames($fd) $tmpname
+    fconfigure $fd -translation binary
+    return $fd
+}
+
+#
+# Open a pipeline of commands, each a list of the program and its
+#  arguments, for reading what the last one writes.  The first one reads
+#  from input, which is a Tcl redirection such as "<@ $fd".  No shell is
+#  started.  Error messages from the commands are saved in a scratch file
+#  and reported by closefilter.
+#
+proc openfilterfrom {commands input} {
+    global filterTmpnames filterCount
+    # more than one may be open at a time
+    set tmpname [scratchAddName "flt[incr filterCount]"]
+    set pipeline ""
+    foreach command $commands {
+	if {$pipeline != ""} {
+	    lappend pipeline "|"
+	}
+	eval lappend pipeline $command
+    }
+    debugmsg "open \"| $pipeline\""
+    set fd [notrace {open [concat | $pipeline $input [list 2> $tmpname]] "r"}]
+    set filterTmpnames($fd) $tmpname
+    fconfigure $fd -translation binary
+    return $fd
+}
+
+#
+# close a filter opened by openfilter or openfilterfrom
+#
+proc closefilter {fd} {
+    global filterTmpnames
+    set tmpname $filterTmpnames($fd)
+    unset filterTmpnames($fd)
+    if {[catch {close $fd}] != 0} {
+	set errfd [notrace {open $tmpname "r"}]
+	set errmsg [read $errfd]
+	close $errfd
+	scratchClean $tmpname
+	nsbderror "filter error: $errmsg"
+    }
+    scratchClean $tmpname
+}
+
+#
+# Run a filter command, such as a compress or uncompress program, on
+#  fromFile and write the result into toFile
+#
+proc filterFile {command fromFile toFile} {
+    set fd [openfilter $command $toFile]
+    alwaysEvalFor "" {closefilter $fd} {
+	withOpen fromfd $fromFile "r" {
+	    fconfigure $fromfd -translation binary
+	    fcopy $fromfd $fd
+	}
+    }
+}
+
+#
+# Return "gzip" or "zstd" if filename was compressed by that program,
+#  judging by its first bytes, otherwise return an empty string
+#
+proc compressedFileEncoding {filename} {
+    withOpen fd $filename "r" {
+	fconfigure $fd -translation binary
+	set magic [read $fd 4]
+    }
+    if {[string range $magic 0 1] == "\x1f\x8b"} {
+	return "gzip"
+    }
+    if {$magic == "\x28\xb5\x2f\xfd"} {
+	return "zstd"
+    }
+    return ""
+}
+
+#
+# Return the command that uncompresses filename, which was compressed
+#  with encoding, and raise an error if its program is not available
+#
+proc uncompressCommand {encoding filename} {
+    set command [urlEncodingCommand $encoding decompress]
+    if {$command == ""} {
+	nsbderror "$filename is compressed with $encoding but there is no $encoding program"
+    }
+    return $command
+}
+
+#
+# Uncompress fromFile, which has to be compressed, into toFile
+#
+proc uncompressFile {fromFile toFile} {
+    filterFile [uncompressCommand [compressedFileEncoding $fromFile] \
+					    $fromFile] $fromFile $toFile
+}
+
+#
+# Like withOpen for reading, except that if filename is compressed it is
+#  read through its uncompress program so evalscript sees the plain text.
+#  If evalscript stops reading before the end, the error that the
+#  uncompress program gets from its output being closed is ignored.
+#
+proc withOpenUncompressed {fdName filename evalscript} {
+    set encoding [compressedFileEncoding $filename]
+    if {$encoding == ""} {
+	set fd [notrace {open $filename "r"}]
+    } else {
+	set command [uncompressCommand $encoding $filename]
+	set fd [notrace {open "|$command < [list $filename]" "r"}]
+    }
+    uplevel "set $fdName $fd"
+    set code [catch {uplevel $evalscript} string]
+    global errorInfo errorCode
+    set info $errorInfo
+    set ecode $errorCode
+    set atEof [eof $fd]
+    if {([catch {close $fd} closeString] != 0) && $atEof && ($code == 0)} {
+	set code 1
+	set string "$encoding error: $closeString"
+	set info $string
+	set ecode "NSBD INTERNAL"
+    }
+    if {$code == 1} {
+	set string [addErrorPrefix $filename $string]
+    }
+    return -code $code -errorinfo $info -errorcode $ecode $string
+}
+
 #
 # figure out the verboseLevel
 #
@@ -712,11 +860,11 @@ proc trimOldLog {fname} {
 
 #
 # Lock a file.  Create lock file with exclusive create permission.  If
-#  file already exists, try up to 5 times one second apart.  If the
-#  modification time of the lock file or $file changes, assume another
-#  program is making progress and reset the count.  If neither changes
-#  after 5 seconds, assume the other program has died and forcibly remove
-#  the lock before retrying.
+#  file already exists, keep trying every tenth of a second for up to 5
+#  seconds.  If the modification time of the lock file or $file changes,
+#  assume another program is making progress and reset the count.  If
+#  neither changes after 5 seconds, assume the other program has died and
+#  forcibly remove the lock before retrying.
 # NOTE: perhaps this should be changed to use the Unix 'fcntl' F_SETLK
 #  facility.  I'm not sure how portable that would be though.  It's nice
 #  in that it can distinguish between read locks and read/write locks.
@@ -730,7 +878,7 @@ proc lockFile {filename} {
     set lockname [addFilePrefix $filename LCK]
     set tries 0
     set modtime 0
-    while {$tries <= 5} {
+    while {$tries <= 50} {
 	set code [catch {set fd [open $lockname "WRONLY CREAT EXCL"]} why]
 	if {$code == 0} {
 	    puts $fd [pid]
@@ -739,10 +887,10 @@ proc lockFile {filename} {
 	    return
 	}
 	incr tries
-	after 1000
-	foreach file {$lockname $filename "last"} {
+	after 100
+	foreach file [list $lockname $filename "last"] {
 	    if {$file == "last"} {
-		if {$tries >= 5} {
+		if {$tries >= 50} {
 		    progressmsg "Overriding $lockname, lock held at least 5 seconds"
 		    notrace {file delete $lockname}
 		    set tries 0
@@ -31,6 +31,12 @@
 #include <grp.h>
 #include <utime.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#if HAVE_SENDFILE && defined(__linux__)
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
 
 static Tcl_Interp *nsbd_interp;
 
@@ -493,18 +499,48 @@ nsbd_stdinisatty(clientData, interp, argc, argv)
  *   on a file of about 10000 lines; the tcl version took up about half
  *   the parse time of that file, and this C version made it drop to
  *   about 1/5th of the total parse time.
+ * The nesting state is kept in a separate descriptor for each file being
+ *   parsed, so more than one file can be parsed at a time.
+ *   nsbdnestlevelInit returns a new descriptor and nsbdnestlevelDone
+ *   frees it.
  * nsbdnestlevel figures out the nestlevel in a line of an "nsbd" file.
  * parameters are
- *    1. line - the line to parse
- *    2. linelength - the number of bytes in the line
- *    3. lineno - the line number that is being parsed
+ *    1. nest - the descriptor returned by nsbdnestlevelInit
+ *    2. line - the line to parse
+ *    3. linelength - the number of bytes in the line
+ *    4. lineno - the line number that is being parsed
  * returns list of two items: the nesting level and the number of characters
  *    of whitespace at the beginning of the line
  */
 
 #define MAXNESTLEVEL 50
-static int nestlength[MAXNESTLEVEL+1];
-static int nestlevel;
+typedef struct {
+    int level;		/* current nesting level, -1 if not in use */
+    int length[MAXNESTLEVEL+1];
+} NestState;
+static int numnests = 0;
+static NestState *nestStates = NULL;
+
+static NestState *
+#ifdef _USING_PROTOTYPES_
+nsbd_getNestState(Tcl_Interp *interp, char *descriptor)
+#else
+nsbd_getNestState(interp, descriptor)
+    Tcl_Interp *interp;
+    char *descriptor;
+#endif
+{
+    int nestnum;
+
+    if ((sscanf(descriptor, "nest%d", &nestnum) != 1) ||
+	(nestnum < 0) || (nestnum >= numnests) ||
+	(nestStates[nestnum].level < 0)) {
+	Tcl_AppendResult(interp, "invalid nsbdnestlevel descriptor \"", 
+			descriptor, "\"", (char *) NULL);
+	return NULL;
+    }
+    return &nestStates[nestnum];
+}
 
 static int
 #ifdef _USING_PROTOTYPES_
@@ -517,7 +553,49 @@ nsbd_nestlevelInit(clientData, interp, argc, argv)
     char *argv[];
 #endif
 {
-    nestlevel = 0;
+    int nestnum;
+
+    if (argc != 1) {
+	interp->result = "wrong # args: should be \"nsbdnestlevelInit\"";
+	return TCL_ERROR;
+    }
+    for (nestnum = 0; nestnum < numnests; nestnum++) {
+	if (nestStates[nestnum].level < 0)
+	    break;
+    }
+    if (nestnum == numnests) {
+	/* allocate a new one */
+	numnests++;
+	nestStates = (NestState *) realloc((void *) nestStates,
+				    numnests * sizeof(NestState));
+    }
+    nestStates[nestnum].level = 0;
+    nestStates[nestnum].length[0] = 0;
+    sprintf(interp->result, "nest%d", nestnum);
+    return TCL_OK;
+}
+
+static int
+#ifdef _USING_PROTOTYPES_
+nsbd_nestlevelDone(ClientData clientData, Tcl_Interp *interp, int argc, char *argv[])
+#else
+nsbd_nestlevelDone(clientData, interp, argc, argv)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    int argc;
+    char *argv[];
+#endif
+{
+    NestState *nest;
+
+    if (argc != 2) {
+	interp->result = "wrong # args: should be \"nsbdnestlevelDone nest\"";
+	return TCL_ERROR;
+    }
+    if ((nest = nsbd_getNestState(interp, argv[1])) == NULL) {
+	return TCL_ERROR;
+    }
+    nest->level = -1;
     return TCL_OK;
 }
 
@@ -532,20 +610,24 @@ nsbd_nestlevel(clientData, interp, argc, argv)
     char *argv[];
 #endif
 {
+    NestState *nest;
     char *line, *lineno;
     int linelength;
     int nlength = 0, whitechars = 0;
     int i, c;
     int curlength; 
 
-    if (argc != 4) {
-	interp->result = "wrong # args: should be \"nsbdnestlevel line linelength lineno\"";
+    if (argc != 5) {
+	interp->result = "wrong # args: should be \"nsbdnestlevel nest line linelength lineno\"";
 	return TCL_ERROR;
     }
     
-    line = argv[1];
-    sscanf(argv[2], "%d", &linelength);
-    lineno = argv[3];
+    if ((nest = nsbd_getNestState(interp, argv[1])) == NULL) {
+	return TCL_ERROR;
+    }
+    line = argv[2];
+    sscanf(argv[3], "%d", &linelength);
+    lineno = argv[4];
     c = 0;
     for (i = 0; i < linelength; i++) {
 	if ((c = line[i]) == ' ') {
@@ -561,23 +643,25 @@ nsbd_nestlevel(clientData, interp, argc, argv)
 	}
     }
     if ((c != '#') && (whitechars != linelength)) {
-	curlength = nestlength[nestlevel];
+	curlength = nest->length[nest->level];
 	if (nlength != curlength) {
 	    if (nlength > curlength) {
-		if (++nestlevel >= MAXNESTLEVEL) {
+		if (++nest->level >= MAXNESTLEVEL) {
+		    nest->level--;
 		    sprintf(interp->result,
 			    "nesting level too deep at line %s", lineno);
 		    return (nsbderror(interp));
 		}
-		nestlength[nestlevel] = nlength;
+		nest->length[nest->level] = nlength;
 	    }
 	    else {
 		/* must be less, find out which if any previous level matches */
-		nestlevel--;
-		while ((nestlevel > 0) && (nlength < nestlength[nestlevel])) {
-		    nestlevel--;
+		nest->level--;
+		while ((nest->level > 0) &&
+				(nlength < nest->length[nest->level])) {
+		    nest->level--;
 		}
-		if (nlength != nestlength[nestlevel]) {
+		if (nlength != nest->length[nest->level]) {
 		    sprintf(interp->result,
 			"invalid indent level on line %s", lineno);
 		    return(nsbderror(interp));
@@ -585,7 +669,7 @@ nsbd_nestlevel(clientData, interp, argc, argv)
 	    }
 	}
     }
-    sprintf(interp->result, "%d %d", nestlevel, whitechars);
+    sprintf(interp->result, "%d %d", nest->level, whitechars);
     return TCL_OK;
 }
 
@@ -666,10 +750,135 @@ nsbd_matchpatterns(clientData, interp, argc, argv)
     return TCL_OK;
 }
 
+/*
+ * sendchannel outChan inChan size
+ * Send up to size bytes from the current position of inChan, which must
+ *   be a file, to outChan by passing them directly between the underlying
+ *   file descriptors, with sendfile() if it is available.  Anything
+ *   buffered in outChan (such as headers) is flushed first so it is
+ *   written in one piece ahead of the data.  Returns the number of bytes
+ *   sent, which is less than size only if outChan is in non-blocking mode
+ *   and would block; it is an error if the file ends first.  inChan is
+ *   left positioned after the bytes that were sent.
+ */
+static int
+#ifdef _USING_PROTOTYPES_
+nsbd_sendchannel(ClientData clientData, Tcl_Interp *interp, int argc, char *argv[])
+#else
+nsbd_sendchannel(clientData, interp, argc, argv)
+    ClientData clientData;
+    Tcl_Interp *interp;
+    int argc;
+    char *argv[];
+#endif
+{
+    Tcl_Channel outChan, inChan;
+    ClientData handle;
+    int mode, outfd, infd;
+    long size, sent, n;
+    off_t offset;
+    char buf[65536];
+
+    if (argc != 4) {
+	interp->result = "wrong # args: should be \"sendchannel outChan inChan size\"";
+	return TCL_ERROR;
+    }
+    if ((outChan = Tcl_GetChannel(interp, argv[1], &mode)) == NULL) {
+	return TCL_ERROR;
+    }
+    if ((inChan = Tcl_GetChannel(interp, argv[2], &mode)) == NULL) {
+	return TCL_ERROR;
+    }
+    if (sscanf(argv[3], "%ld", &size) != 1) {
+	Tcl_AppendResult(interp, "size \"", argv[3], "\" is not a number",
+							    (char *) NULL);
+	return TCL_ERROR;
+    }
+    if ((Tcl_GetChannelHandle(outChan, TCL_WRITABLE, &handle) != TCL_OK)) {
+	Tcl_AppendResult(interp, "channel \"", argv[1],
+		"\" wasn't opened for writing", (char *) NULL);
+	return TCL_ERROR;
+    }
+    outfd = (int) (long) handle;
+    if ((Tcl_GetChannelHandle(inChan, TCL_READABLE, &handle) != TCL_OK)) {
+	Tcl_AppendResult(interp, "channel \"", argv[2],
+		"\" wasn't opened for reading", (char *) NULL);
+	return TCL_ERROR;
+    }
+    infd = (int) (long) handle;
+
+    if ((Tcl_Flush(outChan) != TCL_OK) && (Tcl_GetErrno() != EAGAIN)) {
+	Tcl_AppendResult(interp, "error writing \"", argv[1], "\": ",
+			    Tcl_PosixError(interp), (char *) NULL);
+	return TCL_ERROR;
+    }
+    if (Tcl_OutputBuffered(outChan) > 0) {
+	/* non-blocking and the earlier output hasn't all gone yet */
+	sprintf(interp->result, "0");
+	return TCL_OK;
+    }
+
+    /*
+     * Use the channel's idea of the position because it may have read
+     *   ahead, and set it back afterward
+     */
+    offset = Tcl_Tell(inChan);
+    sent = 0;
+    while (sent < size) {
+#ifdef USE_SENDFILE
+	n = sendfile(outfd, infd, &offset, size - sent);
+	if ((n == -1) && ((errno == EINVAL) || (errno == ENOSYS))) {
+	    /* not supported between these kinds of descriptors */
+	    n = -2;
+	}
+#else
+	n = -2;
+#endif
+	if (n == -2) {
+	    n = pread(infd, buf,
+		    (size - sent) < (long) sizeof(buf) ?
+				(size_t) (size - sent) : sizeof(buf),
+		    offset);
+	    if (n > 0) {
+		n = write(outfd, buf, n);
+		if (n > 0) {
+		    offset += n;
+		}
+	    }
+	}
+	if (n == 0) {
+	    char msg[100];
+	    sprintf(msg, "\" ended %ld bytes early", size - sent);
+	    Tcl_AppendResult(interp, "file \"", argv[2], msg, (char *) NULL);
+	    Tcl_Seek(inChan, offset, SEEK_SET);
+	    return TCL_ERROR;
+	}
+	if (n == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+		break;
+	    }
+	    Tcl_AppendResult(interp, "error sending \"", argv[2], "\" to \"",
+		    argv[1], "\": ", Tcl_PosixError(interp), (char *) NULL);
+	    Tcl_Seek(inChan, offset, SEEK_SET);
+	    return TCL_ERROR;
+	}
+	sent += n;
+    }
+    Tcl_Seek(inChan, offset, SEEK_SET);
+    sprintf(interp->result, "%ld", sent);
+    return TCL_OK;
+}
+
 #ifdef STANDALONE
 #define Tcl_Init Tcl_InitStandAlone
 #endif
 
+extern int Pathtable_Init _ANSI_ARGS_((Tcl_Interp *interp));
+extern int Blockdelta_Init _ANSI_ARGS_((Tcl_Interp *interp));
+
 int
 #ifdef _USING_PROTOTYPES_
 nsbd_init(Tcl_Interp *interp)
@@ -690,6 +899,8 @@ nsbd_init(interp)
     /* Tclgdbm_Init(interp); */
     Tclmd5_Init(interp);
     Tclsha1_Init(interp);
+    Pathtable_Init(interp);
+    Blockdelta_Init(interp);
 
     Tcl_CreateCommand(interp, "startTk", nsbd_startTk,
 	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
@@ -715,8 +926,12 @@ nsbd_init(interp)
 	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
     Tcl_CreateCommand(interp, "nsbdnestlevel", nsbd_nestlevel,
 	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+    Tcl_CreateCommand(interp, "nsbdnestlevelDone", nsbd_nestlevelDone,
+	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
     Tcl_CreateCommand(interp, "matchpatterns", nsbd_matchpatterns,
 	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+    Tcl_CreateCommand(interp, "sendchannel", nsbd_sendchannel,
+	(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
 
     return TCL_OK;
 }
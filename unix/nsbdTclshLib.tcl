@@ -94,30 +94,50 @@ proc stdinisatty {} {
 }
 
 #
-# initialize nsbdnestlevel variables
+# initialize nsbdnestlevel variables for a file and return a descriptor
+#   for them, so more than one file can be parsed at a time
 #
 
 proc nsbdnestlevelInit {} {
-    upvar #0 nsbdnestlevel_level nestlevel
-    upvar #0 nsbdnestlevel_length nestlength
+    global nsbdnestlevel_uid
+    if {![info exists nsbdnestlevel_uid]} {
+	set nsbdnestlevel_uid 0
+    }
+    set nest nest[incr nsbdnestlevel_uid]
+    upvar #0 nsbdnestlevel_level_$nest nestlevel
+    upvar #0 nsbdnestlevel_length_$nest nestlength
     set nestlevel 0
-    catch {unset nestlength}
     set nestlength(0) 0
+    return $nest
+}
+
+#
+# free the nsbdnestlevel variables of a descriptor
+#
+
+proc nsbdnestlevelDone {nest} {
+    upvar #0 nsbdnestlevel_level_$nest nestlevel
+    upvar #0 nsbdnestlevel_length_$nest nestlength
+    unset nestlevel nestlength
 }
 
 # nsbdnestlevel figures out the nestlevel in a line of an "nsbd" file.
 # parameters are
-#    1. line - the line to parse
-#    2. linelength - the number of bytes in the line
-#    3. lineno - the line number that is being parsed
+#    1. nest - the descriptor returned by nsbdnestlevelInit
+#    2. line - the line to parse
+#    3. linelength - the number of bytes in the line
+#    4. lineno - the line number that is being parsed
 # returns list of two items: the nesting level and the number of characters
 #    of whitespace at the beginning of the line
 # this is a good candidate for writing in C for speed
 # 
 
-proc nsbdnestlevel {line linelength lineno} {
-    upvar #0 nsbdnestlevel_level nestlevel
-    upvar #0 nsbdnestlevel_length nestlength
+proc nsbdnestlevel {nest line linelength lineno} {
+    upvar #0 nsbdnestlevel_level_$nest nestlevel
+    upvar #0 nsbdnestlevel_length_$nest nestlength
+    if {![info exists nestlevel]} {
+	error "invalid nsbdnestlevel descriptor \"$nest\""
+    }
     # nlength is nestlength for this line
     set nlength 0
     # whitechars is number of characters of whitespace (tab counts as 1)
@@ -209,3 +229,128 @@ proc matchpatterns {pat1 pat2} {
     return [expr {$len1 == $len2}]
 }
 
+
+#
+# Table of per-path information, kept in global arrays named after the
+#   descriptor.  See generic/tclpathtab.c for the usage.
+#
+proc pathtable {option args} {
+    global pathtableCount
+    set columns {length digest mode linkTo hardLinkTo mtime loadPath perm
+	group new nonPortable otherLoadPath otherRevreloc backupPath localPath}
+    if {$option == "create"} {
+	if {![info exists pathtableCount]} {
+	    set pathtableCount 0
+	}
+	set table pathtable[incr pathtableCount]
+	upvar #0 ${table}_order order
+	set order ""
+	return $table
+    }
+    set table [lindex $args 0]
+    upvar #0 ${table}_order order ${table}_rows rows ${table}_cells cells
+    if {![info exists order]} {
+	error "invalid pathtable descriptor \"$table\""
+    }
+    set path [lindex $args 1]
+    set column [lindex $args 2]
+    if {($column != "") && ([lsearch -exact $columns $column] < 0)} {
+	error "unknown pathtable column \"$column\""
+    }
+    switch -- $option {
+	delete {
+	    catch {unset order}
+	    catch {unset rows}
+	    catch {unset cells}
+	}
+	paths {
+	    set paths ""
+	    foreach path $order {
+		if {[info exists rows($path)] && ![info exists seen($path)]} {
+		    set seen($path) ""
+		    lappend paths $path
+		}
+	    }
+	    set order $paths
+	    return $paths
+	}
+	size {
+	    return [array size rows]
+	}
+	set {
+	    if {![info exists rows($path)]} {
+		set rows($path) ""
+		lappend order $path
+	    }
+	    return [set cells([list $path $column]) [lindex $args 3]]
+	}
+	get {
+	    if {![info exists cells([list $path $column])]} {
+		error "no $column in pathtable for \"$path\""
+	    }
+	    return $cells([list $path $column])
+	}
+	exists {
+	    if {$column == ""} {
+		return [info exists rows($path)]
+	    }
+	    return [info exists cells([list $path $column])]
+	}
+	unset {
+	    if {$column != ""} {
+		catch {unset cells([list $path $column])}
+	    } elseif {[info exists rows($path)]} {
+		unset rows($path)
+		foreach column $columns {
+		    catch {unset cells([list $path $column])}
+		}
+	    }
+	}
+	default {
+	    error "bad option \"$option\" to pathtable"
+	}
+    }
+}
+
+#
+# Send size bytes from file channel in to channel out, returning the
+#   number of bytes sent.  See sendchannel in nsbdInit.c.
+#
+proc sendchannel {out in size} {
+    set translation [fconfigure $out -translation]
+    fconfigure $out -translation binary
+    set sent [fcopy $in $out -size $size]
+    fconfigure $out -translation $translation
+    if {$sent != $size} {
+	error "file \"$in\" ended [expr {$size - $sent}] bytes early"
+    }
+    return $sent
+}
+
+#
+# Block deltas; see generic/tcldelta.c for the usage.  Scanning for
+#   matching blocks is much too slow in Tcl, so no signatures are ever
+#   written here and a delta is always the whole file as one literal.
+#
+proc blockdelta {option args} {
+    switch -- $option {
+	signature {
+	    return ""
+	}
+	delta {
+	    set in [lindex $args 0]
+	    set out [lindex $args 1]
+	    set start [tell $in]
+	    seek $in 0 end
+	    set size [expr {[tell $in] - $start}]
+	    seek $in $start
+	    if {$size > 0} {
+		puts $out "L $size"
+		fcopy $in $out
+	    }
+	}
+	default {
+	    error "bad option \"$option\" to blockdelta"
+	}
+    }
+}